@@ -10,26 +10,250 @@
 #include <lauxlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdlib.h>
 
 #include "php.h"
+#include "zend_smart_str.h"
 #include "php_luasandbox.h"
 
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#endif
+
+/** The slab allocator size class granularity, which is also the alignment */
+#define LUASANDBOX_SLAB_GRANULE 8
+/** The largest block size which is allocated from slabs */
+#define LUASANDBOX_SLAB_MAX_SIZE 256
+#define LUASANDBOX_SLAB_NUM_CLASSES (LUASANDBOX_SLAB_MAX_SIZE / LUASANDBOX_SLAB_GRANULE)
+/** The size of each slab requested from PHP */
+#define LUASANDBOX_SLAB_SIZE 16384
+
+#define LUASANDBOX_SLAB_CLASS(size) (((size) - 1) / LUASANDBOX_SLAB_GRANULE)
+#define LUASANDBOX_SLAB_CLASS_SIZE(index) (((index) + 1) * LUASANDBOX_SLAB_GRANULE)
+
+typedef struct _luasandbox_slab {
+	struct _luasandbox_slab * next;
+} luasandbox_slab;
+
+#define LUASANDBOX_SLAB_HEADER_SIZE ZEND_MM_ALIGNED_SIZE(sizeof(luasandbox_slab))
+
+/**
+ * The slab allocator state. Blocks of up to LUASANDBOX_SLAB_MAX_SIZE bytes
+ * are carved from large slabs, and kept on a free list for their size class
+ * when they are freed. The slabs are only returned to PHP when the state is
+ * closed.
+ *
+ * Lua always passes the original size of a block to the allocator, so the
+ * size class of a block, and whether it came from a slab, is known without
+ * storing a header.
+ */
+typedef struct _luasandbox_slab_arena {
+	// Freed blocks of each size class, linked through their first word
+	void * free_lists[LUASANDBOX_SLAB_NUM_CLASSES];
+	// The unused part of the newest slab
+	char * next_block;
+	char * end;
+	// All slabs, newest first
+	luasandbox_slab * slabs;
+	// Nonzero while the state is being closed, so that freeing can be skipped
+	int closing;
+} luasandbox_slab_arena;
+
+/**
+ * The state of LUASANDBOX_ALLOCATOR_MMAP. Blocks are carved from a private
+ * anonymous mapping which is reserved when the Lua state is created, and
+ * unmapped in one call when it is closed. The mapping is reserved without
+ * access, and made accessible LUASANDBOX_MMAP_COMMIT_SIZE bytes at a time as
+ * blocks are carved, so that only that part is charged under strict
+ * overcommit accounting. Blocks of up to
+ * LUASANDBOX_SLAB_MAX_SIZE bytes are rounded up to the slab size classes,
+ * larger blocks to a power of two, and freed blocks are kept on a free list
+ * for their class. When the region is full, blocks are allocated with
+ * malloc(), and a block's origin is found by checking its address.
+ *
+ * The malloc() blocks are linked into a list in the region, so that they
+ * can be freed with it. A region of a request-local state is also linked
+ * into the request's list, so that it is freed after a bailout. A region of
+ * a persistent state is allocated from the persistent heap instead, and is
+ * freed when the state is closed.
+ */
+typedef struct _luasandbox_mmap_block {
+	struct _luasandbox_mmap_block * prev;
+	struct _luasandbox_mmap_block * next;
+} luasandbox_mmap_block;
+
+typedef struct _luasandbox_mmap_region {
+	char * base;
+	char * end;
+	// The start of the never used part of the region
+	char * next_block;
+	// The end of the accessible part of the region
+	char * committed;
+	// The blocks allocated with malloc(), newest first
+	luasandbox_mmap_block * blocks;
+	// Nonzero if the region belongs to a persistent state
+	int persistent;
+	// The request's list of regions, see luasandbox_alloc_post_deactivate()
+	struct _luasandbox_mmap_region * prev;
+	struct _luasandbox_mmap_region * next;
+	void * small_free_lists[LUASANDBOX_SLAB_NUM_CLASSES];
+	// Freed large blocks, indexed by log2 of the block size
+	void * large_free_lists[sizeof(size_t) * CHAR_BIT];
+	// Nonzero while the state is being closed, so that freeing can be skipped
+	int closing;
+} luasandbox_mmap_region;
+
+ZEND_EXTERN_MODULE_GLOBALS(luasandbox);
+
 static inline int luasandbox_update_memory_accounting(php_luasandbox_alloc * obj,
 	size_t osize, size_t nsize);
+static inline int luasandbox_check_group_limit(php_luasandbox_group * group,
+	size_t osize, size_t nsize);
+static inline void luasandbox_update_group_accounting(php_luasandbox_group * group,
+	size_t osize, size_t nsize);
 static void *luasandbox_php_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+static void *luasandbox_detached_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+static void luasandbox_slab_destroy(php_luasandbox_alloc * alloc);
+static void luasandbox_alloc_free_stats(php_luasandbox_alloc * alloc);
+static void luasandbox_mmap_create(php_luasandbox_alloc * alloc);
+static void luasandbox_mmap_destroy(php_luasandbox_alloc * alloc);
+static int luasandbox_mmap_commit(luasandbox_mmap_region * region, char * end);
+static void *luasandbox_mmap_realloc(luasandbox_mmap_region * region, void *ptr,
+	size_t osize, size_t nsize);
+static void luasandbox_push_gc_sentinel(lua_State * L);
+static void luasandbox_memory_profiler_sample(php_luasandbox_obj * obj, size_t bytes);
+static int luasandbox_gc_sentinel_finalize(lua_State * L);
+static void *luasandbox_slab_realloc(luasandbox_slab_arena * arena, void *ptr,
+	size_t osize, size_t nsize);
 
 lua_State * luasandbox_alloc_new_state(php_luasandbox_alloc * alloc, php_luasandbox_obj * sandbox)
 {
 	lua_State * L;
+	if (alloc->allocator == LUASANDBOX_ALLOCATOR_SLAB && !alloc->persistent) {
+		alloc->slab = ecalloc(1, sizeof(luasandbox_slab_arena));
+	}
+	if (alloc->allocator == LUASANDBOX_ALLOCATOR_MMAP) {
+		luasandbox_mmap_create(alloc);
+	}
+	if (alloc->collect_stats && !alloc->persistent) {
+		alloc->stats = ecalloc(1, sizeof(luasandbox_alloc_stats));
+	}
 	L = lua_newstate(luasandbox_php_alloc, sandbox);
+	if (!L) {
+		luasandbox_slab_destroy(alloc);
+		luasandbox_mmap_destroy(alloc);
+		luasandbox_alloc_free_stats(alloc);
+	}
 	return L;
 }
 
 void luasandbox_alloc_delete_state(php_luasandbox_alloc * alloc, lua_State * L)
 {
+	if (alloc->slab) {
+		alloc->slab->closing = 1;
+	}
+	if (alloc->region) {
+		alloc->region->closing = 1;
+	}
 	lua_close(L);
+	luasandbox_slab_destroy(alloc);
+	luasandbox_mmap_destroy(alloc);
+	luasandbox_alloc_free_stats(alloc);
+}
+
+static void luasandbox_alloc_free_stats(php_luasandbox_alloc * alloc)
+{
+	if (alloc->stats) {
+		efree(alloc->stats);
+		alloc->stats = NULL;
+	}
 }
 
+/**
+ * Make a persistent state which was detached with
+ * luasandbox_alloc_detach_state() allocate on behalf of the given sandbox.
+ * The caller is responsible for copying the allocator state into
+ * sandbox->alloc.
+ */
+void luasandbox_alloc_attach_state(php_luasandbox_alloc * alloc, lua_State * L,
+	php_luasandbox_obj * sandbox)
+{
+	lua_setallocf(L, luasandbox_php_alloc, sandbox);
+}
+
+/**
+ * Detach a persistent state from its sandbox object, so that it can outlive
+ * the request. The alloc struct must remain valid until the state is
+ * attached again or closed.
+ */
+void luasandbox_alloc_detach_state(php_luasandbox_alloc * alloc, lua_State * L)
+{
+	alloc->memory_limit = (size_t)-1;
+	alloc->soft_memory_limit = (size_t)-1;
+	lua_setallocf(L, luasandbox_detached_alloc, alloc);
+}
+
+/**
+ * Set up the counting of garbage collection cycles in a new state. An
+ * unreachable userdata, the sentinel, is freed at the end of each cycle. Its
+ * finalizer counts the cycle and creates the sentinel for the next one.
+ */
+void luasandbox_alloc_gc_init(lua_State * L)
+{
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, luasandbox_gc_sentinel_finalize);
+	lua_setfield(L, -2, "__gc");
+	lua_setfield(L, LUA_REGISTRYINDEX, "php_luasandbox_gc_sentinel");
+	luasandbox_push_gc_sentinel(L);
+	lua_pop(L, 1);
+}
+
+/** {{{ luasandbox_push_gc_sentinel */
+static void luasandbox_push_gc_sentinel(lua_State * L)
+{
+	lua_newuserdata(L, 1);
+	lua_getfield(L, LUA_REGISTRYINDEX, "php_luasandbox_gc_sentinel");
+	lua_setmetatable(L, -2);
+}
+/* }}} */
+
+/** {{{ luasandbox_gc_sentinel_finalize
+ *
+ * The __gc metamethod of the sentinel. The allocator state is found through
+ * the allocator function, since a persistent state may be detached from its
+ * LuaSandbox object.
+ */
+static int luasandbox_gc_sentinel_finalize(lua_State * L)
+{
+	void * ud;
+	php_luasandbox_alloc * alloc;
+	size_t old_memory_limit;
+
+	if (lua_getallocf(L, &ud) == luasandbox_php_alloc) {
+		alloc = &((php_luasandbox_obj*)ud)->alloc;
+	} else {
+		alloc = (php_luasandbox_alloc*)ud;
+	}
+	alloc->gc_cycles++;
+
+	// Don't let the memory limit raise an error in the collector
+	old_memory_limit = alloc->memory_limit;
+	alloc->memory_limit = (size_t)-1;
+	alloc->limit_lifted++;
+	luasandbox_push_gc_sentinel(L);
+	lua_pop(L, 1);
+	alloc->limit_lifted--;
+	alloc->memory_limit = old_memory_limit;
+	return 0;
+}
+/* }}} */
+
 
 /** {{{ luasandbox_update_memory_accounting
  *
@@ -46,42 +270,340 @@ static inline int luasandbox_update_memory_accounting(php_luasandbox_alloc * all
 		return 0;
 	}
 
-	if (osize > nsize && alloc->memory_usage + nsize < osize) {
-		// Negative memory usage -- do not update
-		return 1;
+	if (osize > nsize) {
+		alloc->released_bytes += osize - nsize;
+		if (alloc->memory_usage + nsize < osize) {
+			// Negative memory usage -- do not update
+			return 1;
+		}
 	}
 
 	alloc->memory_usage += nsize - osize;
-	if (alloc->memory_usage > alloc->peak_memory_usage) {
-		alloc->peak_memory_usage = alloc->memory_usage;
+	// The lifetime peak is never less than the call peak
+	if (alloc->memory_usage > alloc->call_peak_usage) {
+		alloc->call_peak_usage = alloc->memory_usage;
+		if (alloc->memory_usage > alloc->peak_memory_usage) {
+			alloc->peak_memory_usage = alloc->memory_usage;
+		}
 	}
 	return 1;
 }
 /* }}} */
 
-/** {{{ luasandbox_update_gc_pause
- * Scale the GC pause size so that collection will start before an OOM occurs (T349462)
+/** {{{ luasandbox_check_group_limit
+ *
+ * Returns 1 if the allocation request fits in the group's memory limit, 0
+ * if it should fail.
  */
-static inline void luasandbox_update_gc_pause(lua_State * L, php_luasandbox_alloc * alloc)
+static inline int luasandbox_check_group_limit(php_luasandbox_group * group,
+	size_t osize, size_t nsize)
+{
+	return nsize <= osize || (nsize - osize <= group->memory_limit
+		&& group->memory_usage + (nsize - osize) <= group->memory_limit);
+}
+/* }}} */
+
+/** {{{ luasandbox_update_group_accounting
+ *
+ * Charge an allocation request which has passed the sandbox's own limit to
+ * its group.
+ */
+static inline void luasandbox_update_group_accounting(php_luasandbox_group * group,
+	size_t osize, size_t nsize)
+{
+	if (osize > nsize && group->memory_usage + nsize < osize) {
+		// Negative memory usage -- do not update
+		return;
+	}
+	group->memory_usage += nsize - osize;
+	if (group->memory_usage > group->peak_memory_usage) {
+		group->peak_memory_usage = group->memory_usage;
+	}
+}
+/* }}} */
+
+/** {{{ luasandbox_recompute_gc_pause
+ *
+ * Scale the GC pause size so that collection will start before an OOM occurs
+ * (T349462), and find the usage band in which it applies. The memory limit is
+ * divided into gc_bands equal bands. In a group, the limit is the smaller of
+ * the sandbox limit and what the group limit leaves for this sandbox.
+ */
+static void luasandbox_recompute_gc_pause(lua_State * L, php_luasandbox_alloc * alloc)
 {
 	size_t limit = alloc->memory_limit;
 	size_t usage = alloc->memory_usage;
+	size_t width, pause;
+	php_luasandbox_group * group = alloc->group;
+
+	// The state is still being created. Leave the band stale, so that the
+	// first allocation after lua_newstate() returns sets the pause.
+	if (!L) {
+		return;
+	}
+
+	// The group's headroom is only sampled here, when this sandbox's usage
+	// leaves its band, not when the other members allocate
+	if (group && usage <= limit && group->memory_usage <= group->memory_limit
+		&& group->memory_limit - group->memory_usage < limit - usage)
+	{
+		limit = usage + (group->memory_limit - group->memory_usage);
+	}
+	alloc->gc_band_limit = alloc->memory_limit;
+	alloc->gc_band_group_limit = group ? group->memory_limit : 0;
 
-	// Guard against overflow and division by zero
-	if (limit >= SIZE_MAX / 90 || usage == 0) {
+	// Guard against overflow. Without a limit there is no OOM to avoid, so
+	// use the ceiling, which the constructor has already clamped to be at
+	// least the floor.
+	if (limit >= SIZE_MAX / 90) {
+		alloc->gc_band_low = 0;
+		alloc->gc_band_high = SIZE_MAX;
+		lua_gc(L, LUA_GCSETPAUSE, alloc->gc_pause_ceiling);
 		return;
 	}
-	size_t pause = limit * 90 / usage;
-	if (pause > 200) {
-		pause = 200;
+
+	width = limit / alloc->gc_bands;
+	if (width == 0) {
+		width = 1;
+	}
+	alloc->gc_band_low = usage - usage % width;
+	alloc->gc_band_high = alloc->gc_band_low + width;
+
+	pause = usage ? limit * 90 / usage : (size_t)alloc->gc_pause_ceiling;
+	if (pause > (size_t)alloc->gc_pause_ceiling) {
+		pause = alloc->gc_pause_ceiling;
+	}
+	if (pause < (size_t)alloc->gc_pause_floor) {
+		pause = alloc->gc_pause_floor;
 	}
 	lua_gc(L, LUA_GCSETPAUSE, (int)pause);
 }
 /* }}} */
 
+/** {{{ luasandbox_update_gc_pause
+ *
+ * Update the GC pause if the usage has left its band or the limit has changed
+ */
+static inline void luasandbox_update_gc_pause(lua_State * L, php_luasandbox_alloc * alloc)
+{
+	if (alloc->memory_usage < alloc->gc_band_low
+		|| alloc->memory_usage >= alloc->gc_band_high
+		|| alloc->memory_limit != alloc->gc_band_limit
+		|| (alloc->group && alloc->group->memory_limit != alloc->gc_band_group_limit))
+	{
+		luasandbox_recompute_gc_pause(L, alloc);
+	}
+}
+/* }}} */
+
+/** {{{ luasandbox_log2
+ *
+ * Get the index of the highest set bit of a nonzero size
+ */
+static inline int luasandbox_log2(size_t n)
+{
+#if defined(__GNUC__)
+	return (int)(sizeof(unsigned long) * CHAR_BIT - 1) - __builtin_clzl((unsigned long)n);
+#else
+	int i = 0;
+	while (n >>= 1) {
+		i++;
+	}
+	return i;
+#endif
+}
+/* }}} */
+
+/** {{{ luasandbox_update_alloc_stats
+ *
+ * Count an allocation request which has passed the memory limit check
+ */
+static inline void luasandbox_update_alloc_stats(luasandbox_alloc_stats * stats,
+	void *ptr, size_t osize, size_t nsize)
+{
+	int bucket;
+
+	if (nsize == 0) {
+		if (ptr) {
+			stats->frees++;
+		}
+		return;
+	}
+	if (ptr) {
+		stats->reallocations++;
+		if (nsize > osize) {
+			stats->bytes_allocated += nsize - osize;
+		}
+	} else {
+		stats->allocations++;
+		stats->bytes_allocated += nsize;
+	}
+	bucket = luasandbox_log2(nsize);
+	if (bucket >= LUASANDBOX_ALLOC_HISTOGRAM_SIZE) {
+		bucket = LUASANDBOX_ALLOC_HISTOGRAM_SIZE - 1;
+	}
+	stats->histogram[bucket]++;
+}
+/* }}} */
+
+/** {{{ luasandbox_memory_profiler_enable
+ *
+ * Start sampling allocations every interval bytes, discarding any previous
+ * report
+ */
+void luasandbox_memory_profiler_enable(php_luasandbox_obj * sandbox, size_t interval)
+{
+	luasandbox_memory_profiler * mp;
+
+	luasandbox_memory_profiler_disable(sandbox);
+	mp = emalloc(sizeof(luasandbox_memory_profiler));
+	mp->interval = mp->countdown = interval;
+	ALLOC_HASHTABLE(mp->function_bytes);
+	zend_hash_init(mp->function_bytes, 0, NULL, NULL, 0);
+	ALLOC_HASHTABLE(mp->stack_bytes);
+	zend_hash_init(mp->stack_bytes, 0, NULL, NULL, 0);
+	sandbox->memory_profiler = mp;
+}
+/* }}} */
+
+/** {{{ luasandbox_memory_profiler_disable
+ *
+ * Stop sampling and free the report
+ */
+void luasandbox_memory_profiler_disable(php_luasandbox_obj * sandbox)
+{
+	luasandbox_memory_profiler * mp = sandbox->memory_profiler;
+
+	if (mp) {
+		zend_hash_destroy(mp->function_bytes);
+		FREE_HASHTABLE(mp->function_bytes);
+		zend_hash_destroy(mp->stack_bytes);
+		FREE_HASHTABLE(mp->stack_bytes);
+		efree(mp);
+		sandbox->memory_profiler = NULL;
+	}
+}
+/* }}} */
+
+/** {{{ luasandbox_memory_profiler_count
+ *
+ * Count bytes allocated, and take a sample each time another interval has
+ * been allocated. A sample of a large allocation which spans several
+ * intervals is weighted accordingly.
+ */
+static inline void luasandbox_memory_profiler_count(php_luasandbox_obj * obj, size_t size)
+{
+	luasandbox_memory_profiler * mp = obj->memory_profiler;
+	size_t samples;
+
+	if (size < mp->countdown) {
+		mp->countdown -= size;
+		return;
+	}
+	size -= mp->countdown;
+	samples = 1 + size / mp->interval;
+	mp->countdown = mp->interval - size % mp->interval;
+	if (obj->in_lua) {
+		luasandbox_memory_profiler_sample(obj, samples * mp->interval);
+	}
+}
+/* }}} */
+
+/** {{{ luasandbox_memory_profiler_fail
+ *
+ * Sample an allocation which was denied by a memory limit. It is always
+ * sampled, since it is usually the one the report is wanted for, and
+ * weighted as the number of intervals it would have spanned. The bytes were
+ * never allocated, so the countdown is left alone.
+ */
+static void luasandbox_memory_profiler_fail(php_luasandbox_obj * obj, size_t size)
+{
+	luasandbox_memory_profiler * mp = obj->memory_profiler;
+
+	if (obj->in_lua && size) {
+		luasandbox_memory_profiler_sample(obj,
+			(1 + (size - 1) / mp->interval) * mp->interval);
+	}
+}
+/* }}} */
+
+/** {{{ luasandbox_memory_profiler_add
+ *
+ * Add bytes to the count for a name in a memory profiler report
+ */
+static void luasandbox_memory_profiler_add(HashTable * ht, zend_string * name, size_t bytes)
+{
+	zval * elt;
+
+	elt = zend_hash_find(ht, name);
+	if (elt != NULL) {
+		ZVAL_LONG(elt, Z_LVAL_P(elt) + (zend_long)bytes);
+	} else {
+		zval v;
+		ZVAL_LONG(&v, (zend_long)bytes);
+		zend_hash_add(ht, name, &v);
+	}
+}
+/* }}} */
+
+/** {{{ luasandbox_memory_profiler_sample
+ *
+ * Attribute the given number of bytes to the running Lua function, and to
+ * the call stack leading to it. This is called from the allocator, possibly
+ * while the Lua stack is being resized, so nothing may be pushed on to the
+ * stack: only lua_getinfo() options which read the call info are used.
+ */
+static void luasandbox_memory_profiler_sample(php_luasandbox_obj * obj, size_t bytes)
+{
+	luasandbox_memory_profiler * mp = obj->memory_profiler;
+	lua_Debug ar;
+	smart_str stack = {0};
+	zend_string * name;
+	int depth, level;
+
+	if (!obj->state) {
+		return;
+	}
+	memset(&ar, 0, sizeof(ar));
+	for (depth = 0; depth < LUASANDBOX_MEMORY_PROFILER_MAX_DEPTH; depth++) {
+		if (!lua_getstack(obj->state, depth, &ar)) {
+			break;
+		}
+	}
+	if (depth == 0) {
+		return;
+	}
+	if (depth == LUASANDBOX_MEMORY_PROFILER_MAX_DEPTH
+		&& lua_getstack(obj->state, depth, &ar))
+	{
+		// Mark the stack as truncated
+		smart_str_appends(&stack, "...");
+	}
+
+	for (level = depth - 1; level >= 0; level--) {
+		lua_getstack(obj->state, level, &ar);
+		lua_getinfo(obj->state, "Sn", &ar);
+		name = luasandbox_format_function_name(&ar, NULL);
+		if (stack.s) {
+			smart_str_appendc(&stack, ';');
+		}
+		smart_str_append(&stack, name);
+		if (level == 0) {
+			luasandbox_memory_profiler_add(mp->function_bytes, name, bytes);
+		}
+		zend_string_release(name);
+	}
+
+	smart_str_0(&stack);
+	luasandbox_memory_profiler_add(mp->stack_bytes, stack.s, bytes);
+	smart_str_free(&stack);
+}
+/* }}} */
+
 /** {{{ luasandbox_php_alloc
  *
- * The Lua allocator function. Use PHP's request-local allocator as a backend.
+ * The Lua allocator function. Use PHP's request-local allocator as a backend,
+ * or the persistent allocator for states created by LuaSandbox::getPersistent().
  * Account for memory usage and deny the allocation request if the amount
  * allocated is above the user-specified limit.
  */
@@ -90,27 +612,489 @@ static void *luasandbox_php_alloc(void *ud, void *ptr, size_t osize, size_t nsiz
 	php_luasandbox_obj * obj = (php_luasandbox_obj*)ud;
 	void * nptr;
 	obj->in_php ++;
+	// The group limit is enforced wherever the sandbox limit is, including
+	// while loading chunks and converting arguments. Creating and resetting a
+	// sandbox, and handling its errors, lift both limits.
+	if (obj->alloc.group && !obj->alloc.limit_lifted
+		&& !luasandbox_check_group_limit(obj->alloc.group, osize, nsize))
+	{
+		if (obj->memory_profiler && nsize > osize) {
+			luasandbox_memory_profiler_fail(obj, nsize - osize);
+		}
+		obj->in_php --;
+		return NULL;
+	}
 	if (!luasandbox_update_memory_accounting(&obj->alloc, osize, nsize)) {
+		if (obj->memory_profiler && nsize > osize) {
+			luasandbox_memory_profiler_fail(obj, nsize - osize);
+		}
 		obj->in_php --;
 		return NULL;
 	}
+	if (obj->alloc.group) {
+		luasandbox_update_group_accounting(obj->alloc.group, osize, nsize);
+	}
 
 	luasandbox_update_gc_pause(obj->state, &obj->alloc);
+	if (obj->alloc.stats) {
+		luasandbox_update_alloc_stats(obj->alloc.stats, ptr, osize, nsize);
+	}
+	if (obj->alloc.memory_usage > obj->alloc.soft_memory_limit) {
+		if (!obj->soft_limit_handled) {
+			luasandbox_soft_limit_exceeded(obj);
+		}
+	} else if (obj->soft_limit_handled) {
+		obj->soft_limit_handled = 0;
+	}
+	// Sample before the block is moved, since it may be the Lua stack
+	if (obj->memory_profiler && nsize > osize) {
+		luasandbox_memory_profiler_count(obj, nsize - osize);
+	}
 
-	if (nsize == 0) {
+	if (obj->alloc.slab) {
+		nptr = luasandbox_slab_realloc(obj->alloc.slab, ptr, osize, nsize);
+	} else if (obj->alloc.region) {
+		nptr = luasandbox_mmap_realloc(obj->alloc.region, ptr, osize, nsize);
+	} else if (nsize == 0) {
 		if (ptr) {
-			efree(ptr);
+			pefree(ptr, obj->alloc.persistent);
 		}
 		nptr = NULL;
 	} else if (osize == 0) {
-		nptr = ecalloc(1, nsize);
+		// Lua initialises everything it allocates, so don't zero the memory
+		nptr = pemalloc(nsize, obj->alloc.persistent);
 	} else {
-		nptr = erealloc(ptr, nsize);
-		if (nsize > osize) {
-			memset(nptr + osize, 0, nsize - osize);
-		}
+		nptr = perealloc(ptr, nsize, obj->alloc.persistent);
 	}
 	obj->in_php --;
 	return nptr;
 }
 /* }}} */
+
+/** {{{ luasandbox_detached_alloc
+ *
+ * The allocator for persistent states while they are not attached to a
+ * LuaSandbox object, for example while they are being closed at shutdown.
+ * There is no PHP object to report to, so only the usage is tracked.
+ */
+static void *luasandbox_detached_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	php_luasandbox_alloc * alloc = (php_luasandbox_alloc*)ud;
+
+	luasandbox_update_memory_accounting(alloc, osize, nsize);
+	if (alloc->region) {
+		return luasandbox_mmap_realloc(alloc->region, ptr, osize, nsize);
+	}
+	if (nsize == 0) {
+		if (ptr) {
+			pefree(ptr, 1);
+		}
+		return NULL;
+	}
+	return perealloc(ptr, nsize, 1);
+}
+/* }}} */
+
+/** {{{ luasandbox_slab_destroy
+ *
+ * Return all slabs to PHP and free the slab allocator state
+ */
+static void luasandbox_slab_destroy(php_luasandbox_alloc * alloc)
+{
+	luasandbox_slab * slab, * next;
+
+	if (!alloc->slab) {
+		return;
+	}
+	for (slab = alloc->slab->slabs; slab; slab = next) {
+		next = slab->next;
+		efree(slab);
+	}
+	efree(alloc->slab);
+	alloc->slab = NULL;
+}
+/* }}} */
+
+/** {{{ luasandbox_slab_alloc
+ *
+ * Allocate a block of at most LUASANDBOX_SLAB_MAX_SIZE bytes. The memory is
+ * not zeroed, Lua does not need it to be.
+ */
+static void *luasandbox_slab_alloc(luasandbox_slab_arena * arena, size_t size)
+{
+	int index = LUASANDBOX_SLAB_CLASS(size);
+	size_t block_size = LUASANDBOX_SLAB_CLASS_SIZE(index);
+	size_t remaining;
+	luasandbox_slab * slab;
+	void * block = arena->free_lists[index];
+
+	if (block) {
+		arena->free_lists[index] = *(void**)block;
+		return block;
+	}
+
+	remaining = arena->end - arena->next_block;
+	if (remaining < block_size) {
+		// Keep the rest of the old slab as a free block. It is a multiple of
+		// the granule, so it fits its size class exactly.
+		if (remaining) {
+			int rest = LUASANDBOX_SLAB_CLASS(remaining);
+			*(void**)arena->next_block = arena->free_lists[rest];
+			arena->free_lists[rest] = arena->next_block;
+		}
+		slab = (luasandbox_slab*)emalloc(LUASANDBOX_SLAB_SIZE);
+		slab->next = arena->slabs;
+		arena->slabs = slab;
+		arena->next_block = (char*)slab + LUASANDBOX_SLAB_HEADER_SIZE;
+		arena->end = (char*)slab + LUASANDBOX_SLAB_SIZE;
+	}
+	block = arena->next_block;
+	arena->next_block += block_size;
+	return block;
+}
+/* }}} */
+
+/** {{{ luasandbox_slab_free
+ *
+ * Put a block allocated by luasandbox_slab_alloc() on its free list
+ */
+static inline void luasandbox_slab_free(luasandbox_slab_arena * arena, void *ptr, size_t size)
+{
+	int index;
+
+	if (arena->closing) {
+		// The whole slab will be freed
+		return;
+	}
+	index = LUASANDBOX_SLAB_CLASS(size);
+	*(void**)ptr = arena->free_lists[index];
+	arena->free_lists[index] = ptr;
+}
+/* }}} */
+
+/** {{{ luasandbox_slab_realloc
+ *
+ * The allocation backend for LUASANDBOX_ALLOCATOR_SLAB, with the semantics
+ * of lua_Alloc. Small blocks come from slabs, larger blocks from emalloc().
+ */
+static void *luasandbox_slab_realloc(luasandbox_slab_arena * arena, void *ptr,
+	size_t osize, size_t nsize)
+{
+	int old_small = ptr && osize <= LUASANDBOX_SLAB_MAX_SIZE;
+	int new_small = nsize <= LUASANDBOX_SLAB_MAX_SIZE;
+	void * nptr;
+
+	if (nsize == 0) {
+		if (old_small) {
+			luasandbox_slab_free(arena, ptr, osize);
+		} else if (ptr) {
+			efree(ptr);
+		}
+		return NULL;
+	}
+	if (old_small && new_small
+		&& LUASANDBOX_SLAB_CLASS(osize) == LUASANDBOX_SLAB_CLASS(nsize))
+	{
+		return ptr;
+	}
+	if (ptr && !old_small && !new_small) {
+		return erealloc(ptr, nsize);
+	}
+
+	nptr = new_small ? luasandbox_slab_alloc(arena, nsize) : emalloc(nsize);
+	if (ptr) {
+		memcpy(nptr, ptr, osize < nsize ? osize : nsize);
+		if (old_small) {
+			luasandbox_slab_free(arena, ptr, osize);
+		} else {
+			efree(ptr);
+		}
+	}
+	return nptr;
+}
+/* }}} */
+
+/** {{{ luasandbox_mmap_create
+ *
+ * Reserve the region for LUASANDBOX_ALLOCATOR_MMAP. Pages are only made
+ * accessible when blocks are carved from them. If the region can't be
+ * mapped, it is left empty, and all blocks will come from malloc().
+ */
+static void luasandbox_mmap_create(php_luasandbox_alloc * alloc)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+	luasandbox_mmap_region * region;
+	void * base;
+
+	region = pecalloc(1, sizeof(luasandbox_mmap_region), alloc->persistent);
+	region->persistent = alloc->persistent;
+	base = mmap(NULL, alloc->region_size, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (base == MAP_FAILED) {
+		php_error_docref(NULL, E_WARNING,
+			"unable to map %zu bytes for the Lua heap, using malloc()", alloc->region_size);
+	} else {
+#ifdef MADV_HUGEPAGE
+		if (alloc->huge_pages) {
+			madvise(base, alloc->region_size, MADV_HUGEPAGE);
+		}
+#endif
+		region->base = region->next_block = region->committed = (char*)base;
+		region->end = region->base + alloc->region_size;
+	}
+	if (!region->persistent) {
+		region->next = LUASANDBOX_G(mmap_regions);
+		if (region->next) {
+			region->next->prev = region;
+		}
+		LUASANDBOX_G(mmap_regions) = region;
+	}
+	alloc->region = region;
+#endif
+}
+/* }}} */
+
+/** {{{ luasandbox_mmap_unmap
+ *
+ * Unmap a region, and free the blocks allocated with malloc() and the
+ * region structure
+ */
+static void luasandbox_mmap_unmap(luasandbox_mmap_region * region)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+	luasandbox_mmap_block * block, * next;
+
+	if (!region->persistent) {
+		if (region->prev) {
+			region->prev->next = region->next;
+		} else {
+			LUASANDBOX_G(mmap_regions) = region->next;
+		}
+		if (region->next) {
+			region->next->prev = region->prev;
+		}
+	}
+	for (block = region->blocks; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+	if (region->base) {
+		munmap(region->base, region->end - region->base);
+	}
+	pefree(region, region->persistent);
+#endif
+}
+/* }}} */
+
+/** {{{ luasandbox_mmap_destroy
+ *
+ * Unmap the region and free everything allocated from it
+ */
+static void luasandbox_mmap_destroy(php_luasandbox_alloc * alloc)
+{
+	if (!alloc->region) {
+		return;
+	}
+	luasandbox_mmap_unmap(alloc->region);
+	alloc->region = NULL;
+}
+/* }}} */
+
+/** {{{ luasandbox_alloc_post_deactivate
+ *
+ * Unmap the regions of sandboxes which were not freed, because the request
+ * was aborted by a bailout, along with their malloc() blocks. This is called
+ * after the executor is shut down, when no Lua state can use them any more.
+ * The regions of persistent states are not in the list.
+ */
+void luasandbox_alloc_post_deactivate()
+{
+	while (LUASANDBOX_G(mmap_regions)) {
+		luasandbox_mmap_unmap(LUASANDBOX_G(mmap_regions));
+	}
+}
+/* }}} */
+
+/** {{{ luasandbox_mmap_commit
+ *
+ * Make the region accessible up to at least the given address. Returns 0 if
+ * the kernel refused, for example because the commit limit was reached.
+ */
+static int luasandbox_mmap_commit(luasandbox_mmap_region * region, char * end)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+	size_t size;
+
+	if (end <= region->committed) {
+		return 1;
+	}
+	size = end - region->committed;
+	size = (size + LUASANDBOX_MMAP_COMMIT_SIZE - 1) / LUASANDBOX_MMAP_COMMIT_SIZE
+		* LUASANDBOX_MMAP_COMMIT_SIZE;
+	if (size > (size_t)(region->end - region->committed)) {
+		size = region->end - region->committed;
+	}
+	if (mprotect(region->committed, size, PROT_READ | PROT_WRITE) != 0) {
+		return 0;
+	}
+	region->committed += size;
+	return 1;
+#else
+	return 0;
+#endif
+}
+/* }}} */
+
+/** {{{ luasandbox_mmap_free_list
+ *
+ * Get the free list for blocks of the given requested size, and round the
+ * size up to the block size
+ */
+static inline void ** luasandbox_mmap_free_list(luasandbox_mmap_region * region, size_t * size)
+{
+	int index;
+
+	if (*size <= LUASANDBOX_SLAB_MAX_SIZE) {
+		index = LUASANDBOX_SLAB_CLASS(*size);
+		*size = LUASANDBOX_SLAB_CLASS_SIZE(index);
+		return &region->small_free_lists[index];
+	}
+	index = luasandbox_log2(*size - 1) + 1;
+	*size = (size_t)1 << index;
+	return &region->large_free_lists[index];
+}
+/* }}} */
+
+/** {{{ luasandbox_mmap_link_block
+ *
+ * Add a block allocated with malloc() to the region's list
+ */
+static inline void luasandbox_mmap_link_block(luasandbox_mmap_region * region,
+	luasandbox_mmap_block * block)
+{
+	block->prev = NULL;
+	block->next = region->blocks;
+	if (block->next) {
+		block->next->prev = block;
+	}
+	region->blocks = block;
+}
+/* }}} */
+
+/** {{{ luasandbox_mmap_unlink_block */
+static inline void luasandbox_mmap_unlink_block(luasandbox_mmap_region * region,
+	luasandbox_mmap_block * block)
+{
+	if (block->prev) {
+		block->prev->next = block->next;
+	} else {
+		region->blocks = block->next;
+	}
+	if (block->next) {
+		block->next->prev = block->prev;
+	}
+}
+/* }}} */
+
+/** {{{ luasandbox_mmap_block_realloc
+ *
+ * Allocate, resize or free a block outside the region with malloc(). The
+ * list header is stored before the block; two pointers keep the alignment
+ * that malloc() gives for Lua's objects.
+ */
+static void *luasandbox_mmap_block_realloc(luasandbox_mmap_region * region, void *ptr,
+	size_t nsize)
+{
+	luasandbox_mmap_block * block = NULL, * nblock;
+
+	if (ptr) {
+		block = (luasandbox_mmap_block*)ptr - 1;
+		luasandbox_mmap_unlink_block(region, block);
+	}
+	if (nsize == 0) {
+		free(block);
+		return NULL;
+	}
+	nblock = realloc(block, sizeof(luasandbox_mmap_block) + nsize);
+	if (!nblock) {
+		if (block) {
+			luasandbox_mmap_link_block(region, block);
+		}
+		return NULL;
+	}
+	luasandbox_mmap_link_block(region, nblock);
+	return nblock + 1;
+}
+/* }}} */
+
+/** {{{ luasandbox_mmap_in_region */
+static inline int luasandbox_mmap_in_region(luasandbox_mmap_region * region, void * ptr)
+{
+	return region->base && (char*)ptr >= region->base && (char*)ptr < region->end;
+}
+/* }}} */
+
+/** {{{ luasandbox_mmap_realloc
+ *
+ * The allocation backend for LUASANDBOX_ALLOCATOR_MMAP, with the semantics
+ * of lua_Alloc. This uses malloc() rather than the request heap, so that
+ * the Lua heap is not counted against the PHP memory limit.
+ */
+static void *luasandbox_mmap_realloc(luasandbox_mmap_region * region, void *ptr,
+	size_t osize, size_t nsize)
+{
+	int old_in_region = ptr && luasandbox_mmap_in_region(region, ptr);
+	size_t old_block_size = osize, new_block_size = nsize;
+	void ** old_list = NULL, ** new_list;
+	void * nptr = NULL;
+
+	if (old_in_region) {
+		old_list = luasandbox_mmap_free_list(region, &old_block_size);
+	}
+	if (nsize == 0) {
+		if (old_in_region) {
+			if (!region->closing) {
+				*(void**)ptr = *old_list;
+				*old_list = ptr;
+			}
+		} else if (ptr) {
+			luasandbox_mmap_block_realloc(region, ptr, 0);
+		}
+		return NULL;
+	}
+
+	new_list = luasandbox_mmap_free_list(region, &new_block_size);
+	if (old_in_region && new_list == old_list) {
+		return ptr;
+	}
+	if (*new_list) {
+		nptr = *new_list;
+		*new_list = *(void**)nptr;
+	} else if ((size_t)(region->end - region->next_block) >= new_block_size
+		&& luasandbox_mmap_commit(region, region->next_block + new_block_size))
+	{
+		nptr = region->next_block;
+		region->next_block += new_block_size;
+	}
+	if (!nptr) {
+		if (ptr && !old_in_region) {
+			return luasandbox_mmap_block_realloc(region, ptr, nsize);
+		}
+		nptr = luasandbox_mmap_block_realloc(region, NULL, nsize);
+		if (!nptr) {
+			return NULL;
+		}
+	}
+
+	if (ptr) {
+		memcpy(nptr, ptr, osize < nsize ? osize : nsize);
+		if (old_in_region) {
+			*(void**)ptr = *old_list;
+			*old_list = ptr;
+		} else {
+			luasandbox_mmap_block_realloc(region, ptr, 0);
+		}
+	}
+	return nptr;
+}
+/* }}} */
@@ -0,0 +1,69 @@
+<?php
+/**
+ * Lua workloads which are dominated by allocation, with each allocator
+ */
+
+$workloads = [
+	'small-tables' => '
+		local t = {}
+		for i = 1, 1000 do
+			t[i] = { i, tostring( i ) }
+		end
+	',
+	'table-insert' => '
+		local t = {}
+		for i = 1, 20000 do
+			table.insert( t, i )
+		end
+	',
+	// Growing the hash part allocates a new node vector each time, and
+	// discards the old one, so this is dominated by fresh large blocks
+	'hash-resize' => '
+		for i = 1, 10 do
+			local t = {}
+			for j = 1, 5000 do
+				t[j + 0.5] = j
+			end
+		end
+	',
+	'string-rep' => '
+		for i = 1, 100 do
+			local s = string.rep( "x", 10000 + i )
+		end
+	',
+	'string-concat' => '
+		local s = ""
+		for i = 1, 1000 do
+			s = s .. "x"
+		end
+	',
+	'closures' => '
+		local t = {}
+		for i = 1, 1000 do
+			t[i] = function () return i end
+		end
+	',
+];
+
+$benchWorkload = static function ( $code, array $options ) {
+	return static function ( $n ) use ( $code, $options ) {
+		$sandbox = new LuaSandbox( $options );
+		$func = $sandbox->loadString( $code );
+		$start = bench_now();
+		for ( $i = 0; $i < $n; $i++ ) {
+			$func->call();
+		}
+		return [
+			'callsPerSec' => $n / ( bench_now() - $start ),
+		];
+	};
+};
+
+$benchmarks = [];
+foreach ( $workloads as $name => $code ) {
+	foreach ( [ 'default', 'slab', 'mmap' ] as $allocator ) {
+		$benchmarks["allocator-$name-$allocator"] =
+			$benchWorkload( $code, [ 'allocator' => $allocator ] );
+	}
+}
+return $benchmarks;
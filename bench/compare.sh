@@ -0,0 +1,49 @@
+#!/bin/sh
+# Build LuaSandbox at a git revision and from the working tree, run the
+# benchmarks against both builds, and print the results of the working tree
+# with the percentage change from the revision.
+#
+# Usage:
+#   bench/compare.sh REVISION [run.php arguments ...]
+#
+# For example, to measure the construction time before and after a commit:
+#   bench/compare.sh abc1234^ --iterations=5000 construct
+#
+# The benchmark scripts of the working tree are used for both builds, so
+# options which the older build does not know may raise warnings. The older
+# build is made in a temporary worktree, which is removed afterwards.
+
+set -e
+
+if [ $# -lt 1 ]; then
+	echo "Usage: $0 REVISION [run.php arguments ...]" >&2
+	exit 1
+fi
+rev=$1
+shift
+
+top=$(git rev-parse --show-toplevel)
+tmp=$(mktemp -d)
+cleanup() {
+	git -C "$top" worktree remove --force "$tmp/old" >/dev/null 2>&1 || true
+	rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+build() {
+	(
+		cd "$1"
+		phpize >/dev/null
+		./configure >/dev/null
+		make >/dev/null
+	)
+}
+
+git -C "$top" worktree add --detach "$tmp/old" "$rev" >/dev/null
+build "$tmp/old"
+build "$top"
+
+php -d extension="$tmp/old/modules/luasandbox.so" "$top/bench/run.php" "$@" \
+	> "$tmp/before.json"
+php -d extension="$top/modules/luasandbox.so" "$top/bench/run.php" \
+	--baseline="$tmp/before.json" "$@"
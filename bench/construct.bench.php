@@ -0,0 +1,39 @@
+<?php
+/**
+ * Construction and destruction of sandboxes, with each constructor profile
+ */
+
+$benchConstruct = static function ( array $options ) {
+	return static function ( $n ) use ( $options ) {
+		$start = bench_now();
+		for ( $i = 0; $i < $n; $i++ ) {
+			$sandbox = new LuaSandbox( $options );
+			unset( $sandbox );
+		}
+		$elapsed = bench_now() - $start;
+
+		// Keep some sandboxes alive to see how much of the PHP memory limit
+		// each one uses
+		$count = min( $n, 100 );
+		$sandboxes = [];
+		$before = memory_get_usage();
+		for ( $i = 0; $i < $count; $i++ ) {
+			$sandboxes[] = new LuaSandbox( $options );
+		}
+		$phpBytes = ( memory_get_usage() - $before ) / $count;
+
+		return [
+			'constructionsPerSec' => $n / $elapsed,
+			'luaBytesPerState' => $sandboxes[0]->getMemoryUsage(),
+			'phpBytesPerSandbox' => $phpBytes,
+		];
+	};
+};
+
+return [
+	'construct' => $benchConstruct( [] ),
+	'construct-lazy' => $benchConstruct( [ 'lazyLibraries' => true ] ),
+	'construct-slim' => $benchConstruct( [ 'profile' => 'slim' ] ),
+	'construct-slab' => $benchConstruct( [ 'allocator' => 'slab' ] ),
+	'construct-mmap' => $benchConstruct( [ 'allocator' => 'mmap' ] ),
+];
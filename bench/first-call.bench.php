@@ -0,0 +1,21 @@
+<?php
+/**
+ * The first call into a new sandbox, which is what most short-lived
+ * sandboxes do
+ */
+
+return [
+	'first-call' => static function ( $n ) {
+		$total = 0;
+		for ( $i = 0; $i < $n; $i++ ) {
+			$sandbox = new LuaSandbox;
+			$start = bench_now();
+			$sandbox->loadString( 'return 1' )->call();
+			$total += bench_now() - $start;
+			unset( $sandbox );
+		}
+		return [
+			'firstCallUsec' => $total / $n * 1e6,
+		];
+	},
+];
@@ -0,0 +1,111 @@
+<?php
+/**
+ * Run the LuaSandbox benchmarks and print the results as JSON.
+ *
+ * Usage:
+ *   php -d extension=modules/luasandbox.so bench/run.php [--iterations=N]
+ *       [--baseline=FILE] [name ...]
+ *
+ * Each bench/*.bench.php file returns an array mapping benchmark names to
+ * functions. Each function is called with the iteration count and returns an
+ * associative array of measurements. If names are given on the command line,
+ * only the benchmarks starting with one of them are run.
+ *
+ * To compare two builds, save the output from one of them, and run the other
+ * with --baseline pointing at the saved file. The percentage change of each
+ * measurement present in both runs is then included in the output.
+ */
+
+if ( !extension_loaded( 'luasandbox' ) ) {
+	fwrite( STDERR, "The luasandbox extension is not loaded\n" );
+	exit( 1 );
+}
+
+/**
+ * Get a monotonic time in seconds
+ * @return float
+ */
+function bench_now() {
+	if ( function_exists( 'hrtime' ) ) {
+		return hrtime( true ) / 1e9;
+	}
+	return microtime( true );
+}
+
+/**
+ * Round a measurement for output
+ * @param float $value
+ * @return float
+ */
+function bench_round( $value ) {
+	return round( $value, 3 );
+}
+
+$iterations = 1000;
+$baseline = null;
+$filters = [];
+foreach ( array_slice( $argv, 1 ) as $arg ) {
+	if ( preg_match( '/^--iterations=(\d+)$/', $arg, $m ) ) {
+		$iterations = max( 1, (int)$m[1] );
+	} elseif ( preg_match( '/^--baseline=(.+)$/', $arg, $m ) ) {
+		$baseline = json_decode( (string)@file_get_contents( $m[1] ), true );
+		if ( !isset( $baseline['results'] ) ) {
+			fwrite( STDERR, "Unable to read benchmark results from {$m[1]}\n" );
+			exit( 1 );
+		}
+	} elseif ( substr( $arg, 0, 2 ) === '--' ) {
+		fwrite( STDERR, "Unknown option $arg\n" );
+		exit( 1 );
+	} else {
+		$filters[] = $arg;
+	}
+}
+
+$benchmarks = [];
+$files = glob( __DIR__ . '/*.bench.php' );
+sort( $files );
+foreach ( $files as $file ) {
+	$benchmarks += require $file;
+}
+
+$results = [];
+foreach ( $benchmarks as $name => $fn ) {
+	if ( $filters ) {
+		$match = false;
+		foreach ( $filters as $filter ) {
+			if ( strpos( $name, $filter ) === 0 ) {
+				$match = true;
+				break;
+			}
+		}
+		if ( !$match ) {
+			continue;
+		}
+	}
+	// Warm up the PHP and system allocators
+	$fn( max( 1, intdiv( $iterations, 10 ) ) );
+	gc_collect_cycles();
+	$results[$name] = array_map( 'bench_round', $fn( $iterations ) );
+}
+
+$output = [
+	'versions' => LuaSandbox::getVersionInfo() + [ 'PHP' => PHP_VERSION ],
+	'iterations' => $iterations,
+	'results' => $results,
+];
+
+if ( $baseline ) {
+	$changes = [];
+	foreach ( $results as $name => $measurements ) {
+		foreach ( $measurements as $key => $value ) {
+			$old = $baseline['results'][$name][$key] ?? null;
+			if ( $old ) {
+				$changes[$name][$key] = bench_round( ( $value - $old ) / $old * 100 );
+			}
+		}
+	}
+	$output['baselineVersions'] = $baseline['versions'] ?? null;
+	$output['changePercent'] = $changes;
+}
+
+echo json_encode( $output, JSON_PRETTY_PRINT ) . "\n";
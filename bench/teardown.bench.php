@@ -0,0 +1,34 @@
+<?php
+/**
+ * Destruction of a sandbox with live LuaSandboxFunction objects. The last
+ * reference to the sandbox is held by the functions, so the whole set is
+ * freed at once.
+ */
+
+$benchTeardown = static function ( $live ) {
+	return static function ( $n ) use ( $live ) {
+		// Each iteration loads $live chunks, so scale the repetitions down
+		$reps = max( 1, intdiv( $n, max( 1, intdiv( $live, 10 ) ) ) );
+		$total = 0;
+		for ( $i = 0; $i < $reps; $i++ ) {
+			$sandbox = new LuaSandbox;
+			$functions = [];
+			for ( $j = 0; $j < $live; $j++ ) {
+				$functions[] = $sandbox->loadString( 'return 1' );
+			}
+			$start = bench_now();
+			$sandbox = null;
+			$functions = null;
+			$total += bench_now() - $start;
+		}
+		return [
+			'teardownUsec' => $total / $reps * 1e6,
+		];
+	};
+};
+
+return [
+	'teardown-0' => $benchTeardown( 0 ),
+	'teardown-100' => $benchTeardown( 100 ),
+	'teardown-1000' => $benchTeardown( 1000 ),
+];
@@ -0,0 +1,57 @@
+<?php
+/**
+ * Calls with a CPU limit, and limited sandboxes created and called from
+ * several threads at once. The threaded benchmarks need a ZTS build with the
+ * parallel extension.
+ */
+
+$benchThreads = static function ( $threads ) {
+	return static function ( $n ) use ( $threads ) {
+		$worker = static function ( $n ) {
+			for ( $i = 0; $i < $n; $i++ ) {
+				$sandbox = new LuaSandbox;
+				$sandbox->setCPULimit( 10 );
+				$sandbox->loadString( 'return 1' )->call();
+			}
+		};
+		$runtimes = [];
+		for ( $i = 0; $i < $threads; $i++ ) {
+			$runtimes[] = new \parallel\Runtime;
+		}
+		$start = bench_now();
+		$futures = [];
+		foreach ( $runtimes as $runtime ) {
+			$futures[] = $runtime->run( $worker, [ $n ] );
+		}
+		foreach ( $futures as $future ) {
+			$future->value();
+		}
+		$elapsed = bench_now() - $start;
+		foreach ( $runtimes as $runtime ) {
+			$runtime->close();
+		}
+		return [
+			'sandboxesPerSec' => $threads * $n / $elapsed,
+		];
+	};
+};
+
+$benchmarks = [
+	'limited-calls' => static function ( $n ) {
+		$sandbox = new LuaSandbox;
+		$sandbox->setCPULimit( 10 );
+		$func = $sandbox->loadString( 'return 1' );
+		$start = bench_now();
+		for ( $i = 0; $i < $n; $i++ ) {
+			$func->call();
+		}
+		return [
+			'callsPerSec' => $n / ( bench_now() - $start ),
+		];
+	},
+];
+if ( PHP_ZTS && class_exists( 'parallel\Runtime' ) ) {
+	$benchmarks['limited-threads-4'] = $benchThreads( 4 );
+	$benchmarks['limited-threads-16'] = $benchThreads( 16 );
+}
+return $benchmarks;
@@ -0,0 +1,518 @@
+/**
+ * Estimation of the memory used by each type of Lua object, for
+ * LuaSandbox::getMemoryBreakdown().
+ *
+ * The Lua 5.1 API does not expose the size of objects, and the allocator is
+ * not told what type of object a block is for, so the objects reachable from
+ * the registry, the global table and the stack of the main thread are
+ * walked, and the size of each is estimated from the layout of the
+ * structures in the reference implementation. Memory which belongs to no
+ * reachable object, such as the string table and garbage which has not been
+ * collected yet, is not counted.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <limits.h>
+
+#include "php.h"
+#include "php_luasandbox.h"
+#include "zend_smart_str.h"
+
+/*
+ * Structures with the same members as the Lua 5.1 object headers, so that
+ * the estimates follow the word size and alignment of this platform.
+ */
+#define LUASANDBOX_EST_HEADER void * next; unsigned char tt; unsigned char marked
+
+typedef union {
+	void * p;
+	lua_Number n;
+	int b;
+} luasandbox_est_value;
+
+typedef struct {
+	luasandbox_est_value value;
+	int tt;
+} luasandbox_est_tvalue;
+
+typedef struct {
+	LUASANDBOX_EST_HEADER;
+	unsigned char reserved;
+	unsigned int hash;
+	size_t len;
+} luasandbox_est_string;
+
+typedef struct {
+	LUASANDBOX_EST_HEADER;
+	void * metatable;
+	void * env;
+	size_t len;
+} luasandbox_est_udata;
+
+typedef struct {
+	LUASANDBOX_EST_HEADER;
+	unsigned char flags;
+	unsigned char lsizenode;
+	void * metatable;
+	void * array;
+	void * node;
+	void * lastfree;
+	void * gclist;
+	int sizearray;
+} luasandbox_est_table;
+
+typedef struct {
+	luasandbox_est_tvalue i_val;
+	luasandbox_est_value key_value;
+	int key_tt;
+	void * key_next;
+} luasandbox_est_node;
+
+typedef struct {
+	LUASANDBOX_EST_HEADER;
+	unsigned char isC;
+	unsigned char nupvalues;
+	void * gclist;
+	void * env;
+} luasandbox_est_closure;
+
+typedef struct {
+	LUASANDBOX_EST_HEADER;
+	void * v;
+	luasandbox_est_tvalue value;
+} luasandbox_est_upval;
+
+typedef struct {
+	LUASANDBOX_EST_HEADER;
+	void * pointers[7];
+	int sizes[6];
+	int linedefined;
+	int lastlinedefined;
+	void * gclist;
+	unsigned char counts[4];
+} luasandbox_est_proto;
+
+typedef struct {
+	void * pointers[4];
+	int nresults;
+	int tailcalls;
+} luasandbox_est_callinfo;
+
+typedef struct {
+	LUASANDBOX_EST_HEADER;
+	unsigned char status;
+	void * pointers[9];
+	int sizes[2];
+	unsigned short ccalls[2];
+	unsigned char hookmask;
+	unsigned char allowhook;
+	int hookcounts[2];
+	void * hook;
+	luasandbox_est_tvalue l_gt;
+	luasandbox_est_tvalue env;
+	void * openupval;
+	void * gclist;
+	void * errorJmp;
+	ptrdiff_t errfunc;
+} luasandbox_est_state;
+
+/** The largest array part considered, as MAXASIZE in ltable.c */
+#define LUASANDBOX_EST_MAXABITS 26
+
+/** The initial stack and CallInfo sizes of a thread, as in lstate.c */
+#define LUASANDBOX_EST_STACK_SIZE (2 * LUA_MINSTACK + 5)
+#define LUASANDBOX_EST_CI_SIZE 8
+
+typedef struct {
+	luasandbox_memory_breakdown * result;
+	/** The objects seen so far, by address. This is kept out of the Lua heap
+	 * so that it doesn't leave garbage behind for the collector. */
+	HashTable visited;
+	/** The function dumps seen so far. This is kept out of the Lua heap,
+	 * since the dumps are as large as the prototypes being measured. */
+	HashTable protos;
+	/** Stack index of the queue of objects to be scanned */
+	int queue_index;
+	int queue_head;
+	int queue_tail;
+	/** Stack index of the zval userdata metatable */
+	int zval_mt_index;
+} luasandbox_breakdown_params;
+
+static int luasandbox_breakdown_protected(lua_State * L);
+static void luasandbox_breakdown_visit(luasandbox_breakdown_params * p, lua_State * L, int index);
+static void luasandbox_breakdown_scan(luasandbox_breakdown_params * p, lua_State * L, int index);
+static void luasandbox_breakdown_table(luasandbox_breakdown_params * p, lua_State * L, int index);
+static void luasandbox_breakdown_function(luasandbox_breakdown_params * p, lua_State * L, int index);
+static void luasandbox_breakdown_thread(luasandbox_breakdown_params * p, lua_State * L, int index);
+static int luasandbox_breakdown_writer(lua_State * L, const void * data, size_t sz, void * ud);
+
+/** {{{ luasandbox_memory_breakdown_state
+ *
+ * Fill the result with the estimated memory usage by type of the objects
+ * reachable in the sandbox, and the memory usage before the walk. Returns
+ * the status code from lua_cpcall(); on failure, an error message is left
+ * on the stack.
+ */
+int luasandbox_memory_breakdown_state(php_luasandbox_obj * sandbox,
+	luasandbox_memory_breakdown * result)
+{
+	luasandbox_breakdown_params p;
+	php_luasandbox_alloc * alloc = &sandbox->alloc;
+	size_t old_memory_limit, old_soft_limit, old_peak, old_call_peak, old_group_peak = 0;
+	int status;
+
+	memset(result, 0, sizeof(*result));
+	memset(&p, 0, sizeof(p));
+	p.result = result;
+	zend_hash_init(&p.protos, 8, NULL, NULL, 0);
+	zend_hash_init(&p.visited, 256, NULL, NULL, 0);
+	result->memory_usage = alloc->memory_usage;
+
+	// The queue used to track the walk is not part of the sandbox's memory,
+	// so don't let it hit a limit or show up in the peak usage. It is emptied
+	// before returning, rather than running a full collection, which would
+	// change the GC statistics and the idle GC baseline.
+	old_memory_limit = alloc->memory_limit;
+	old_soft_limit = alloc->soft_memory_limit;
+	old_peak = alloc->peak_memory_usage;
+	old_call_peak = alloc->call_peak_usage;
+	if (alloc->group) {
+		old_group_peak = alloc->group->peak_memory_usage;
+	}
+	alloc->memory_limit = (size_t)-1;
+	alloc->soft_memory_limit = (size_t)-1;
+	alloc->limit_lifted++;
+	status = lua_cpcall(sandbox->state, luasandbox_breakdown_protected, &p);
+	alloc->limit_lifted--;
+	alloc->memory_limit = old_memory_limit;
+	alloc->soft_memory_limit = old_soft_limit;
+	alloc->peak_memory_usage = old_peak;
+	alloc->call_peak_usage = old_call_peak;
+	if (alloc->group) {
+		alloc->group->peak_memory_usage = old_group_peak;
+	}
+
+	zend_hash_destroy(&p.visited);
+	zend_hash_destroy(&p.protos);
+	return status;
+}
+/* }}} */
+
+/** {{{ luasandbox_breakdown_protected
+ *
+ * The body of luasandbox_memory_breakdown_state(), run under lua_cpcall().
+ * The walk is breadth-first with a queue, so that long chains of objects
+ * don't need deep recursion.
+ *
+ * Only the small queue table and the closure created by lua_cpcall() are
+ * left as garbage: the queue's array part is freed by forcing a rehash once
+ * it is empty.
+ */
+static int luasandbox_breakdown_protected(lua_State * L)
+{
+	luasandbox_breakdown_params * p = (luasandbox_breakdown_params*)lua_touserdata(L, 1);
+
+	luaL_checkstack(L, 20, "walking the Lua heap");
+	lua_newtable(L);
+	p->queue_index = lua_gettop(L);
+	lua_getfield(L, LUA_REGISTRYINDEX, "php_luasandbox_zval_metatable");
+	p->zval_mt_index = lua_gettop(L);
+
+	// The queue is reachable from this function's stack frame only, which
+	// the thread walk skips, so visiting the roots can't reach it
+	lua_pushthread(L);
+	luasandbox_breakdown_visit(p, L, lua_gettop(L));
+	lua_pushvalue(L, LUA_REGISTRYINDEX);
+	luasandbox_breakdown_visit(p, L, lua_gettop(L));
+	lua_pushvalue(L, LUA_GLOBALSINDEX);
+	luasandbox_breakdown_visit(p, L, lua_gettop(L));
+	lua_pushliteral(L, "");
+	if (lua_getmetatable(L, -1)) {
+		luasandbox_breakdown_visit(p, L, lua_gettop(L));
+	}
+	lua_settop(L, p->zval_mt_index);
+
+	while (p->queue_head < p->queue_tail) {
+		p->queue_head++;
+		lua_rawgeti(L, p->queue_index, p->queue_head);
+		lua_pushnil(L);
+		lua_rawseti(L, p->queue_index, p->queue_head);
+		luasandbox_breakdown_scan(p, L, lua_gettop(L));
+		lua_settop(L, p->zval_mt_index);
+	}
+
+	// Inserting a key into a table with no free hash node resizes both parts
+	// to fit the keys in use, and there are none left in the array part
+	lua_pushboolean(L, 1);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, p->queue_index);
+	return 0;
+}
+/* }}} */
+
+/** {{{ luasandbox_breakdown_visit
+ *
+ * Count the value at the given absolute stack index if it has not been seen
+ * before. Strings are counted immediately, other collectable objects are
+ * queued to be scanned for references.
+ */
+static void luasandbox_breakdown_visit(luasandbox_breakdown_params * p, lua_State * L, int index)
+{
+	luasandbox_memory_breakdown * result = p->result;
+	int type = lua_type(L, index);
+	const void * ptr;
+
+	switch (type) {
+		case LUA_TSTRING:
+			// Strings are interned, so the address of the contents identifies
+			// the object
+			ptr = lua_tostring(L, index);
+			break;
+		case LUA_TTABLE:
+		case LUA_TFUNCTION:
+		case LUA_TUSERDATA:
+		case LUA_TTHREAD:
+			ptr = lua_topointer(L, index);
+			break;
+		default:
+			return;
+	}
+
+	if (!zend_hash_index_add_empty_element(&p->visited, (zend_ulong)(uintptr_t)ptr)) {
+		return;
+	}
+
+	if (type == LUA_TSTRING) {
+		result->count[LUASANDBOX_BREAKDOWN_STRING]++;
+		result->bytes[LUASANDBOX_BREAKDOWN_STRING] +=
+			sizeof(luasandbox_est_string) + lua_objlen(L, index) + 1;
+		return;
+	}
+	lua_pushvalue(L, index);
+	lua_rawseti(L, p->queue_index, ++p->queue_tail);
+}
+/* }}} */
+
+/** {{{ luasandbox_breakdown_scan
+ *
+ * Count the size of a queued object, and visit the values it refers to.
+ */
+static void luasandbox_breakdown_scan(luasandbox_breakdown_params * p, lua_State * L, int index)
+{
+	luasandbox_memory_breakdown * result = p->result;
+
+	// Recursion requires an arbitrary amount of stack space so we have to
+	// check the stack.
+	luaL_checkstack(L, 10, "walking the Lua heap");
+
+	switch (lua_type(L, index)) {
+		case LUA_TTABLE:
+			luasandbox_breakdown_table(p, L, index);
+			break;
+		case LUA_TFUNCTION:
+			luasandbox_breakdown_function(p, L, index);
+			break;
+		case LUA_TTHREAD:
+			luasandbox_breakdown_thread(p, L, index);
+			break;
+		case LUA_TUSERDATA:
+			result->count[LUASANDBOX_BREAKDOWN_USERDATA]++;
+			result->bytes[LUASANDBOX_BREAKDOWN_USERDATA] +=
+				sizeof(luasandbox_est_udata) + lua_objlen(L, index);
+			if (lua_getmetatable(L, index)) {
+				if (lua_rawequal(L, -1, p->zval_mt_index)) {
+					result->zval_userdata++;
+				}
+				luasandbox_breakdown_visit(p, L, lua_gettop(L));
+				lua_pop(L, 1);
+			}
+			lua_getfenv(L, index);
+			luasandbox_breakdown_visit(p, L, lua_gettop(L));
+			lua_pop(L, 1);
+			break;
+	}
+}
+/* }}} */
+
+/** {{{ luasandbox_breakdown_table
+ *
+ * Count a table and visit its keys, values and metatable. The sizes of the
+ * array and hash parts are not visible through the API, so they are
+ * computed from the keys in the same way as a rehash in ltable.c would.
+ */
+static void luasandbox_breakdown_table(luasandbox_breakdown_params * p, lua_State * L, int index)
+{
+	luasandbox_memory_breakdown * result = p->result;
+	size_t nums[LUASANDBOX_EST_MAXABITS + 1] = {0};
+	size_t num_int_keys = 0, num_keys = 0, array_size = 0, array_keys = 0;
+	size_t hash_keys, hash_size, array_bytes, hash_bytes, a, twotoi;
+	int i;
+
+	lua_pushnil(L);
+	while (lua_next(L, index) != 0) {
+		num_keys++;
+		if (lua_type(L, -2) == LUA_TNUMBER) {
+			lua_Number n = lua_tonumber(L, -2);
+			if (n >= 1 && n <= ((size_t)1 << LUASANDBOX_EST_MAXABITS)
+				&& n == (lua_Number)(size_t)n)
+			{
+				size_t k = (size_t)n;
+				i = 0;
+				while (((size_t)1 << i) < k) {
+					i++;
+				}
+				nums[i]++;
+				num_int_keys++;
+			}
+		}
+		luasandbox_breakdown_visit(p, L, lua_gettop(L) - 1);
+		luasandbox_breakdown_visit(p, L, lua_gettop(L));
+		lua_pop(L, 1);
+	}
+
+	// As computesizes() in ltable.c: the array part is the largest power of
+	// two n such that more than half of the slots 1..n are in use
+	a = 0;
+	for (i = 0, twotoi = 1; i <= LUASANDBOX_EST_MAXABITS && twotoi / 2 < num_int_keys;
+		i++, twotoi *= 2)
+	{
+		if (nums[i] > 0) {
+			a += nums[i];
+			if (a > twotoi / 2) {
+				array_size = twotoi;
+				array_keys = a;
+			}
+		}
+	}
+
+	hash_keys = num_keys - array_keys;
+	hash_size = 0;
+	if (hash_keys) {
+		hash_size = 1;
+		while (hash_size < hash_keys) {
+			hash_size *= 2;
+		}
+	}
+
+	array_bytes = array_size * sizeof(luasandbox_est_tvalue);
+	hash_bytes = hash_size * sizeof(luasandbox_est_node);
+	result->count[LUASANDBOX_BREAKDOWN_TABLE]++;
+	result->bytes[LUASANDBOX_BREAKDOWN_TABLE] +=
+		sizeof(luasandbox_est_table) + array_bytes + hash_bytes;
+	result->table_array_bytes += array_bytes;
+	result->table_hash_bytes += hash_bytes;
+
+	if (lua_getmetatable(L, index)) {
+		luasandbox_breakdown_visit(p, L, lua_gettop(L));
+		lua_pop(L, 1);
+	}
+}
+/* }}} */
+
+/** {{{ luasandbox_breakdown_function
+ *
+ * Count a closure and visit its upvalues and environment. The size of the
+ * prototype of a Lua function is estimated from the length of its dump,
+ * and closures with identical dumps are assumed to share a prototype. So
+ * distinct prototypes with the same bytecode, constants and debug info,
+ * such as two copies of the same chunk, are only counted once.
+ * Upvalues shared by several closures are counted once for each closure.
+ */
+static void luasandbox_breakdown_function(luasandbox_breakdown_params * p, lua_State * L, int index)
+{
+	luasandbox_memory_breakdown * result = p->result;
+	int i, nups;
+
+	for (i = 1; lua_getupvalue(L, index, i) != NULL; i++) {
+		luasandbox_breakdown_visit(p, L, lua_gettop(L));
+		lua_pop(L, 1);
+	}
+	nups = i - 1;
+
+	lua_getfenv(L, index);
+	luasandbox_breakdown_visit(p, L, lua_gettop(L));
+	lua_pop(L, 1);
+
+	if (lua_iscfunction(L, index)) {
+		result->count[LUASANDBOX_BREAKDOWN_CFUNCTION]++;
+		result->bytes[LUASANDBOX_BREAKDOWN_CFUNCTION] += sizeof(luasandbox_est_closure)
+			+ sizeof(void*) + nups * sizeof(luasandbox_est_tvalue);
+		return;
+	}
+
+	result->count[LUASANDBOX_BREAKDOWN_FUNCTION]++;
+	result->bytes[LUASANDBOX_BREAKDOWN_FUNCTION] += sizeof(luasandbox_est_closure)
+		+ sizeof(void*) + nups * (sizeof(void*) + sizeof(luasandbox_est_upval));
+
+	smart_str buf = {0};
+	lua_pushvalue(L, index);
+	lua_dump(L, luasandbox_breakdown_writer, (void*)&buf);
+	lua_pop(L, 1);
+	if (!buf.s) {
+		return;
+	}
+	smart_str_0(&buf);
+	if (zend_hash_add_empty_element(&p->protos, buf.s)) {
+		result->count[LUASANDBOX_BREAKDOWN_PROTO]++;
+		result->bytes[LUASANDBOX_BREAKDOWN_PROTO] +=
+			sizeof(luasandbox_est_proto) + ZSTR_LEN(buf.s);
+	}
+	smart_str_free(&buf);
+}
+/* }}} */
+
+/** {{{ luasandbox_breakdown_thread
+ *
+ * Count a thread and visit the functions and locals of its active frames.
+ * The stack and CallInfo array are counted at their initial size, since
+ * their current size is not visible through the API. The frame of the walk
+ * itself is skipped, so that the queue is not counted.
+ */
+static void luasandbox_breakdown_thread(luasandbox_breakdown_params * p, lua_State * L, int index)
+{
+	luasandbox_memory_breakdown * result = p->result;
+	lua_State * co = lua_tothread(L, index);
+	lua_Debug ar;
+	int level = (co == L) ? 1 : 0;
+	int i;
+
+	result->count[LUASANDBOX_BREAKDOWN_THREAD]++;
+	result->bytes[LUASANDBOX_BREAKDOWN_THREAD] += sizeof(luasandbox_est_state)
+		+ LUASANDBOX_EST_STACK_SIZE * sizeof(luasandbox_est_tvalue)
+		+ LUASANDBOX_EST_CI_SIZE * sizeof(luasandbox_est_callinfo);
+
+	if (co != L && !lua_checkstack(co, 1)) {
+		return;
+	}
+	for (; lua_getstack(co, level, &ar); level++) {
+		// lua_xmove() does nothing when the thread is L itself
+		lua_getinfo(co, "f", &ar);
+		lua_xmove(co, L, 1);
+		luasandbox_breakdown_visit(p, L, lua_gettop(L));
+		lua_pop(L, 1);
+		for (i = 1; lua_getlocal(co, &ar, i) != NULL; i++) {
+			lua_xmove(co, L, 1);
+			luasandbox_breakdown_visit(p, L, lua_gettop(L));
+			lua_pop(L, 1);
+		}
+	}
+}
+/* }}} */
+
+/** {{{ luasandbox_breakdown_writer
+ *
+ * Writer function for lua_dump() in luasandbox_breakdown_function().
+ */
+static int luasandbox_breakdown_writer(lua_State * L, const void * data, size_t sz, void * ud)
+{
+	smart_str * buf = (smart_str *)ud;
+	smart_str_appendl(buf, data, sz);
+	return 0;
+}
+/* }}} */
@@ -0,0 +1,565 @@
+/**
+ * Copying of the global environment from one Lua state to another, used by
+ * LuaSandbox::cloneFrom().
+ *
+ * Lua 5.1 has no API for duplicating a lua_State, so the source globals are
+ * walked and each reachable value is recreated in the destination state.
+ * Lua functions are transferred as bytecode with lua_dump(), so the
+ * destination does not need to parse or execute any of the code that set up
+ * the source environment.
+ *
+ * Lua 5.1 can't make two existing closures share an upvalue, so closures
+ * which share an upvalue holding a plain value, such as a counter, can't be
+ * cloned. See luasandbox_clone_check_shared().
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "php.h"
+#include "php_luasandbox.h"
+#include "zend_smart_str.h"
+
+typedef struct {
+	lua_State * src;
+	lua_State * dst;
+	/** Destination stack index of the table mapping source object addresses
+	 * to the corresponding destination values */
+	int map_index;
+	/** Source stack index of the zval userdata metatable */
+	int src_zval_mt_index;
+} luasandbox_clone_params;
+
+/**
+ * Global tables which exist in both states after construction. These are
+ * reused in the destination rather than recreated, so that references held
+ * by C code, such as the string metatable's __index, stay intact.
+ */
+static const char * luasandbox_clone_shared_tables[] = {
+	"string",
+	"table",
+	"math",
+	"os",
+	"debug",
+	NULL
+};
+
+static int luasandbox_clone_protected(lua_State * L);
+static void luasandbox_clone_value(luasandbox_clone_params * p, int index);
+static void luasandbox_clone_table_contents(luasandbox_clone_params * p,
+	int src_index, int dst_index);
+static void luasandbox_clone_function(luasandbox_clone_params * p, int index);
+static void luasandbox_clone_pair(luasandbox_clone_params * p,
+	int src_index, int dst_index);
+static int luasandbox_clone_writer(lua_State * L, const void * data, size_t sz, void * ud);
+static void luasandbox_clone_check_shared(luasandbox_clone_params * p);
+static void luasandbox_clone_collect(luasandbox_clone_params * p, int seen_index,
+	int funcs_index, int index);
+static int luasandbox_clone_find_shared(lua_State * src, int funcs_index,
+	int num_slots, int * rep);
+
+/** {{{ luasandbox_clone_state
+ *
+ * Replace the global environment of dest with a copy of the global
+ * environment of source. Returns the status code from lua_cpcall(); on
+ * failure, an error message is left on the destination stack.
+ */
+int luasandbox_clone_state(php_luasandbox_obj * source, php_luasandbox_obj * dest)
+{
+	luasandbox_clone_params p;
+	size_t old_memory_limit;
+	int src_top, status;
+
+	p.src = source->state;
+	p.dst = dest->state;
+	p.map_index = 0;
+	p.src_zval_mt_index = 0;
+
+	// The source state is accessed outside of any protected call, so
+	// temporarily disable its memory limit to make sure that growing its
+	// stack cannot raise an error.
+	old_memory_limit = source->alloc.memory_limit;
+	source->alloc.memory_limit = (size_t)-1;
+	source->alloc.limit_lifted++;
+	src_top = lua_gettop(p.src);
+
+	status = lua_cpcall(p.dst, luasandbox_clone_protected, &p);
+
+	lua_settop(p.src, src_top);
+	source->alloc.limit_lifted--;
+	source->alloc.memory_limit = old_memory_limit;
+
+	if (status == 0) {
+		dest->random_seed = source->random_seed;
+	}
+	return status;
+}
+/* }}} */
+
+/** {{{ luasandbox_clone_protected
+ *
+ * The body of luasandbox_clone_state(), run under lua_cpcall() in the
+ * destination state.
+ */
+static int luasandbox_clone_protected(lua_State * L)
+{
+	luasandbox_clone_params * p = (luasandbox_clone_params*)lua_touserdata(L, 1);
+	lua_State * src = p->src;
+	int i, pairs_top;
+
+	if (!lua_checkstack(src, 30)) {
+		return luaL_error(L, "unable to allocate stack space for cloning");
+	}
+	luaL_checkstack(L, 30, "cloning LuaSandbox");
+
+	luasandbox_clone_check_shared(p);
+	lua_newtable(L);
+	p->map_index = lua_gettop(L);
+	lua_getfield(src, LUA_REGISTRYINDEX, "php_luasandbox_zval_metatable");
+	p->src_zval_mt_index = lua_gettop(src);
+
+	// Pair up the tables which exist in both states. Each pair is pushed on
+	// to both stacks, so that the contents can be copied once every pair is
+	// registered in the map.
+	pairs_top = lua_gettop(L);
+	lua_pushvalue(src, LUA_GLOBALSINDEX);
+	lua_pushvalue(L, LUA_GLOBALSINDEX);
+	luasandbox_clone_pair(p, lua_gettop(src), lua_gettop(L));
+
+	lua_pushliteral(src, "");
+	lua_pushliteral(L, "");
+	if (lua_getmetatable(src, -1) && lua_getmetatable(L, -1)) {
+		lua_remove(src, -2);
+		lua_remove(L, -2);
+		luasandbox_clone_pair(p, lua_gettop(src), lua_gettop(L));
+	} else {
+		lua_settop(src, p->src_zval_mt_index + 1);
+		lua_settop(L, pairs_top + 1);
+	}
+
+	for (i = 0; luasandbox_clone_shared_tables[i]; i++) {
+		lua_getfield(src, LUA_GLOBALSINDEX, luasandbox_clone_shared_tables[i]);
+		lua_getfield(L, LUA_GLOBALSINDEX, luasandbox_clone_shared_tables[i]);
+		lua_pushlightuserdata(L, (void*)lua_topointer(src, -1));
+		lua_rawget(L, p->map_index);
+		if (lua_istable(src, -1) && lua_istable(L, -2) && lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			luasandbox_clone_pair(p, lua_gettop(src), lua_gettop(L));
+		} else {
+			lua_pop(src, 1);
+			lua_pop(L, 2);
+		}
+	}
+
+	// Now replace the contents of each destination table with a copy of the
+	// contents of its source table
+	for (i = pairs_top + 1; i <= lua_gettop(L); i++) {
+		luasandbox_clone_table_contents(p, p->src_zval_mt_index + i - pairs_top, i);
+	}
+	return 0;
+}
+/* }}} */
+
+/** {{{ luasandbox_clone_pair
+ *
+ * Register the source table at src_index as corresponding to the
+ * destination table at dst_index.
+ */
+static void luasandbox_clone_pair(luasandbox_clone_params * p, int src_index, int dst_index)
+{
+	lua_pushlightuserdata(p->dst, (void*)lua_topointer(p->src, src_index));
+	lua_pushvalue(p->dst, dst_index);
+	lua_rawset(p->dst, p->map_index);
+}
+/* }}} */
+
+/** {{{ luasandbox_clone_value
+ *
+ * Push on to the destination stack a copy of the source value at the given
+ * absolute source stack index. Tables, functions and userdata which are
+ * reachable more than once are copied only once, so shared references and
+ * cycles are preserved.
+ */
+static void luasandbox_clone_value(luasandbox_clone_params * p, int index)
+{
+	lua_State * src = p->src;
+	lua_State * L = p->dst;
+	int type = lua_type(src, index);
+
+	// Recursion requires an arbitrary amount of stack space so we have to
+	// check the stack.
+	luaL_checkstack(L, 10, "cloning LuaSandbox");
+	if (!lua_checkstack(src, 10)) {
+		luaL_error(L, "unable to allocate stack space for cloning");
+	}
+
+	switch (type) {
+		case LUA_TNIL:
+			lua_pushnil(L);
+			return;
+		case LUA_TBOOLEAN:
+			lua_pushboolean(L, lua_toboolean(src, index));
+			return;
+		case LUA_TNUMBER:
+			lua_pushnumber(L, lua_tonumber(src, index));
+			return;
+		case LUA_TSTRING: {
+			size_t length;
+			const char * str = lua_tolstring(src, index, &length);
+			lua_pushlstring(L, str, length);
+			return;
+		}
+		case LUA_TTABLE:
+		case LUA_TFUNCTION:
+		case LUA_TUSERDATA:
+			break;
+		default:
+			luaL_error(L, "cannot clone a value of type %s", lua_typename(src, type));
+			return;
+	}
+
+	// Has this object been copied already?
+	lua_pushlightuserdata(L, (void*)lua_topointer(src, index));
+	lua_rawget(L, p->map_index);
+	if (!lua_isnil(L, -1)) {
+		return;
+	}
+	lua_pop(L, 1);
+
+	if (type == LUA_TTABLE) {
+		lua_newtable(L);
+		luasandbox_clone_pair(p, index, lua_gettop(L));
+		luasandbox_clone_table_contents(p, index, lua_gettop(L));
+	} else if (type == LUA_TFUNCTION) {
+		luasandbox_clone_function(p, index);
+	} else {
+		// The only userdata which can exist in a sandbox are the wrapped PHP
+		// callbacks created by luasandbox_push_zval_userdata()
+		int is_zval = 0;
+		if (lua_getmetatable(src, index)) {
+			is_zval = lua_rawequal(src, -1, p->src_zval_mt_index);
+			lua_pop(src, 1);
+		}
+		if (!is_zval) {
+			luaL_error(L, "cannot clone a value of type userdata");
+		}
+		luasandbox_push_zval_userdata(L, (zval*)lua_touserdata(src, index));
+		luasandbox_clone_pair(p, index, lua_gettop(L));
+	}
+}
+/* }}} */
+
+/** {{{ luasandbox_clone_table_contents
+ *
+ * Replace the contents and metatable of the destination table with copies of
+ * those of the source table.
+ */
+static void luasandbox_clone_table_contents(luasandbox_clone_params * p,
+	int src_index, int dst_index)
+{
+	lua_State * src = p->src;
+	lua_State * L = p->dst;
+
+	// Remove any existing members. Assigning nil to an existing field during
+	// traversal is allowed.
+	lua_pushnil(L);
+	while (lua_next(L, dst_index) != 0) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, -1);
+		lua_pushnil(L);
+		lua_rawset(L, dst_index);
+	}
+
+	lua_pushnil(src);
+	while (lua_next(src, src_index) != 0) {
+		luasandbox_clone_value(p, lua_gettop(src) - 1);
+		luasandbox_clone_value(p, lua_gettop(src));
+		lua_rawset(L, dst_index);
+		lua_pop(src, 1);
+	}
+
+	if (lua_getmetatable(src, src_index)) {
+		luasandbox_clone_value(p, lua_gettop(src));
+		lua_pop(src, 1);
+	} else {
+		lua_pushnil(L);
+	}
+	lua_setmetatable(L, dst_index);
+}
+/* }}} */
+
+/** {{{ luasandbox_clone_function
+ *
+ * Push a copy of the source function at the given index. Lua functions are
+ * transferred as bytecode, and C functions are recreated from their function
+ * pointer. Upvalues are copied by value. Closures sharing an upvalue get the
+ * same copy of the value it refers to, but not a shared variable, see
+ * luasandbox_clone_check_shared().
+ */
+static void luasandbox_clone_function(luasandbox_clone_params * p, int index)
+{
+	lua_State * src = p->src;
+	lua_State * L = p->dst;
+	int i, dst_index;
+
+	if (lua_iscfunction(src, index)) {
+		lua_CFunction f = lua_tocfunction(src, index);
+		for (i = 1; lua_getupvalue(src, index, i) != NULL; i++) {
+			luasandbox_clone_value(p, lua_gettop(src));
+			lua_pop(src, 1);
+		}
+		lua_pushcclosure(L, f, i - 1);
+		luasandbox_clone_pair(p, index, lua_gettop(L));
+		return;
+	}
+
+	smart_str buf = {0};
+	int status;
+
+	lua_pushvalue(src, index);
+	lua_dump(src, luasandbox_clone_writer, (void*)&buf);
+	lua_pop(src, 1);
+	if (!buf.s) {
+		luaL_error(L, "unable to dump function for cloning");
+	}
+	status = luaL_loadbuffer(L, ZSTR_VAL(buf.s), ZSTR_LEN(buf.s), "=clone");
+	smart_str_free(&buf);
+	if (status != 0) {
+		lua_error(L);
+	}
+
+	// Register it before copying the upvalues, since a recursive local
+	// function has itself as an upvalue
+	dst_index = lua_gettop(L);
+	luasandbox_clone_pair(p, index, dst_index);
+
+	for (i = 1; lua_getupvalue(src, index, i) != NULL; i++) {
+		luasandbox_clone_value(p, lua_gettop(src));
+		lua_setupvalue(L, dst_index, i);
+		lua_pop(src, 1);
+	}
+
+	lua_getfenv(src, index);
+	luasandbox_clone_value(p, lua_gettop(src));
+	lua_setfenv(L, dst_index);
+	lua_pop(src, 1);
+}
+/* }}} */
+
+/** {{{ luasandbox_clone_check_shared
+ *
+ * Raise an error if the source has closures which share an upvalue that
+ * luasandbox_clone_function() can't copy faithfully. Lua 5.1 can't make
+ * two existing closures share an upvalue, so each closure in the copy gets
+ * its own. For an upvalue holding a table, function or userdata, the copies
+ * all refer to the same copied object, so this only differs if the variable
+ * itself is assigned after cloning. Any other value, such as a counter or a
+ * flag, can only be changed by assigning the variable, so closures sharing
+ * it can't be cloned.
+ */
+static void luasandbox_clone_check_shared(luasandbox_clone_params * p)
+{
+	lua_State * src = p->src;
+	lua_State * L = p->dst;
+	int src_top = lua_gettop(src), dst_top = lua_gettop(L);
+	int funcs_index, seen_index, num_funcs, num_slots, f, i, s, type;
+	int * rep;
+
+	lua_newtable(src);
+	funcs_index = lua_gettop(src);
+	lua_newtable(L);
+	seen_index = lua_gettop(L);
+
+	lua_pushvalue(src, LUA_GLOBALSINDEX);
+	luasandbox_clone_collect(p, seen_index, funcs_index, lua_gettop(src));
+	lua_pushliteral(src, "");
+	if (lua_getmetatable(src, -1)) {
+		luasandbox_clone_collect(p, seen_index, funcs_index, lua_gettop(src));
+	}
+	lua_settop(src, funcs_index);
+
+	// One function can't share an upvalue with anything
+	num_funcs = (int)lua_objlen(src, funcs_index);
+	if (num_funcs < 2) {
+		lua_settop(src, src_top);
+		lua_settop(L, dst_top);
+		return;
+	}
+	num_slots = 0;
+	for (f = 1; f <= num_funcs; f++) {
+		lua_rawgeti(src, funcs_index, f);
+		for (i = 1; lua_getupvalue(src, -1, i) != NULL; i++) {
+			lua_pop(src, 1);
+		}
+		lua_pop(src, 1);
+		num_slots += i - 1;
+	}
+
+	rep = (int*)lua_newuserdata(L, (size_t)num_slots * sizeof(int));
+	if (!luasandbox_clone_find_shared(src, funcs_index, num_slots, rep)) {
+		luaL_error(L, "cannot clone: too many upvalues");
+	}
+
+	// The original values are on the source stack, above the function table,
+	// at the position of the first slot referring to each upvalue
+	for (s = 0; s < num_slots; s++) {
+		if (rep[s] == s) {
+			continue;
+		}
+		type = lua_type(src, funcs_index + 1 + rep[s]);
+		if (type != LUA_TTABLE && type != LUA_TFUNCTION && type != LUA_TUSERDATA) {
+			luaL_error(L, "cannot clone closures which share an upvalue holding a %s",
+				lua_typename(src, type));
+		}
+	}
+
+	lua_settop(src, src_top);
+	lua_settop(L, dst_top);
+}
+/* }}} */
+
+/** {{{ luasandbox_clone_collect
+ *
+ * Append to the source table at funcs_index every Lua function with
+ * upvalues which is reachable from the source value at the given index,
+ * in the same way as luasandbox_clone_value() would reach it.
+ */
+static void luasandbox_clone_collect(luasandbox_clone_params * p, int seen_index,
+	int funcs_index, int index)
+{
+	lua_State * src = p->src;
+	lua_State * L = p->dst;
+	int type = lua_type(src, index);
+	int i;
+
+	if (type != LUA_TTABLE && type != LUA_TFUNCTION) {
+		return;
+	}
+
+	// Recursion requires an arbitrary amount of stack space so we have to
+	// check the stack.
+	luaL_checkstack(L, 5, "cloning LuaSandbox");
+	if (!lua_checkstack(src, 10)) {
+		luaL_error(L, "unable to allocate stack space for cloning");
+	}
+
+	lua_pushlightuserdata(L, (void*)lua_topointer(src, index));
+	lua_rawget(L, seen_index);
+	if (!lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pop(L, 1);
+	lua_pushlightuserdata(L, (void*)lua_topointer(src, index));
+	lua_pushboolean(L, 1);
+	lua_rawset(L, seen_index);
+
+	if (type == LUA_TTABLE) {
+		lua_pushnil(src);
+		while (lua_next(src, index) != 0) {
+			luasandbox_clone_collect(p, seen_index, funcs_index, lua_gettop(src) - 1);
+			luasandbox_clone_collect(p, seen_index, funcs_index, lua_gettop(src));
+			lua_pop(src, 1);
+		}
+		if (lua_getmetatable(src, index)) {
+			luasandbox_clone_collect(p, seen_index, funcs_index, lua_gettop(src));
+			lua_pop(src, 1);
+		}
+		return;
+	}
+
+	for (i = 1; lua_getupvalue(src, index, i) != NULL; i++) {
+		luasandbox_clone_collect(p, seen_index, funcs_index, lua_gettop(src));
+		lua_pop(src, 1);
+	}
+	if (i > 1 && !lua_iscfunction(src, index)) {
+		lua_pushvalue(src, index);
+		lua_rawseti(src, funcs_index, (int)lua_objlen(src, funcs_index) + 1);
+	}
+	lua_getfenv(src, index);
+	luasandbox_clone_collect(p, seen_index, funcs_index, lua_gettop(src));
+	lua_pop(src, 1);
+}
+/* }}} */
+
+/** {{{ luasandbox_clone_find_shared
+ *
+ * Find which upvalue slots of the collected source functions refer to the
+ * same upvalue, setting rep[s] to the first slot which refers to the same
+ * upvalue as slot s. The public API has no way to compare upvalues, so each
+ * upvalue is temporarily set to a unique light userdata. A later slot which
+ * reads back an earlier slot's marker shares its upvalue.
+ *
+ * The original value of slot s is pushed on to the source stack at
+ * lua_gettop() + 1 + s, and left there for the caller. The stack space is
+ * reserved before any upvalue is changed, and nothing between changing the
+ * upvalues and putting them back allocates memory, so this can't raise an
+ * error or run the garbage collector while the source functions are holding
+ * the markers. If the stack space can't be reserved, zero is returned and
+ * nothing is changed.
+ */
+static int luasandbox_clone_find_shared(lua_State * src, int funcs_index,
+	int num_slots, int * rep)
+{
+	// Addresses in the rep array can't be held by any Lua value
+	char * markers = (char*)rep;
+	char * value;
+	int base = lua_gettop(src), f, i, s;
+
+	if (!lua_checkstack(src, num_slots + 10)) {
+		return 0;
+	}
+	// Fill the stack so that its layout doesn't depend on which slots share
+	for (s = 0; s < num_slots; s++) {
+		lua_pushnil(src);
+	}
+
+	for (f = 1, s = 0; s < num_slots; f++) {
+		lua_rawgeti(src, funcs_index, f);
+		for (i = 1; lua_getupvalue(src, -1, i) != NULL; i++, s++) {
+			value = (char*)lua_touserdata(src, -1);
+			if (lua_islightuserdata(src, -1) && value >= markers
+				&& value < markers + num_slots)
+			{
+				rep[s] = (int)(value - markers);
+				lua_pop(src, 1);
+			} else {
+				rep[s] = s;
+				lua_replace(src, base + 1 + s);
+				lua_pushlightuserdata(src, markers + s);
+				lua_setupvalue(src, -2, i);
+			}
+		}
+		lua_pop(src, 1);
+	}
+
+	for (f = 1, s = 0; s < num_slots; f++) {
+		lua_rawgeti(src, funcs_index, f);
+		for (i = 1; lua_getupvalue(src, -1, i) != NULL; i++, s++) {
+			lua_pop(src, 1);
+			if (rep[s] == s) {
+				lua_pushvalue(src, base + 1 + s);
+				lua_setupvalue(src, -2, i);
+			}
+		}
+		lua_pop(src, 1);
+	}
+	return 1;
+}
+/* }}} */
+
+/** {{{ luasandbox_clone_writer
+ *
+ * Writer function for lua_dump() in luasandbox_clone_function().
+ */
+static int luasandbox_clone_writer(lua_State * L, const void * data, size_t sz, void * ud)
+{
+	smart_str * buf = (smart_str *)ud;
+	smart_str_appendl(buf, data, sz);
+	return 0;
+}
+/* }}} */
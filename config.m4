@@ -22,18 +22,21 @@ if test "$PHP_LUASANDBOX" != "no"; then
 
 	dnl Timers require real-time and pthread library on Linux and not
 	dnl supported on other platforms
-	AC_SEARCH_LIBS([timer_create], [rt], [
+	AC_SEARCH_LIBS([clock_gettime], [rt], [
 		PHP_EVAL_LIBLINE($LIBS, LUASANDBOX_SHARED_LIBADD)
 	])
-	AC_SEARCH_LIBS([sem_init], [pthread], [
+	AC_SEARCH_LIBS([pthread_create], [pthread], [
 		PHP_EVAL_LIBLINE($LIBS, LUASANDBOX_SHARED_LIBADD)
 	])
 
+	dnl The mmap allocator needs mmap() and munmap()
+	AC_CHECK_HEADERS([sys/mman.h])
+
 	dnl LUA_LIBS and LUA_CFLAGS interprets them:
 	PHP_EVAL_INCLINE($LUA_CFLAGS)
 	PHP_EVAL_LIBLINE($LUA_LIBS, LUASANDBOX_SHARED_LIBADD)
 
 	PHP_SUBST(LUASANDBOX_SHARED_LIBADD)
-	PHP_NEW_EXTENSION(luasandbox, alloc.c data_conversion.c library.c luasandbox.c timer.c luasandbox_lstrlib.c, $ext_shared)
+	PHP_NEW_EXTENSION(luasandbox, alloc.c breakdown.c clone.c data_conversion.c library.c luasandbox.c preload.c timer.c luasandbox_lstrlib.c, $ext_shared)
 	PHP_ADD_MAKEFILE_FRAGMENT
 fi
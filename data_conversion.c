@@ -159,6 +159,7 @@ static int luasandbox_free_zval_userdata(lua_State * L)
 		zval_ptr_dtor(ud);
 		ZVAL_UNDEF(ud);
 	}
+	intern->zval_userdata_count--;
 
 	luasandbox_leave_php(L, intern);
 	return 0;
@@ -178,6 +179,7 @@ void luasandbox_push_zval_userdata(lua_State * L, zval * z)
 
 	lua_getfield(L, LUA_REGISTRYINDEX, "php_luasandbox_zval_metatable");
 	lua_setmetatable(L, -2);
+	luasandbox_get_php_obj(L)->zval_userdata_count++;
 }
 /* }}} */
 
@@ -409,6 +411,20 @@ static int luasandbox_lua_to_array(HashTable *ht, lua_State *L, int index,
 		index += top + 1;
 	}
 
+	// If the table is a placeholder for a library which hasn't been loaded
+	// yet, load it so that the conversion sees its members.
+	if (luasandbox_lib_is_placeholder(L, index)) {
+		sandbox = luasandbox_get_php_obj(L);
+		lua_pushcfunction(L, luasandbox_attach_trace);
+		lua_pushcfunction(L, luasandbox_lib_materialize_protected);
+		lua_pushvalue(L, index);
+		if (!luasandbox_call_lua(sandbox, sandbox_zval, 1, 0, top + 1)) {
+			lua_settop(L, top);
+			return 0;
+		}
+		lua_settop(L, top);
+	}
+
 	// If the input table has a __pairs function, we need to use that instead
 	// of lua_next.
 	if (luaL_getmetafield(L, index, "__pairs")) {
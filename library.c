@@ -20,8 +20,45 @@
 #include <time.h>
 #endif
 
-static void luasandbox_lib_filter_table(lua_State * L, char ** member_names);
-static HashTable * luasandbox_lib_get_allowed_globals();
+/**
+ * A standard library member recorded by luasandbox_lib_minit()
+ */
+typedef struct {
+	char * name;
+	// LUA_TFUNCTION or LUA_TNUMBER
+	int type;
+	lua_CFunction func;
+	// The C function upvalue of pairs and ipairs in Lua 5.1
+	lua_CFunction upvalue;
+	lua_Number number;
+} luasandbox_lib_member;
+
+typedef struct {
+	// The global name of the library, or NULL for the base library
+	const char * name;
+	lua_CFunction open;
+	// Allowed member names, or NULL to allow all members
+	char ** allowed;
+	// Our own functions which replace or add to the allowed members
+	const luaL_Reg * overrides;
+	// Nonzero if the library can be loaded on first access
+	int lazy;
+	// Nonzero if the library is included in the slim profile
+	int slim;
+	luasandbox_lib_member * members;
+	int num_members;
+} luasandbox_lib_template;
+
+static int luasandbox_lib_collect(lua_State * L);
+static int luasandbox_lib_collect_member(lua_State * L, const char * name,
+	luasandbox_lib_member * member);
+static void luasandbox_lib_fill(lua_State * L, luasandbox_lib_template * lib);
+static void luasandbox_lib_push_placeholder(lua_State * L, int lib_index);
+static int luasandbox_lib_get_placeholder(lua_State * L, int index);
+static int luasandbox_lib_lazy_index(lua_State * L);
+static int luasandbox_lib_lazy_newindex(lua_State * L);
+static int luasandbox_lib_lazy_wrapper(lua_State * L);
+static void luasandbox_lib_wrap(lua_State * L, const char * name);
 
 static int luasandbox_base_tostring(lua_State * L);
 static int luasandbox_math_random(lua_State * L);
@@ -37,7 +74,7 @@ static int luasandbox_base_ipairs(lua_State *L);
 #endif
 
 /**
- * Allowed global variables. Omissions are:
+ * Allowed functions from the base library. Omissions are:
  *   * pcall, xpcall: We have our own versions which don't allow interception of
  *     timeout etc. errors.
  *   * loadfile: insecure.
@@ -48,15 +85,18 @@ static int luasandbox_base_ipairs(lua_State *L);
  *   * tostring: Provides addresses of tables and functions, which provides an
  *     easy ASLR workaround or heap address discovery mechanism for a memory
  *     corruption exploit. We have our own version.
+ *   * unpack: We have our own version.
  *   * Any new or undocumented functions like newproxy.
  *   * package: cpath, loadlib etc. are insecure.
  *   * coroutine: Not useful for our application so unreviewed at present.
  *   * io, file, os: insecure
  *   * debug: Provides various ways to break the sandbox, such as setupvalue()
  *     and getregistry().
+ *
+ * The other allowed globals are _G, _VERSION, and the string, table, math, os
+ * and debug libraries.
  */
-char * luasandbox_allowed_globals[] = {
-	// base
+char * luasandbox_allowed_base_members[] = {
 	"assert",
 	"error",
 	"getfenv",
@@ -72,15 +112,6 @@ char * luasandbox_allowed_globals[] = {
 	"setmetatable",
 	"tonumber",
 	"type",
-	"unpack",
-	"_G",
-	"_VERSION",
-	// libs
-	"string",
-	"table",
-	"math",
-	"os",
-	"debug",
 	NULL
 };
 
@@ -96,67 +127,231 @@ char * luasandbox_allowed_debug_members[] = {
 	NULL
 };
 
+/**
+ * The standard libraries which are copied into each sandbox. The members are
+ * collected by luasandbox_lib_minit(), since the library functions are not
+ * exported by liblua. The string library is our own, see
+ * luasandbox_lstrlib.c.
+ */
+static const luaL_Reg luasandbox_base_overrides[] = {
+	{"tostring", luasandbox_base_tostring},
+	{"pcall", luasandbox_base_pcall},
+	{"xpcall", luasandbox_base_xpcall},
+	{"unpack", luasandbox_base_unpack},
+	{NULL, NULL}
+};
 
+static const luaL_Reg luasandbox_math_overrides[] = {
+	{"random", luasandbox_math_random},
+	{"randomseed", luasandbox_math_randomseed},
+	{NULL, NULL}
+};
 
-ZEND_EXTERN_MODULE_GLOBALS(luasandbox);
+static const luaL_Reg luasandbox_os_overrides[] = {
+	// Uses our high-resolution usage timer
+	{"clock", luasandbox_os_clock},
+	{NULL, NULL}
+};
 
-/** {{{  luasandbox_lib_register
+static luasandbox_lib_template luasandbox_libs[] = {
+	{NULL, luaopen_base, luasandbox_allowed_base_members, luasandbox_base_overrides, 0, 1},
+	{"table", luaopen_table, NULL, NULL, 0, 1},
+	{"math", luaopen_math, NULL, luasandbox_math_overrides, 1, 1},
+	{"os", luaopen_os, luasandbox_allowed_os_members, luasandbox_os_overrides, 1, 0},
+	{"debug", luaopen_debug, luasandbox_allowed_debug_members, NULL, 1, 0},
+	{NULL, NULL, NULL, NULL, 0, 0}
+};
+
+/**
+ * Functions which can see the contents or metatable of a table without
+ * triggering its metamethods. In a sandbox with lazy libraries, these are
+ * wrapped so that they load a library before looking at it.
+ */
+static const char * luasandbox_lazy_wrapped_functions[] = {
+	"next",
+	"rawget",
+	"rawset",
+	"getmetatable",
+	"setmetatable",
+	NULL
+};
+
+/** {{{ luasandbox_lib_minit
+ *
+ * Open the standard libraries in a scratch state and record the allowed
+ * members of each, so that luasandbox_lib_register() can build the sandbox
+ * environment without creating anything it would then have to delete.
  */
-void luasandbox_lib_register(lua_State * L)
+int luasandbox_lib_minit()
 {
-	// Load the standard libraries that we need
-	lua_pushcfunction(L, luaopen_base);
-	lua_call(L, 0, 0);
-	lua_pushcfunction(L, luaopen_table);
-	lua_call(L, 0, 0);
-	lua_pushcfunction(L, luaopen_math);
-	lua_call(L, 0, 0);
-	lua_pushcfunction(L, luaopen_debug);
-	lua_call(L, 0, 0);
-	lua_pushcfunction(L, luaopen_os);
-	lua_call(L, 0, 0);
+	lua_State * L = luaL_newstate();
+	int status;
 
-	// Install our own string library
-	lua_pushcfunction(L, luasandbox_open_string);
-	lua_call(L, 0, 0);
+	if (!L) {
+		return FAILURE;
+	}
+	status = lua_cpcall(L, luasandbox_lib_collect, NULL);
+	if (status != 0) {
+		php_error_docref(NULL, E_CORE_WARNING,
+			"unable to initialise the Lua standard library: %s",
+			luasandbox_error_to_string(L, -1));
+	}
+	lua_close(L);
+	return status == 0 ? SUCCESS : FAILURE;
+}
+/* }}} */
 
-	// Filter the os library
-	lua_getglobal(L, "os");
-	luasandbox_lib_filter_table(L, luasandbox_allowed_os_members);
-	lua_setglobal(L, "os");
+/** {{{ luasandbox_lib_mshutdown */
+void luasandbox_lib_mshutdown()
+{
+	luasandbox_lib_template * lib;
+	int i;
 
-	// Filter the debug library
-	lua_getglobal(L, "debug");
-	luasandbox_lib_filter_table(L, luasandbox_allowed_debug_members);
-	lua_setglobal(L, "debug");
+	for (lib = luasandbox_libs; lib->open; lib++) {
+		if (lib->members) {
+			for (i = 0; i < lib->num_members; i++) {
+				pefree(lib->members[i].name, 1);
+			}
+			pefree(lib->members, 1);
+			lib->members = NULL;
+			lib->num_members = 0;
+		}
+	}
+}
+/* }}} */
 
-	// Remove any globals that aren't in a whitelist. This is mostly to remove
-	// unsafe functions from the base library.
-	lua_pushnil(L);
-	while (lua_next(L, LUA_GLOBALSINDEX) != 0) {
-		const char * key;
-		size_t key_len;
-		lua_pop(L, 1);
-		if (lua_type(L, -1) != LUA_TSTRING) {
-			continue;
+/** {{{ luasandbox_lib_collect
+ *
+ * The body of luasandbox_lib_minit(), run under lua_cpcall()
+ */
+static int luasandbox_lib_collect(lua_State * L)
+{
+	luasandbox_lib_template * lib;
+	int i, n, table;
+
+	for (lib = luasandbox_libs; lib->open; lib++) {
+		lua_pushcfunction(L, lib->open);
+		lua_call(L, 0, 0);
+		if (lib->name) {
+			lua_getglobal(L, lib->name);
+		} else {
+			lua_pushvalue(L, LUA_GLOBALSINDEX);
 		}
-		key = lua_tolstring(L, -1, &key_len);
-		if (!zend_hash_str_exists(luasandbox_lib_get_allowed_globals(), key, key_len)) {
-			// Not allowed, delete it
+		table = lua_gettop(L);
+
+		if (lib->allowed) {
+			for (n = 0; lib->allowed[n]; n++);
+		} else {
+			n = 0;
+			lua_pushnil(L);
+			while (lua_next(L, table) != 0) {
+				lua_pop(L, 1);
+				n++;
+			}
+		}
+
+		lib->members = pecalloc(n ? n : 1, sizeof(luasandbox_lib_member), 1);
+		if (lib->allowed) {
+			for (i = 0; lib->allowed[i]; i++) {
+				lua_getfield(L, table, lib->allowed[i]);
+				if (!lua_isnil(L, -1) && luasandbox_lib_collect_member(L,
+					lib->allowed[i], &lib->members[lib->num_members]))
+				{
+					lib->num_members++;
+				}
+				lua_pop(L, 1);
+			}
+		} else {
 			lua_pushnil(L);
-			lua_setglobal(L, key);
+			while (lua_next(L, table) != 0) {
+				if (lua_type(L, -2) == LUA_TSTRING && luasandbox_lib_collect_member(L,
+					lua_tostring(L, -2), &lib->members[lib->num_members]))
+				{
+					lib->num_members++;
+				}
+				lua_pop(L, 1);
+			}
+		}
+		lua_settop(L, table - 1);
+	}
+	return 0;
+}
+/* }}} */
+
+/** {{{ luasandbox_lib_collect_member
+ *
+ * Record the library member at the top of the stack. Only numbers and C
+ * functions which have either no upvalues or a single C function upvalue,
+ * like pairs and ipairs, can be recreated. Return 0 if the member is
+ * something else.
+ */
+static int luasandbox_lib_collect_member(lua_State * L, const char * name,
+	luasandbox_lib_member * member)
+{
+	int index = lua_gettop(L);
+
+	if (lua_type(L, index) == LUA_TNUMBER) {
+		member->number = lua_tonumber(L, index);
+	} else if (lua_iscfunction(L, index)) {
+		member->func = lua_tocfunction(L, index);
+		if (lua_getupvalue(L, index, 1)) {
+			if (!lua_iscfunction(L, -1) || lua_getupvalue(L, -1, 1)) {
+				lua_settop(L, index);
+				return 0;
+			}
+			member->upvalue = lua_tocfunction(L, -1);
+			lua_pop(L, 1);
+			if (lua_getupvalue(L, index, 2)) {
+				lua_pop(L, 1);
+				return 0;
+			}
+		}
+	} else {
+		return 0;
+	}
+	member->type = lua_type(L, index);
+	member->name = pestrdup(name, 1);
+	return 1;
+}
+/* }}} */
+
+/** {{{  luasandbox_lib_register
+ *
+ * Create the standard library in the global table. If lazy is nonzero, the
+ * libraries which allow it are initially empty placeholders, filled in on
+ * first access by luasandbox_lib_materialize(). If slim is nonzero, only the
+ * base, string, table and math libraries are created.
+ */
+void luasandbox_lib_register(lua_State * L, int lazy, int slim)
+{
+	luasandbox_lib_template * lib;
+	const char ** name;
+
+	// Copy the allowed parts of the standard libraries
+	for (lib = luasandbox_libs; lib->open; lib++) {
+		if (slim && !lib->slim) {
+			continue;
+		} else if (!lib->name) {
+			lua_pushvalue(L, LUA_GLOBALSINDEX);
+			luasandbox_lib_fill(L, lib);
+			lua_pop(L, 1);
+		} else if (lazy && lib->lazy) {
+			luasandbox_lib_push_placeholder(L, lib - luasandbox_libs);
+			lua_setglobal(L, lib->name);
+		} else {
+			lua_createtable(L, 0, lib->num_members);
+			luasandbox_lib_fill(L, lib);
+			lua_setglobal(L, lib->name);
 		}
 	}
+	lua_pushvalue(L, LUA_GLOBALSINDEX);
+	lua_setglobal(L, "_G");
+	lua_pushliteral(L, LUA_VERSION);
+	lua_setglobal(L, "_VERSION");
 
-	// Install our own versions of tostring, pcall, xpcall, unpack
-	lua_pushcfunction(L, luasandbox_base_tostring);
-	lua_setglobal(L, "tostring");
-	lua_pushcfunction(L, luasandbox_base_pcall);
-	lua_setglobal(L, "pcall");
-	lua_pushcfunction(L, luasandbox_base_xpcall);
-	lua_setglobal(L, "xpcall");
-	lua_pushcfunction(L, luasandbox_base_unpack);
-	lua_setglobal(L, "unpack");
+	// Install our own string library
+	lua_pushcfunction(L, luasandbox_open_string);
+	lua_call(L, 0, 0);
 
 	// Remove string.dump: may expose private data
 	lua_getglobal(L, "string");
@@ -164,21 +359,6 @@ void luasandbox_lib_register(lua_State * L)
 	lua_setfield(L, -2, "dump");
 	lua_pop(L, 1);
 
-	// Install our own versions of math.random and math.randomseed
-	lua_getglobal(L, "math");
-	lua_pushcfunction(L, luasandbox_math_random);
-	lua_setfield(L, -2, "random");
-	lua_pushcfunction(L, luasandbox_math_randomseed);
-	lua_setfield(L, -2, "randomseed");
-	lua_pop(L, 1);
-
-	// Install our own version of os.clock(), which uses our high-resolution
-	// usage timer
-	lua_getglobal(L, "os");
-	lua_pushcfunction(L, luasandbox_os_clock);
-	lua_setfield(L, -2, "clock");
-	lua_pop(L, 1);
-
 	// Install our own versions of pairs and ipairs, if necessary
 #if LUA_VERSION_NUM < 502
 	lua_getfield(L, LUA_GLOBALSINDEX, "pairs");
@@ -190,64 +370,199 @@ void luasandbox_lib_register(lua_State * L)
 	lua_pushcfunction(L, luasandbox_base_ipairs);
 	lua_setglobal(L, "ipairs");
 #endif
+
+	if (lazy) {
+		for (name = luasandbox_lazy_wrapped_functions; *name; name++) {
+			lua_pushvalue(L, LUA_GLOBALSINDEX);
+			luasandbox_lib_wrap(L, *name);
+			lua_pop(L, 1);
+		}
+		lua_getglobal(L, "table");
+		luasandbox_lib_wrap(L, "foreach");
+		lua_pop(L, 1);
+	}
 }
 /* }}} */
 
-/** {{{ luasandbox_lib_filter_table
+/** {{{ luasandbox_lib_fill
  *
- * Make a copy of the table at the top of the stack, and remove any members
- * from it that aren't in the given whitelist.
+ * Add the recorded members of a library, and our overrides, to the table at
+ * the top of the stack. This does not invoke metamethods.
  */
-static void luasandbox_lib_filter_table(lua_State * L, char ** member_names)
+static void luasandbox_lib_fill(lua_State * L, luasandbox_lib_template * lib)
 {
-	int i, n;
-	int si = lua_gettop(L);
-	for (n = 0; member_names[n]; n++);
-	lua_createtable(L, 0, n);
-	for (i = 0; member_names[i]; i++) {
-		lua_getfield(L, si, member_names[i]);
-		lua_setfield(L, si+1, member_names[i]);
+	luasandbox_lib_member * member;
+	const luaL_Reg * reg;
+	int i;
+
+	for (i = 0; i < lib->num_members; i++) {
+		member = &lib->members[i];
+		lua_pushstring(L, member->name);
+		if (member->type == LUA_TNUMBER) {
+			lua_pushnumber(L, member->number);
+		} else if (member->upvalue) {
+			lua_pushcfunction(L, member->upvalue);
+			lua_pushcclosure(L, member->func, 1);
+		} else {
+			lua_pushcfunction(L, member->func);
+		}
+		lua_rawset(L, -3);
+	}
+	for (reg = lib->overrides; reg && reg->name; reg++) {
+		lua_pushstring(L, reg->name);
+		lua_pushcfunction(L, reg->func);
+		lua_rawset(L, -3);
 	}
-	lua_replace(L, si);
 }
 /* }}} */
 
-/** {{{ luasandbox_lib_destroy_globals */
-void luasandbox_lib_destroy_globals()
+/** {{{ luasandbox_lib_push_placeholder
+ *
+ * Push an empty table standing in for the given library. Its metatable loads
+ * the library into it when a member is read or written. The table is sized
+ * as luasandbox_lib_register() sizes an eager library, so that once it is
+ * filled, its members are in the same order for next() and pairs().
+ */
+static void luasandbox_lib_push_placeholder(lua_State * L, int lib_index)
+{
+	lua_createtable(L, 0, luasandbox_libs[lib_index].num_members);
+	lua_createtable(L, 0, 2);
+	lua_pushinteger(L, lib_index);
+	lua_pushcclosure(L, luasandbox_lib_lazy_index, 1);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, luasandbox_lib_lazy_newindex);
+	lua_setfield(L, -2, "__newindex");
+	lua_setmetatable(L, -2);
+}
+/* }}} */
+
+/** {{{ luasandbox_lib_get_placeholder
+ *
+ * If the value at the given index is a library placeholder, return the index
+ * of its library in luasandbox_libs. Otherwise return -1.
+ */
+static int luasandbox_lib_get_placeholder(lua_State * L, int index)
 {
-	if (LUASANDBOX_G(allowed_globals)) {
-		zend_hash_destroy(LUASANDBOX_G(allowed_globals));
-		FREE_HASHTABLE(LUASANDBOX_G(allowed_globals));
-		LUASANDBOX_G(allowed_globals) = NULL;
+	int lib_index = -1;
+
+	if (!lua_istable(L, index) || !lua_getmetatable(L, index)) {
+		return -1;
 	}
+	lua_pushliteral(L, "__index");
+	lua_rawget(L, -2);
+	if (lua_tocfunction(L, -1) == luasandbox_lib_lazy_index) {
+		lua_getupvalue(L, -1, 1);
+		lib_index = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 2);
+	return lib_index;
+}
+/* }}} */
+
+/** {{{ luasandbox_lib_is_placeholder
+ *
+ * Return nonzero if the value at the given index is a library placeholder
+ * which has not been loaded yet.
+ */
+int luasandbox_lib_is_placeholder(lua_State * L, int index)
+{
+	return luasandbox_lib_get_placeholder(L, index) >= 0;
 }
 /* }}} */
 
-/** {{{ luasandbox_lib_get_allowed_globals
+/** {{{ luasandbox_lib_materialize
  *
- * Get a HashTable of allowed global variables
+ * If the value at the given index is a library placeholder, load the library
+ * into it and remove its metatable, so that it is indistinguishable from a
+ * library which was loaded eagerly. This may raise a memory error.
  */
-static HashTable * luasandbox_lib_get_allowed_globals()
+void luasandbox_lib_materialize(lua_State * L, int index)
 {
-	int i, n;
-	if (LUASANDBOX_G(allowed_globals)) {
-		return LUASANDBOX_G(allowed_globals);
+	int lib_index = luasandbox_lib_get_placeholder(L, index);
+
+	if (lib_index < 0) {
+		return;
+	}
+	if (index < 0) {
+		index += lua_gettop(L) + 1;
 	}
 
-	for (n = 0; luasandbox_allowed_globals[n]; n++);
+	// Fill before removing the metatable, so that after a memory error the
+	// placeholder can be filled again
+	lua_pushvalue(L, index);
+	luasandbox_lib_fill(L, &luasandbox_libs[lib_index]);
+	lua_pushnil(L);
+	lua_setmetatable(L, -2);
+	lua_pop(L, 1);
+}
+/* }}} */
+
+/** {{{ luasandbox_lib_materialize_protected
+ *
+ * luasandbox_lib_materialize() for the value at index 1, for use with
+ * lua_pcall().
+ */
+int luasandbox_lib_materialize_protected(lua_State * L)
+{
+	luasandbox_lib_materialize(L, 1);
+	return 0;
+}
+/* }}} */
 
-	ALLOC_HASHTABLE(LUASANDBOX_G(allowed_globals));
-	zend_hash_init(LUASANDBOX_G(allowed_globals), n, NULL, NULL, 0);
+/** {{{ luasandbox_lib_lazy_index
+ *
+ * The __index metamethod of a library placeholder
+ */
+static int luasandbox_lib_lazy_index(lua_State * L)
+{
+	lua_settop(L, 2);
+	luasandbox_lib_materialize(L, 1);
+	lua_rawget(L, 1);
+	return 1;
+}
+/* }}} */
 
-	zval zv;
-	ZVAL_TRUE(&zv);
+/** {{{ luasandbox_lib_lazy_newindex
+ *
+ * The __newindex metamethod of a library placeholder
+ */
+static int luasandbox_lib_lazy_newindex(lua_State * L)
+{
+	lua_settop(L, 3);
+	luasandbox_lib_materialize(L, 1);
+	lua_rawset(L, 1);
+	return 0;
+}
+/* }}} */
 
-	for (i = 0; luasandbox_allowed_globals[i]; i++) {
-		zend_hash_str_update(LUASANDBOX_G(allowed_globals),
-			luasandbox_allowed_globals[i], strlen(luasandbox_allowed_globals[i]), &zv);
+/** {{{ luasandbox_lib_wrap
+ *
+ * Replace the C function with the given name in the table at the top of the
+ * stack with luasandbox_lib_lazy_wrapper().
+ */
+static void luasandbox_lib_wrap(lua_State * L, const char * name)
+{
+	lua_getfield(L, -1, name);
+	if (!lua_iscfunction(L, -1)) {
+		lua_pop(L, 1);
+		return;
 	}
+	lua_pushcclosure(L, luasandbox_lib_lazy_wrapper, 1);
+	lua_setfield(L, -2, name);
+}
+/* }}} */
 
-	return LUASANDBOX_G(allowed_globals);
+/** {{{ luasandbox_lib_lazy_wrapper
+ *
+ * Load the library if the first argument is a library placeholder, then call
+ * the wrapped function, which is a C function without upvalues.
+ */
+static int luasandbox_lib_lazy_wrapper(lua_State * L)
+{
+	lua_CFunction f = lua_tocfunction(L, lua_upvalueindex(1));
+	luasandbox_lib_materialize(L, 1);
+	return f(L);
 }
 /* }}} */
 
@@ -507,6 +822,7 @@ static int luasandbox_base_unpack(lua_State * L) {
  */
 static int luasandbox_base_pairs (lua_State *L)
 {
+	luasandbox_lib_materialize(L, 1);
 	if (!luaL_getmetafield(L, 1, "__pairs")) {
 		luaL_checktype(L, 1, LUA_TTABLE);
 		lua_getfield(L, LUA_REGISTRYINDEX, "luasandbox_old_pairs");
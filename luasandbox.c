@@ -33,16 +33,43 @@ typedef zval* star_param_t;
 	}
 
 static PHP_GINIT_FUNCTION(luasandbox);
+static ZEND_MODULE_POST_ZEND_DEACTIVATE_D(luasandbox);
 static PHP_GSHUTDOWN_FUNCTION(luasandbox);
-static int luasandbox_post_deactivate();
 static object_constructor_ret_t luasandbox_new(zend_class_entry *ce);
 static lua_State * luasandbox_newstate(php_luasandbox_obj * intern);
+static lua_State * luasandbox_get_state(php_luasandbox_obj * sandbox);
+static void luasandbox_set_options(php_luasandbox_obj * sandbox, HashTable * options);
+static void luasandbox_get_int_option(zend_string * key, zval * value, zend_long min, int * dest);
+static void luasandbox_persistent_attach(php_luasandbox_persistent * entry,
+	php_luasandbox_obj * sandbox);
+static void luasandbox_persistent_release(php_luasandbox_obj * sandbox);
+static void luasandbox_persistent_free(php_luasandbox_persistent * entry);
+static int luasandbox_baseline_save_protected(lua_State * L);
+static void luasandbox_baseline_add(lua_State * L, int baseline, int index);
+static int luasandbox_baseline_restore_protected(lua_State * L);
+static int luasandbox_reset_protected(lua_State * L);
+static void luasandbox_raise_php_exception(lua_State * L);
 static void luasandbox_free_storage(zend_object *object);
+#if PHP_VERSION_ID < 80000
+static HashTable * luasandbox_get_gc(zval * object, zval ** table, int * n);
+#else
+static HashTable * luasandbox_get_gc(zend_object * object, zval ** table, int * n);
+#endif
 static object_constructor_ret_t luasandboxfunction_new(zend_class_entry *ce);
 static void luasandboxfunction_free_storage(zend_object *object);
+static object_constructor_ret_t luasandboxgroup_new(zend_class_entry *ce);
+static void luasandboxgroup_free_storage(zend_object *object);
+static void luasandbox_dtor(zend_object *object);
+static void luasandbox_leave_group(php_luasandbox_obj * sandbox);
+static void luasandbox_set_group(php_luasandbox_obj * sandbox, zval * zgroup);
 static int luasandbox_panic(lua_State * L);
 static lua_State * luasandbox_state_from_zval(zval * this_ptr);
 static void luasandbox_load_helper(int binary, INTERNAL_FUNCTION_PARAMETERS);
+static void luasandbox_call_function_helper(int with_options, INTERNAL_FUNCTION_PARAMETERS);
+static void luasandboxfunction_call_helper(int with_options, INTERNAL_FUNCTION_PARAMETERS);
+static int luasandbox_set_call_options(php_luasandbox_obj * sandbox, HashTable * options);
+struct luasandbox_load_helper_params;
+static void luasandbox_load_chunk(struct luasandbox_load_helper_params * p);
 static int luasandbox_find_field(lua_State * L, int index,
 	char * spec, int specLength);
 static void luasandbox_set_timespec(struct timespec * dest, double source);
@@ -76,13 +103,19 @@ zend_class_entry *luasandboxerrorerror_ce;
 zend_class_entry *luasandboxtimeouterror_ce;
 zend_class_entry *luasandboxemergencytimeouterror_ce;
 zend_class_entry *luasandboxfunction_ce;
+zend_class_entry *luasandboxgroup_ce;
 
 ZEND_DECLARE_MODULE_GLOBALS(luasandbox);
 
 static zend_object_handlers luasandbox_object_handlers;
 static zend_object_handlers luasandboxfunction_object_handlers;
+static zend_object_handlers luasandboxgroup_object_handlers;
 
 /** {{{ arginfo */
+ZEND_BEGIN_ARG_INFO_EX(arginfo_luasandbox___construct, 0, 0, 0)
+	ZEND_ARG_INFO(0, options)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_getVersionInfo, 0)
 ZEND_END_ARG_INFO()
 
@@ -96,16 +129,55 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_luasandbox_loadBinary, 0, 0, 1)
 	ZEND_ARG_INFO(0, chunkName)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_loadPreloaded, 0)
+	ZEND_ARG_INFO(0, name)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_setMemoryLimit, 0)
 	ZEND_ARG_INFO(0, limit)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_luasandbox_setSoftMemoryLimit, 0, 0, 1)
+	ZEND_ARG_INFO(0, limit)
+	ZEND_ARG_INFO(0, callback)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_getMemoryUsage, 0)
 ZEND_END_ARG_INFO()
 
 ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_getPeakMemoryUsage, 0)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_collectGarbage, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_stepGarbageCollector, 0)
+	ZEND_ARG_INFO(0, kb)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_luasandbox_setGCParameters, 0, 0, 1)
+	ZEND_ARG_INFO(0, pause)
+	ZEND_ARG_INFO(0, stepmul)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_getGCStats, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_luasandbox_setIdleGCBudget, 0, 0, 1)
+	ZEND_ARG_INFO(0, usec)
+	ZEND_ARG_INFO(0, stepmul)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_luasandbox_runIdleGC, 0, 0, 1)
+	ZEND_ARG_INFO(0, usec)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_getAllocatorStats, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_getMemoryBreakdown, 0)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_setCPULimit, 0)
 	ZEND_ARG_INFO(0, limit)
 ZEND_END_ARG_INFO()
@@ -113,6 +185,20 @@ ZEND_END_ARG_INFO()
 ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_getCPUUsage, 0)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_setWallClockLimit, 0)
+	ZEND_ARG_INFO(0, limit)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_getWallClockUsage, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_setInstructionLimit, 0)
+	ZEND_ARG_INFO(0, limit)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_getInstructionCount, 0)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_pauseUsageTimer, 0)
 ZEND_END_ARG_INFO()
 
@@ -126,6 +212,17 @@ ZEND_END_ARG_INFO()
 ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_disableProfiler, 0)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_luasandbox_enableMemoryProfiler, 0, 0, 0)
+	ZEND_ARG_INFO(0, interval)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_disableMemoryProfiler, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_luasandbox_getMemoryProfilerReport, 0, 0, 0)
+	ZEND_ARG_INFO(0, stacks)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO_EX(arginfo_luasandbox_getProfilerFunctionReport, 0, 0, 0)
 	ZEND_ARG_INFO(0, units)
 ZEND_END_ARG_INFO()
@@ -139,6 +236,19 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_luasandbox_callFunction, 0, 0, 1)
 #endif
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_luasandbox_callFunctionWithOptions, 0, 0, 2)
+	ZEND_ARG_INFO(0, name)
+	ZEND_ARG_ARRAY_INFO(0, options, 0)
+#ifdef ZEND_ARG_VARIADIC_INFO
+	ZEND_ARG_VARIADIC_INFO(0, args)
+#else
+	ZEND_ARG_INFO(0, ...)
+#endif
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_getLastCallMemoryDelta, 0)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_wrapPhpFunction, 0)
 	ZEND_ARG_INFO(0, function)
 ZEND_END_ARG_INFO()
@@ -148,6 +258,19 @@ ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_registerLibrary, 0)
 	ZEND_ARG_INFO(0, functions)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_cloneFrom, 0)
+	ZEND_ARG_OBJ_INFO(0, template, LuaSandbox, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_luasandbox_getPersistent, 0, 0, 1)
+	ZEND_ARG_INFO(0, name)
+	ZEND_ARG_INFO(0, initializer)
+	ZEND_ARG_ARRAY_INFO(0, options, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_luasandbox_reset, 0)
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO(arginfo_luasandboxfunction___construct, 0)
 ZEND_END_ARG_INFO()
 
@@ -159,9 +282,28 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_luasandboxfunction_call, 0, 0, 0)
 #endif
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO_EX(arginfo_luasandboxfunction_callWithOptions, 0, 0, 1)
+	ZEND_ARG_ARRAY_INFO(0, options, 0)
+#ifdef ZEND_ARG_VARIADIC_INFO
+	ZEND_ARG_VARIADIC_INFO(0, args)
+#else
+	ZEND_ARG_INFO(0, ...)
+#endif
+ZEND_END_ARG_INFO()
+
 ZEND_BEGIN_ARG_INFO(arginfo_luasandboxfunction_dump, 0)
 ZEND_END_ARG_INFO()
 
+ZEND_BEGIN_ARG_INFO(arginfo_luasandboxgroup_setMemoryLimit, 0)
+	ZEND_ARG_INFO(0, limit)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_luasandboxgroup_getMemoryUsage, 0)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO(arginfo_luasandboxgroup_getPeakMemoryUsage, 0)
+ZEND_END_ARG_INFO()
+
 /* }}} */
 
 /** {{{ function entries */
@@ -170,22 +312,45 @@ const zend_function_entry luasandbox_functions[] = {
 };
 
 const zend_function_entry luasandbox_methods[] = {
+	PHP_ME(LuaSandbox, __construct, arginfo_luasandbox___construct, 0)
 	PHP_ME(LuaSandbox, getVersionInfo, arginfo_luasandbox_getVersionInfo, ZEND_ACC_PUBLIC|ZEND_ACC_STATIC)
 	PHP_ME(LuaSandbox, loadString, arginfo_luasandbox_loadString, 0)
 	PHP_ME(LuaSandbox, loadBinary, arginfo_luasandbox_loadBinary, 0)
+	PHP_ME(LuaSandbox, loadPreloaded, arginfo_luasandbox_loadPreloaded, 0)
 	PHP_ME(LuaSandbox, setMemoryLimit, arginfo_luasandbox_setMemoryLimit, 0)
+	PHP_ME(LuaSandbox, setSoftMemoryLimit, arginfo_luasandbox_setSoftMemoryLimit, 0)
 	PHP_ME(LuaSandbox, getMemoryUsage, arginfo_luasandbox_getMemoryUsage, 0)
 	PHP_ME(LuaSandbox, getPeakMemoryUsage, arginfo_luasandbox_getPeakMemoryUsage, 0)
+	PHP_ME(LuaSandbox, collectGarbage, arginfo_luasandbox_collectGarbage, 0)
+	PHP_ME(LuaSandbox, stepGarbageCollector, arginfo_luasandbox_stepGarbageCollector, 0)
+	PHP_ME(LuaSandbox, setGCParameters, arginfo_luasandbox_setGCParameters, 0)
+	PHP_ME(LuaSandbox, getGCStats, arginfo_luasandbox_getGCStats, 0)
+	PHP_ME(LuaSandbox, setIdleGCBudget, arginfo_luasandbox_setIdleGCBudget, 0)
+	PHP_ME(LuaSandbox, runIdleGC, arginfo_luasandbox_runIdleGC, 0)
+	PHP_ME(LuaSandbox, getAllocatorStats, arginfo_luasandbox_getAllocatorStats, 0)
+	PHP_ME(LuaSandbox, getMemoryBreakdown, arginfo_luasandbox_getMemoryBreakdown, 0)
 	PHP_ME(LuaSandbox, setCPULimit, arginfo_luasandbox_setCPULimit, 0)
 	PHP_ME(LuaSandbox, getCPUUsage, arginfo_luasandbox_getCPUUsage, 0)
+	PHP_ME(LuaSandbox, setWallClockLimit, arginfo_luasandbox_setWallClockLimit, 0)
+	PHP_ME(LuaSandbox, getWallClockUsage, arginfo_luasandbox_getWallClockUsage, 0)
+	PHP_ME(LuaSandbox, setInstructionLimit, arginfo_luasandbox_setInstructionLimit, 0)
+	PHP_ME(LuaSandbox, getInstructionCount, arginfo_luasandbox_getInstructionCount, 0)
 	PHP_ME(LuaSandbox, pauseUsageTimer, arginfo_luasandbox_pauseUsageTimer, 0)
 	PHP_ME(LuaSandbox, unpauseUsageTimer, arginfo_luasandbox_unpauseUsageTimer, 0)
 	PHP_ME(LuaSandbox, enableProfiler, arginfo_luasandbox_enableProfiler, 0)
 	PHP_ME(LuaSandbox, disableProfiler, arginfo_luasandbox_disableProfiler, 0)
 	PHP_ME(LuaSandbox, getProfilerFunctionReport, arginfo_luasandbox_getProfilerFunctionReport, 0)
+	PHP_ME(LuaSandbox, enableMemoryProfiler, arginfo_luasandbox_enableMemoryProfiler, 0)
+	PHP_ME(LuaSandbox, disableMemoryProfiler, arginfo_luasandbox_disableMemoryProfiler, 0)
+	PHP_ME(LuaSandbox, getMemoryProfilerReport, arginfo_luasandbox_getMemoryProfilerReport, 0)
 	PHP_ME(LuaSandbox, callFunction, arginfo_luasandbox_callFunction, 0)
+	PHP_ME(LuaSandbox, callFunctionWithOptions, arginfo_luasandbox_callFunctionWithOptions, 0)
+	PHP_ME(LuaSandbox, getLastCallMemoryDelta, arginfo_luasandbox_getLastCallMemoryDelta, 0)
 	PHP_ME(LuaSandbox, wrapPhpFunction, arginfo_luasandbox_wrapPhpFunction, 0)
 	PHP_ME(LuaSandbox, registerLibrary, arginfo_luasandbox_registerLibrary, 0)
+	PHP_ME(LuaSandbox, cloneFrom, arginfo_luasandbox_cloneFrom, ZEND_ACC_PUBLIC|ZEND_ACC_STATIC)
+	PHP_ME(LuaSandbox, getPersistent, arginfo_luasandbox_getPersistent, ZEND_ACC_PUBLIC|ZEND_ACC_STATIC)
+	PHP_ME(LuaSandbox, reset, arginfo_luasandbox_reset, 0)
 	ZEND_FE_END
 };
 
@@ -193,16 +358,31 @@ const zend_function_entry luasandboxfunction_methods[] = {
 	PHP_ME(LuaSandboxFunction, __construct, arginfo_luasandboxfunction___construct,
 		ZEND_ACC_PRIVATE | ZEND_ACC_FINAL)
 	PHP_ME(LuaSandboxFunction, call, arginfo_luasandboxfunction_call, 0)
+	PHP_ME(LuaSandboxFunction, callWithOptions, arginfo_luasandboxfunction_callWithOptions, 0)
 	PHP_ME(LuaSandboxFunction, dump, arginfo_luasandboxfunction_dump, 0)
 	ZEND_FE_END
 };
 
+const zend_function_entry luasandboxgroup_methods[] = {
+	PHP_ME(LuaSandboxGroup, setMemoryLimit, arginfo_luasandboxgroup_setMemoryLimit, 0)
+	PHP_ME(LuaSandboxGroup, getMemoryUsage, arginfo_luasandboxgroup_getMemoryUsage, 0)
+	PHP_ME(LuaSandboxGroup, getPeakMemoryUsage, arginfo_luasandboxgroup_getPeakMemoryUsage, 0)
+	ZEND_FE_END
+};
+
 const zend_function_entry luasandbox_empty_methods[] = {
 	ZEND_FE_END
 };
 
 /* }}} */
 
+/** {{{ INI entries */
+PHP_INI_BEGIN()
+	// Lua source files to compile at startup, for LuaSandbox::loadPreloaded()
+	PHP_INI_ENTRY("luasandbox.preload", "", PHP_INI_SYSTEM, NULL)
+PHP_INI_END()
+/* }}} */
+
 /* {{{ luasandbox_module_entry
  */
 zend_module_entry luasandbox_module_entry = {
@@ -218,7 +398,7 @@ zend_module_entry luasandbox_module_entry = {
 	PHP_MODULE_GLOBALS(luasandbox),
 	PHP_GINIT(luasandbox),
 	PHP_GSHUTDOWN(luasandbox),
-	luasandbox_post_deactivate,
+	ZEND_MODULE_POST_ZEND_DEACTIVATE_N(luasandbox), /* post deactivate */
 	STANDARD_MODULE_PROPERTIES_EX
 };
 /* }}} */
@@ -231,9 +411,7 @@ ZEND_GET_MODULE(luasandbox)
  */
 PHP_MINIT_FUNCTION(luasandbox)
 {
-	/* If you have INI entries, uncomment these lines
 	REGISTER_INI_ENTRIES();
-	*/
 
 	zend_class_entry ce;
 	INIT_CLASS_ENTRY(ce, "LuaSandbox", luasandbox_methods);
@@ -285,16 +463,26 @@ PHP_MINIT_FUNCTION(luasandbox)
 	luasandboxfunction_ce = zend_register_internal_class(&ce);
 	luasandboxfunction_ce->create_object = luasandboxfunction_new;
 
+	INIT_CLASS_ENTRY(ce, "LuaSandboxGroup", luasandboxgroup_methods);
+	luasandboxgroup_ce = zend_register_internal_class(&ce);
+	luasandboxgroup_ce->create_object = luasandboxgroup_new;
+
 	memcpy(&luasandbox_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
 	luasandbox_object_handlers.offset = offsetof(php_luasandbox_obj, std);
 	luasandbox_object_handlers.free_obj = (zend_object_free_obj_t)luasandbox_free_storage;
+	luasandbox_object_handlers.dtor_obj = (zend_object_dtor_obj_t)luasandbox_dtor;
+	luasandbox_object_handlers.get_gc = luasandbox_get_gc;
 	memcpy(&luasandboxfunction_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
 	luasandboxfunction_object_handlers.offset = offsetof(php_luasandboxfunction_obj, std);
 	luasandboxfunction_object_handlers.free_obj = (zend_object_free_obj_t)luasandboxfunction_free_storage;
+	memcpy(&luasandboxgroup_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
+	luasandboxgroup_object_handlers.offset = offsetof(php_luasandbox_group, std);
+	luasandboxgroup_object_handlers.free_obj = (zend_object_free_obj_t)luasandboxgroup_free_storage;
 
 	luasandbox_timer_minit();
+	luasandbox_preload_minit(INI_STR("luasandbox.preload"));
 
-	return SUCCESS;
+	return luasandbox_lib_minit();
 }
 /* }}} */
 
@@ -308,6 +496,16 @@ static PHP_GINIT_FUNCTION(luasandbox)
 /** {{{ luasandbox_destroy_globals */
 static PHP_GSHUTDOWN_FUNCTION(luasandbox)
 {
+	php_luasandbox_persistent * entry;
+
+	if (luasandbox_globals->persistent_sandboxes) {
+		ZEND_HASH_FOREACH_PTR(luasandbox_globals->persistent_sandboxes, entry) {
+			luasandbox_persistent_free(entry);
+		} ZEND_HASH_FOREACH_END();
+		zend_hash_destroy(luasandbox_globals->persistent_sandboxes);
+		pefree(luasandbox_globals->persistent_sandboxes, 1);
+		luasandbox_globals->persistent_sandboxes = NULL;
+	}
 }
 /* }}} */
 
@@ -316,6 +514,9 @@ static PHP_GSHUTDOWN_FUNCTION(luasandbox)
 PHP_MSHUTDOWN_FUNCTION(luasandbox)
 {
 	luasandbox_timer_mshutdown();
+	luasandbox_lib_mshutdown();
+	luasandbox_preload_mshutdown();
+	UNREGISTER_INI_ENTRIES();
 	return SUCCESS;
 }
 /* }}} */
@@ -327,9 +528,14 @@ PHP_RSHUTDOWN_FUNCTION(luasandbox)
 }
 /* }}} */
 
-static int luasandbox_post_deactivate() /* {{{ */
+/** {{{ luasandbox post deactivate
+ *
+ * Runs after the executor has freed all objects, so anything left here
+ * belongs to sandboxes that were never freed.
+ */
+static ZEND_MODULE_POST_ZEND_DEACTIVATE_D(luasandbox)
 {
-	luasandbox_lib_destroy_globals();
+	luasandbox_alloc_post_deactivate();
 	return SUCCESS;
 }
 /* }}} */
@@ -341,6 +547,8 @@ PHP_MINFO_FUNCTION(luasandbox)
 	php_info_print_table_start();
 	php_info_print_table_header(2, "luasandbox support", "enabled");
 	php_info_print_table_end();
+
+	DISPLAY_INI_ENTRIES();
 }
 /* }}} */
 
@@ -363,10 +571,18 @@ static object_constructor_ret_t luasandbox_new(zend_class_entry *ce)
 	object_properties_init(&sandbox->std, ce);
 	sandbox->std.handlers = &luasandbox_object_handlers;
 	sandbox->alloc.memory_limit = (size_t)-1;
+	sandbox->alloc.soft_memory_limit = (size_t)-1;
+	sandbox->call_memory_allowance = (size_t)-1;
+	sandbox->alloc.gc_pause_floor = 0;
+	sandbox->alloc.gc_pause_ceiling = 200;
+	sandbox->alloc.gc_bands = 32;
+	sandbox->alloc.region_size = LUASANDBOX_DEFAULT_MMAP_SIZE;
+	// Increase the GC step size (T349462)
+	sandbox->gc_stepmul = 2000;
 	sandbox->allow_pause = 1;
 
-	// Initialise the Lua state
-	sandbox->state = luasandbox_newstate(sandbox);
+	// The Lua state is created by the constructor, or attached by a static
+	// factory method such as getPersistent()
 
 	// Initialise the timer
 	luasandbox_timer_create(&sandbox->timer, sandbox);
@@ -376,6 +592,16 @@ static object_constructor_ret_t luasandbox_new(zend_class_entry *ce)
 }
 /* }}} */
 
+/** {{{ luasandbox_call_stepmul
+ *
+ * Get the GC step multiplier to use while Lua code is running
+ */
+static inline int luasandbox_call_stepmul(php_luasandbox_obj * sandbox)
+{
+	return sandbox->idle_gc_budget ? sandbox->idle_gc_call_stepmul : sandbox->gc_stepmul;
+}
+/* }}} */
+
 /** {{{ luasandbox_newstate
  *
  * Create a new lua_State which is suitable for running sandboxed scripts in.
@@ -383,7 +609,24 @@ static object_constructor_ret_t luasandbox_new(zend_class_entry *ce)
  */
 static lua_State * luasandbox_newstate(php_luasandbox_obj * intern)
 {
-	lua_State * L = luasandbox_alloc_new_state(&intern->alloc, intern);
+	lua_State * L;
+	size_t old_memory_limit = intern->alloc.memory_limit;
+
+	// There is no point reserving much more address space than the memory
+	// limit allows. Twice the limit leaves room for the size class rounding.
+	if (intern->alloc.allocator == LUASANDBOX_ALLOCATOR_MMAP
+		&& old_memory_limit < intern->alloc.region_size / 2)
+	{
+		intern->alloc.region_size = old_memory_limit * 2;
+		if (intern->alloc.region_size < LUASANDBOX_MIN_MMAP_SIZE) {
+			intern->alloc.region_size = LUASANDBOX_MIN_MMAP_SIZE;
+		}
+	}
+
+	// The standard environment is not subject to the sandbox or group limits
+	intern->alloc.memory_limit = (size_t)-1;
+	intern->alloc.limit_lifted++;
+	L = luasandbox_alloc_new_state(&intern->alloc, intern);
 
 	if (L == NULL) {
 		php_error_docref(NULL, E_ERROR,
@@ -392,15 +635,17 @@ static lua_State * luasandbox_newstate(php_luasandbox_obj * intern)
 
 	lua_atpanic(L, luasandbox_panic);
 
-	// Increase the GC step size (T349462)
-	lua_gc(L, LUA_GCSETSTEPMUL, 2000);
+	lua_gc(L, LUA_GCSETSTEPMUL, luasandbox_call_stepmul(intern));
 
 	// Register the standard library
-	luasandbox_lib_register(L);
+	luasandbox_lib_register(L, intern->lazy_libraries, intern->slim_profile);
 
 	// Set up the data conversion module
 	luasandbox_data_conversion_init(L);
 
+	// Count collection cycles for getGCStats()
+	luasandbox_alloc_gc_init(L);
+
 	// Create a table for storing chunks
 	lua_newtable(L);
 	lua_setfield(L, LUA_REGISTRYINDEX, "php_luasandbox_chunks");
@@ -409,10 +654,33 @@ static lua_State * luasandbox_newstate(php_luasandbox_obj * intern)
 	lua_pushlightuserdata(L, (void*)intern);
 	lua_setfield(L, LUA_REGISTRYINDEX, "php_luasandbox_obj");
 
+	if (intern->slim_profile) {
+		// Free the garbage left by setup. The collector also shrinks the
+		// string table and the string buffer to fit what is left.
+		lua_gc(L, LUA_GCCOLLECT, 0);
+	}
+
+	intern->alloc.limit_lifted--;
+	intern->alloc.memory_limit = old_memory_limit;
 	return L;
 }
 /* }}} */
 
+/** {{{ luasandbox_get_state
+ *
+ * Get the Lua state of a LuaSandbox object, creating it if necessary. The
+ * state is normally created by the constructor, but a subclass constructor
+ * may not have called the parent.
+ */
+static lua_State * luasandbox_get_state(php_luasandbox_obj * sandbox)
+{
+	if (!sandbox->state) {
+		sandbox->state = luasandbox_newstate(sandbox);
+	}
+	return sandbox->state;
+}
+/* }}} */
+
 /** {{{ luasandbox_free_storage
  *
  * "Free storage" handler for LuaSandbox objects.
@@ -422,16 +690,76 @@ static void luasandbox_free_storage(zend_object *object)
 	php_luasandbox_obj * sandbox = php_luasandbox_fetch_object(object);
 
 	luasandbox_timer_destroy(&sandbox->timer);
-	if (sandbox->state) {
+	luasandbox_memory_profiler_disable(sandbox);
+	zval_ptr_dtor(&sandbox->soft_limit_callback);
+	if (sandbox->persistent) {
+		luasandbox_persistent_release(sandbox);
+	} else if (sandbox->state) {
 		luasandbox_alloc_delete_state(&sandbox->alloc, sandbox->state);
 		sandbox->state = NULL;
 	}
+	// The group was normally left in luasandbox_dtor(). If the destructor
+	// was skipped, as after a fatal error, leave it after the state is
+	// closed, since closing it updates the group's usage. Objects are not
+	// freed at shutdown until every free_obj handler has run, so the group
+	// is still valid then.
+	sandbox->alloc.group = NULL;
+	zval_ptr_dtor(&sandbox->group);
 	zend_object_std_dtor(&sandbox->std);
 
 	LUASANDBOX_G(active_count)--;
 }
 /* }}} */
 
+/** {{{ luasandbox_dtor
+ *
+ * "Destroy object" handler for LuaSandbox objects. When a sandbox and its
+ * group are freed together as a garbage cycle, the group may be freed first,
+ * but the destructors of all the objects in the cycle are called before any
+ * of them is freed. So leave the group here, rather than when the state is
+ * closed in luasandbox_free_storage(). A sandbox which is used again after
+ * its destructor has run is no longer limited by the group.
+ */
+static void luasandbox_dtor(zend_object *object)
+{
+	php_luasandbox_obj * sandbox = php_luasandbox_fetch_object(object);
+
+	zend_objects_destroy_object(object);
+	luasandbox_leave_group(sandbox);
+}
+/* }}} */
+
+/** {{{ luasandbox_get_gc
+ *
+ * "Get GC" handler for LuaSandbox objects. The soft limit callback may
+ * refer back to the sandbox, so show it to the cycle collector.
+ */
+#if PHP_VERSION_ID < 80000
+static HashTable * luasandbox_get_gc(zval * object, zval ** table, int * n)
+{
+	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(object);
+#else
+static HashTable * luasandbox_get_gc(zend_object * object, zval ** table, int * n)
+{
+	php_luasandbox_obj * sandbox = php_luasandbox_fetch_object(object);
+#endif
+
+#if PHP_VERSION_ID < 70400
+	ZVAL_COPY_VALUE(&sandbox->gc_table[0], &sandbox->soft_limit_callback);
+	ZVAL_COPY_VALUE(&sandbox->gc_table[1], &sandbox->group);
+	*table = sandbox->gc_table;
+	*n = 2;
+#else
+	zend_get_gc_buffer * gc_buffer = zend_get_gc_buffer_create();
+
+	zend_get_gc_buffer_add_zval(gc_buffer, &sandbox->soft_limit_callback);
+	zend_get_gc_buffer_add_zval(gc_buffer, &sandbox->group);
+	zend_get_gc_buffer_use(gc_buffer, table, n);
+#endif
+	return zend_std_get_properties(object);
+}
+/* }}} */
+
 /** {{{ luasandboxfunction_new
  *
  * "new" handler for the LuaSandboxFunction class.
@@ -520,7 +848,7 @@ static int luasandbox_panic(lua_State * L)
 static lua_State * luasandbox_state_from_zval(zval * this_ptr)
 {
 	php_luasandbox_obj * intern = GET_LUASANDBOX_OBJ(this_ptr);
-	return intern->state;
+	return luasandbox_get_state(intern);
 }
 /* }}} */
 
@@ -576,11 +904,9 @@ static void luasandbox_load_helper(int binary, INTERNAL_FUNCTION_PARAMETERS)
 	str_param_len_t chunkNameLength;
 	lua_State * L;
 	int have_mark;
-	int was_paused;
-	int status;
 
 	p.sandbox = GET_LUASANDBOX_OBJ(getThis());
-	L = p.sandbox->state;
+	L = luasandbox_get_state(p.sandbox);
 	CHECK_VALID_STATE(L);
 
 	p.chunkName = NULL;
@@ -615,24 +941,226 @@ static void luasandbox_load_helper(int binary, INTERNAL_FUNCTION_PARAMETERS)
 		RETURN_FALSE;
 	}
 
-	// Make sure this is counted against the Lua usage time limit
-	was_paused = luasandbox_timer_is_paused(&p.sandbox->timer);
-	luasandbox_timer_unpause(&p.sandbox->timer);
-
 	p.zthis = getThis();
 	p.return_value = return_value;
-	status = lua_cpcall(L, luasandbox_load_helper_protected, &p);
+	luasandbox_load_chunk(&p);
+}
+/* }}} */
+
+/** {{{ luasandbox_load_chunk
+ *
+ * Load the chunk described by the params struct, and set p->return_value to
+ * a LuaSandboxFunction for it, or false on error.
+ */
+static void luasandbox_load_chunk(struct luasandbox_load_helper_params * p)
+{
+	int was_paused;
+	int status;
+
+	// Make sure this is counted against the Lua usage time limit
+	was_paused = luasandbox_timer_is_paused(&p->sandbox->timer);
+	luasandbox_timer_unpause(&p->sandbox->timer);
+
+	status = lua_cpcall(p->sandbox->state, luasandbox_load_helper_protected, p);
 
 	// If the timers were paused before, re-pause them now
 	if (was_paused) {
-		luasandbox_timer_pause(&p.sandbox->timer);
+		luasandbox_timer_pause(&p->sandbox->timer);
 	}
 
 	// Handle any error from Lua
 	if (status != 0) {
-		luasandbox_handle_error(p.sandbox, status);
+		luasandbox_handle_error(p->sandbox, status);
+		ZVAL_FALSE(p->return_value);
+	}
+}
+/* }}} */
+
+/** {{{ proto LuaSandboxFunction LuaSandbox::loadPreloaded(string name)
+ *
+ * Load a module which was compiled at startup from one of the files listed
+ * in the luasandbox.preload INI setting. The name is the file name without
+ * its directory and extension. This is equivalent to loadString() with the
+ * file contents, but without parsing.
+ */
+PHP_METHOD(LuaSandbox, loadPreloaded)
+{
+	struct luasandbox_load_helper_params p;
+	zend_string * name, * code;
+	lua_State * L;
+
+	p.sandbox = GET_LUASANDBOX_OBJ(getThis());
+	L = luasandbox_get_state(p.sandbox);
+	CHECK_VALID_STATE(L);
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S", &name) == FAILURE) {
+		RETURN_FALSE;
+	}
+
+	code = luasandbox_preload_find(name);
+	if (!code) {
+		php_error_docref(NULL, E_WARNING,
+			"no preloaded module named \"%s\"", ZSTR_VAL(name));
 		RETURN_FALSE;
 	}
+
+	p.code = ZSTR_VAL(code);
+	p.codeLength = ZSTR_LEN(code);
+	// The chunk name is taken from the binary chunk
+	p.chunkName = "";
+	p.zthis = getThis();
+	p.return_value = return_value;
+	luasandbox_load_chunk(&p);
+}
+/* }}} */
+
+/** {{{ proto LuaSandbox::__construct(array options = [])
+ *
+ * Create the Lua state. The options are:
+ *   - lazyLibraries: If true, the math, os and debug libraries start out as
+ *     empty placeholders, and are loaded when they are first accessed. This
+ *     is not visible to Lua code, but reduces the cost of a sandbox which
+ *     does not use them, except that next(), rawget(), rawset(),
+ *     getmetatable(), setmetatable() and table.foreach() are replaced by
+ *     wrappers which load a placeholder passed to them.
+ *   - profile: "full" (the default) or "slim". A slim sandbox has only the
+ *     base, string, table and math libraries, and is garbage collected after
+ *     setup, to minimise the memory used by each sandbox.
+ *   - allocator: "default", "slab" or "mmap". The slab allocator serves small
+ *     blocks from per-sandbox free lists, and releases its memory in bulk when
+ *     the sandbox is destroyed. The mmap allocator serves all blocks from a
+ *     private memory mapping, which is unmapped in one call when the sandbox
+ *     is destroyed. Its memory is not counted against the PHP memory limit.
+ *   - mmapSize: The size in bytes of the region reserved by the mmap
+ *     allocator. The default is 256 MiB. Pages are only used when they are
+ *     touched, and blocks are allocated with malloc() when the region is full.
+ *   - hugePages: If true, ask the kernel to back the mmap allocator's region
+ *     with transparent huge pages, where supported.
+ *   - gcPauseFloor, gcPauseCeiling: The range of the GC pause, which is
+ *     reduced as the memory usage approaches the limit. Without a memory
+ *     limit, the pause is the ceiling. The defaults are 0 and 200.
+ *   - gcBands: The number of equal bands the memory limit is divided into.
+ *     The GC pause is recomputed when the usage moves to a different band.
+ *     The default is 32.
+ *   - gcStepMul: The GC step multiplier. The default is 2000.
+ *   - allocatorStats: If true, count allocations for getAllocatorStats().
+ *   - group: A LuaSandboxGroup whose memory limit is shared with the other
+ *     sandboxes in the group.
+ */
+PHP_METHOD(LuaSandbox, __construct)
+{
+	HashTable * options = NULL;
+	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "|h", &options) == FAILURE) {
+		return;
+	}
+	if (sandbox->state) {
+		// Already constructed
+		return;
+	}
+	if (options) {
+		luasandbox_set_options(sandbox, options);
+	}
+	luasandbox_get_state(sandbox);
+}
+/* }}} */
+
+/** {{{ luasandbox_set_options
+ *
+ * Apply constructor options. Unknown options raise a warning.
+ */
+static void luasandbox_set_options(php_luasandbox_obj * sandbox, HashTable * options)
+{
+	zend_string * key;
+	zval * value;
+
+	ZEND_HASH_FOREACH_STR_KEY_VAL(options, key, value) {
+		if (!key) {
+			php_error_docref(NULL, E_WARNING, "option names must be strings");
+		} else if (zend_string_equals_literal(key, "lazyLibraries")) {
+			sandbox->lazy_libraries = zend_is_true(value);
+		} else if (zend_string_equals_literal(key, "profile")) {
+			zend_string * profile = zval_get_string(value);
+			if (zend_string_equals_literal(profile, "slim")) {
+				sandbox->slim_profile = 1;
+			} else if (zend_string_equals_literal(profile, "full")) {
+				sandbox->slim_profile = 0;
+			} else {
+				php_error_docref(NULL, E_WARNING, "unknown profile \"%s\"", ZSTR_VAL(profile));
+			}
+			zend_string_release(profile);
+		} else if (zend_string_equals_literal(key, "allocator")) {
+			zend_string * allocator = zval_get_string(value);
+			if (zend_string_equals_literal(allocator, "slab")) {
+				sandbox->alloc.allocator = LUASANDBOX_ALLOCATOR_SLAB;
+			} else if (zend_string_equals_literal(allocator, "default")) {
+				sandbox->alloc.allocator = LUASANDBOX_ALLOCATOR_DEFAULT;
+			} else if (zend_string_equals_literal(allocator, "mmap")) {
+#ifdef HAVE_SYS_MMAN_H
+				sandbox->alloc.allocator = LUASANDBOX_ALLOCATOR_MMAP;
+#else
+				php_error_docref(NULL, E_WARNING,
+					"the mmap allocator is not available on this platform");
+#endif
+			} else {
+				php_error_docref(NULL, E_WARNING, "unknown allocator \"%s\"", ZSTR_VAL(allocator));
+			}
+			zend_string_release(allocator);
+		} else if (zend_string_equals_literal(key, "mmapSize")) {
+			zend_long size = zval_get_long(value);
+			if (size < LUASANDBOX_MIN_MMAP_SIZE) {
+				php_error_docref(NULL, E_WARNING, "invalid value for option \"%s\"", ZSTR_VAL(key));
+			} else {
+				sandbox->alloc.region_size = (size_t)size;
+			}
+		} else if (zend_string_equals_literal(key, "hugePages")) {
+			sandbox->alloc.huge_pages = zend_is_true(value);
+		} else if (zend_string_equals_literal(key, "allocatorStats")) {
+			sandbox->alloc.collect_stats = zend_is_true(value);
+		} else if (zend_string_equals_literal(key, "group")) {
+			if (Z_TYPE_P(value) == IS_OBJECT
+				&& instanceof_function(Z_OBJCE_P(value), luasandboxgroup_ce))
+			{
+				luasandbox_set_group(sandbox, value);
+			} else {
+				php_error_docref(NULL, E_WARNING, "the group option must be a LuaSandboxGroup");
+			}
+		} else if (zend_string_equals_literal(key, "gcPauseFloor")) {
+			luasandbox_get_int_option(key, value, 0, &sandbox->alloc.gc_pause_floor);
+		} else if (zend_string_equals_literal(key, "gcPauseCeiling")) {
+			luasandbox_get_int_option(key, value, 0, &sandbox->alloc.gc_pause_ceiling);
+		} else if (zend_string_equals_literal(key, "gcBands")) {
+			luasandbox_get_int_option(key, value, 1, &sandbox->alloc.gc_bands);
+		} else if (zend_string_equals_literal(key, "gcStepMul")) {
+			luasandbox_get_int_option(key, value, 1, &sandbox->gc_stepmul);
+		} else {
+			php_error_docref(NULL, E_WARNING, "unknown option \"%s\"", ZSTR_VAL(key));
+		}
+	} ZEND_HASH_FOREACH_END();
+
+	if (sandbox->alloc.gc_pause_floor > sandbox->alloc.gc_pause_ceiling) {
+		php_error_docref(NULL, E_WARNING,
+			"gcPauseFloor is greater than gcPauseCeiling, using the ceiling for both");
+		sandbox->alloc.gc_pause_floor = sandbox->alloc.gc_pause_ceiling;
+	}
+}
+/* }}} */
+
+/** {{{ luasandbox_get_int_option
+ *
+ * Set *dest to the value of an integer option, if it is in the range min to
+ * INT_MAX. Otherwise, raise a warning and leave *dest unchanged.
+ */
+static void luasandbox_get_int_option(zend_string * key, zval * value, zend_long min, int * dest)
+{
+	zend_long n = zval_get_long(value);
+
+	if (n < min || n > INT_MAX) {
+		php_error_docref(NULL, E_WARNING, "invalid value for option \"%s\"", ZSTR_VAL(key));
+		return;
+	}
+	*dest = (int)n;
 }
 /* }}} */
 
@@ -717,7 +1245,9 @@ static void luasandbox_handle_error(php_luasandbox_obj * sandbox, int status)
 	// the fetch doesn't raise a memory error.
 	old_memory_limit = sandbox->alloc.memory_limit;
 	sandbox->alloc.memory_limit = (size_t)-1;
+	sandbox->alloc.limit_lifted++;
 	errorMsg = luasandbox_error_to_string(L, -1);
+	sandbox->alloc.limit_lifted--;
 	sandbox->alloc.memory_limit = old_memory_limit;
 
 	switch (status) {
@@ -756,11 +1286,13 @@ static void luasandbox_handle_error(php_luasandbox_obj * sandbox, int status)
 
 		old_memory_limit = sandbox->alloc.memory_limit;
 		sandbox->alloc.memory_limit = (size_t)-1;
+		sandbox->alloc.limit_lifted++;
 		lua_pushcfunction(L, luasandbox_safe_trace_to_zval);
 		lua_rawgeti(L, -2, 3);
 		lua_pushlightuserdata(L, LUASANDBOX_GET_CURRENT_ZVAL_PTR(sandbox));
 		lua_pushlightuserdata(L, ztrace);
 		lua_pushlightuserdata(L, NULL);
+		sandbox->alloc.limit_lifted--;
 		sandbox->alloc.memory_limit = old_memory_limit;
 		if (lua_pcall(L, 4, 0, 0) == 0) {
 			// Put it in the exception object
@@ -812,51 +1344,145 @@ PHP_METHOD(LuaSandbox, setMemoryLimit)
 }
 /* }}} */
 
-
-/** {{{ proto void LuaSandbox::setCPULimit(mixed limit)
- *
- * Set the limit of CPU time (user+system) for all LuaSandboxFunction::call()
- * calls against this LuaSandbox instance. The limit is specified in seconds,
- * or false to disable the limiter.
+/** {{{ proto void LuaSandbox::setSoftMemoryLimit(int limit, ?callable callback = null)
  *
- * When the time limit expires, a flag will be set which causes a
- * LuaSandboxError exception to be thrown when the currently-running Lua
- * statement finishes.
- *
- * Setting the time limit from a callback while Lua is running causes the timer
- * to be reset, or started if it was not already running.
+ * Set a soft memory limit, or disable it if the limit is zero or less. When
+ * Lua code allocates memory beyond the soft limit, a full garbage collection
+ * is done before the next instruction. If the usage is still above the soft
+ * limit, the callback is called with the sandbox and the memory usage. The
+ * soft limit is not checked again until the usage has dropped below it.
  */
-PHP_METHOD(LuaSandbox, setCPULimit)
+PHP_METHOD(LuaSandbox, setSoftMemoryLimit)
 {
-	zval *zp_limit = NULL;
-
-	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
-
-	struct timespec limit = {0, 0};
+	long_param_t limit;
+	zend_fcall_info fci = empty_fcall_info;
+	zend_fcall_info_cache fcc = empty_fcall_info_cache;
+	php_luasandbox_obj * intern = GET_LUASANDBOX_OBJ(getThis());
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "z/",
-		&zp_limit) == FAILURE)
-	{
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "l|f!", &limit, &fci, &fcc) == FAILURE) {
 		RETURN_FALSE;
 	}
 
-	if (!zp_limit
-#ifdef IS_BOOL
-		|| (Z_TYPE_P(zp_limit) == IS_BOOL && Z_BVAL_P(zp_limit) == 0)
-#else
-		|| Z_TYPE_P(zp_limit) == IS_FALSE
-#endif
-	) {
-		// No limit
-		sandbox->is_cpu_limited = 0;
+	intern->alloc.soft_memory_limit = limit > 0 ? (size_t)limit : (size_t)-1;
+	intern->soft_limit_handled = 0;
+	zval_ptr_dtor(&intern->soft_limit_callback);
+	if (ZEND_FCI_INITIALIZED(fci)) {
+		ZVAL_COPY(&intern->soft_limit_callback, &fci.function_name);
 	} else {
-		convert_to_double(zp_limit);
-		luasandbox_set_timespec(&limit, Z_DVAL_P(zp_limit));
-		sandbox->is_cpu_limited = 1;
+		ZVAL_UNDEF(&intern->soft_limit_callback);
 	}
-
-	// Set the timer
-	luasandbox_timer_set_limit(&sandbox->timer, &limit);
+}
+/* }}} */
+
+/** {{{ luasandbox_soft_limit_exceeded
+ *
+ * Called by the allocator when the memory usage exceeds the soft limit.
+ * Collection can't be done inside the allocator, so set a hook to do it
+ * before the next instruction. If a profiler or timeout hook is pending, it
+ * is left in place, and luasandbox_timer_restore_hook() sets this one when
+ * it is done.
+ */
+void luasandbox_soft_limit_exceeded(php_luasandbox_obj * sandbox)
+{
+	lua_State * L = sandbox->state;
+
+	if (!L || !sandbox->in_lua || sandbox->timed_out || sandbox->soft_limit_pending) {
+		return;
+	}
+	sandbox->soft_limit_pending = 1;
+	if (!luasandbox_timer_hook_is_pending(L)) {
+		lua_sethook(L, luasandbox_soft_limit_hook, LUA_MASKCOUNT, 1);
+	}
+}
+/* }}} */
+
+/** {{{ luasandbox_soft_limit_hook
+ *
+ * The hook set by luasandbox_soft_limit_exceeded()
+ */
+void luasandbox_soft_limit_hook(lua_State * L, lua_Debug * ar)
+{
+	php_luasandbox_obj * sandbox = luasandbox_get_php_obj(L);
+	zval args[2], retval;
+
+	sandbox->soft_limit_pending = 0;
+	luasandbox_timer_restore_hook(L, sandbox);
+	sandbox->soft_limit_handled = 1;
+
+	// This hook may have replaced the timeout hook, in which case entering
+	// PHP raises the timeout error
+	luasandbox_enter_php(L, sandbox);
+	luasandbox_leave_php(L, sandbox);
+
+	lua_gc(L, LUA_GCCOLLECT, 0);
+	if (sandbox->alloc.memory_usage <= sandbox->alloc.soft_memory_limit
+		|| Z_ISUNDEF(sandbox->soft_limit_callback))
+	{
+		return;
+	}
+
+	luasandbox_enter_php(L, sandbox);
+	ZVAL_COPY_VALUE(&args[0], &sandbox->current_zval);
+	ZVAL_LONG(&args[1], (zend_long)sandbox->alloc.memory_usage);
+	ZVAL_UNDEF(&retval);
+	if (call_user_function(NULL, NULL, &sandbox->soft_limit_callback,
+		&retval, 2, args) == SUCCESS)
+	{
+		zval_ptr_dtor(&retval);
+	}
+	luasandbox_leave_php(L, sandbox);
+
+	if (EG(exception)) {
+		luasandbox_raise_php_exception(L);
+	}
+}
+/* }}} */
+
+
+/** {{{ proto void LuaSandbox::setCPULimit(mixed limit)
+ *
+ * Set the limit of CPU time (user+system) for all LuaSandboxFunction::call()
+ * calls against this LuaSandbox instance. The limit is specified in seconds,
+ * or false to disable the limiter.
+ *
+ * When the time limit expires, a flag will be set which causes a
+ * LuaSandboxError exception to be thrown when the currently-running Lua
+ * statement finishes.
+ *
+ * Setting the time limit from a callback while Lua is running causes the timer
+ * to be reset, or started if it was not already running.
+ */
+PHP_METHOD(LuaSandbox, setCPULimit)
+{
+	zval *zp_limit = NULL;
+
+	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
+
+	struct timespec limit = {0, 0};
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "z/",
+		&zp_limit) == FAILURE)
+	{
+		RETURN_FALSE;
+	}
+
+	if (!zp_limit
+#ifdef IS_BOOL
+		|| (Z_TYPE_P(zp_limit) == IS_BOOL && Z_BVAL_P(zp_limit) == 0)
+#else
+		|| Z_TYPE_P(zp_limit) == IS_FALSE
+#endif
+	) {
+		// No limit
+		sandbox->is_cpu_limited = 0;
+	} else {
+		convert_to_double(zp_limit);
+		luasandbox_set_timespec(&limit, Z_DVAL_P(zp_limit));
+		sandbox->is_cpu_limited = 1;
+	}
+
+	// Set the timer
+	luasandbox_timer_set_limit(&sandbox->timer, &limit);
 }
 /* }}} */
 
@@ -902,6 +1528,131 @@ PHP_METHOD(LuaSandbox, getCPUUsage)
 }
 /* }}} */
 
+/** {{{ proto void LuaSandbox::setWallClockLimit(mixed limit)
+ *
+ * Set the limit of real time spent in LuaSandboxFunction::call() calls and
+ * similar against this LuaSandbox instance. The limit is specified in
+ * seconds, or false to disable the limiter.
+ *
+ * Unlike the CPU limit, this counts time spent waiting, for example in a
+ * slow PHP callback or while the thread is descheduled, and it is not
+ * paused by pauseUsageTimer(). When it expires, the same LuaSandboxTimeoutError
+ * is thrown.
+ */
+PHP_METHOD(LuaSandbox, setWallClockLimit)
+{
+	zval *zp_limit = NULL;
+
+	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
+
+	struct timespec limit = {0, 0};
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "z/",
+		&zp_limit) == FAILURE)
+	{
+		RETURN_FALSE;
+	}
+
+	if (!zp_limit
+#ifdef IS_BOOL
+		|| (Z_TYPE_P(zp_limit) == IS_BOOL && Z_BVAL_P(zp_limit) == 0)
+#else
+		|| Z_TYPE_P(zp_limit) == IS_FALSE
+#endif
+	) {
+		// No limit
+	} else {
+		convert_to_double(zp_limit);
+		luasandbox_set_timespec(&limit, Z_DVAL_P(zp_limit));
+	}
+
+	luasandbox_timer_set_wall_limit(&sandbox->timer, &limit);
+}
+/* }}} */
+
+/** {{{ proto float LuaSandbox::getWallClockUsage()
+ *
+ * Get the real time spent in calls into Lua by this LuaSandbox instance,
+ * including any PHP functions called by Lua.
+ */
+PHP_METHOD(LuaSandbox, getWallClockUsage)
+{
+	struct timespec ts;
+	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE) {
+		RETURN_FALSE;
+	}
+
+	luasandbox_timer_get_wall_usage(&sandbox->timer, &ts);
+	RETURN_DOUBLE(ts.tv_sec + 1e-9 * ts.tv_nsec);
+}
+/* }}} */
+
+/** {{{ proto void LuaSandbox::setInstructionLimit(mixed limit)
+ *
+ * Set a limit on the number of Lua VM instructions executed by this
+ * LuaSandbox instance, counted from now, or false to remove the limit.
+ *
+ * Unlike the CPU limit, this gives the same result on every run. The
+ * instructions are counted by a count hook which runs every 10000
+ * instructions, so it needs no timer. When the limit is reached, a
+ * LuaSandboxTimeoutError is thrown, as for the CPU limit.
+ */
+PHP_METHOD(LuaSandbox, setInstructionLimit)
+{
+	zval *zp_limit = NULL;
+	zend_long limit = 0;
+	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "z",
+		&zp_limit) == FAILURE)
+	{
+		RETURN_FALSE;
+	}
+
+	CHECK_VALID_STATE(luasandbox_get_state(sandbox));
+
+	if (!zp_limit
+#ifdef IS_BOOL
+		|| (Z_TYPE_P(zp_limit) == IS_BOOL && Z_BVAL_P(zp_limit) == 0)
+#else
+		|| Z_TYPE_P(zp_limit) == IS_FALSE
+#endif
+	) {
+		// No limit
+		limit = 0;
+	} else {
+		limit = zval_get_long(zp_limit);
+		if (limit <= 0) {
+			php_error_docref(NULL, E_WARNING,
+				"the instruction limit must be positive");
+			RETURN_FALSE;
+		}
+	}
+
+	luasandbox_timer_set_instruction_limit(sandbox, limit);
+}
+/* }}} */
+
+/** {{{ proto int LuaSandbox::getInstructionCount()
+ *
+ * Get the number of Lua VM instructions counted against the instruction
+ * limit. Instructions are only counted while a limit is set, in steps of up
+ * to 10000 instructions.
+ */
+PHP_METHOD(LuaSandbox, getInstructionCount)
+{
+	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE) {
+		RETURN_FALSE;
+	}
+
+	RETURN_LONG(sandbox->instruction_count);
+}
+/* }}} */
+
 /** {{{ proto bool LuaSandbox::pauseUsageTimer()
  *
  * Pause the CPU usage timer, and the time limit set by LuaSandbox::setCPULimit.
@@ -1081,101 +1832,612 @@ PHP_METHOD(LuaSandbox, getProfilerFunctionReport)
 
 /* }}} */
 
-/** {{{ LuaSandbox::getMemoryUsage */
-PHP_METHOD(LuaSandbox, getMemoryUsage)
+/** {{{ proto bool LuaSandbox::enableMemoryProfiler(int interval = 65536)
+ *
+ * Enable the memory profiler. Each time another interval bytes have been
+ * allocated while Lua code is running, the call stack is sampled.
+ * Any previous report is discarded.
+ */
+PHP_METHOD(LuaSandbox, enableMemoryProfiler)
 {
+	zend_long interval = 65536;
 	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
-
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE) {
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "|l", &interval) == FAILURE) {
+		RETURN_FALSE;
+	}
+	if (interval < 1) {
+		php_error_docref(NULL, E_WARNING, "the interval must be at least 1 byte");
 		RETURN_FALSE;
 	}
 
-	RETURN_LONG(sandbox->alloc.memory_usage);
+	luasandbox_memory_profiler_enable(sandbox, (size_t)interval);
+	RETURN_TRUE;
 }
 /* }}} */
 
-/** {{{ LuaSandbox::getPeakMemoryUsage */
-PHP_METHOD(LuaSandbox, getPeakMemoryUsage)
+/* {{{ proto void LuaSandbox::disableMemoryProfiler()
+ *
+ * Disable the memory profiler and discard its report.
+ */
+PHP_METHOD(LuaSandbox, disableMemoryProfiler)
 {
 	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
 
 	if (zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE) {
 		RETURN_FALSE;
 	}
-
-	RETURN_LONG(sandbox->alloc.peak_memory_usage);
+	luasandbox_memory_profiler_disable(sandbox);
 }
 /* }}} */
 
-/** {{{ proto array LuaSandbox::callFunction(string name, ...$args )
- *
- * Call a function in the global variable with the given name. The name may
- * contain "." characters, in which case the function is located via recursive
- * table accesses, as if the name were a Lua expression.
- *
- * If the variable does not exist, or is not a function, false will be returned
- * and a warning issued.
- *
- * Any arguments specified after the name will be passed through as arguments
- * to the function.
- *
- * For more information about calling Lua functions and the return values, see
- * LuaSandboxFunction::call().
+/* {{{ proto array LuaSandbox::getMemoryProfilerReport(bool stacks = false)
  *
- * For catching Lua errors that might be raised, we need a struct and a helper
- * function too.
+ * Get the number of bytes attributed to each function by the memory
+ * profiler, in descending order. Function names are formatted as in
+ * getProfilerFunctionReport(). If stacks is true, the bytes are given for
+ * each sampled call stack instead, as function names separated by ";",
+ * outermost first.
  */
+PHP_METHOD(LuaSandbox, getMemoryProfilerReport)
+{
+	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
+	zend_bool stacks = 0;
+	HashTable * bytes;
 
-struct LuaSandbox_callFunction_params {
-	php_luasandbox_obj * sandbox;
-	zval *zthis;
-	zval *return_value;
-
-	char *name;
-	str_param_len_t nameLength;
-	int numArgs;
-	star_param_t args;
-};
-
-static int LuaSandbox_callFunction_protected(lua_State* L) {
-	struct LuaSandbox_callFunction_params *p = (struct LuaSandbox_callFunction_params *)lua_touserdata(L, 1);
-	zval *return_value = p->return_value;
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "|b", &stacks) == FAILURE) {
+		RETURN_FALSE;
+	}
+	if (!sandbox->memory_profiler) {
+		array_init(return_value);
+		return;
+	}
 
-	// Find the function
-	if (!luasandbox_find_field(L, LUA_GLOBALSINDEX, p->name, p->nameLength)) {
-		php_error_docref(NULL, E_WARNING,
-			"The specified lua function does not exist");
-		RETVAL_FALSE;
+	if (stacks) {
+		bytes = sandbox->memory_profiler->stack_bytes;
 	} else {
-		// Call it
-		luasandbox_call_helper(L, p->zthis, p->sandbox, p->args, p->numArgs, return_value);
+		bytes = sandbox->memory_profiler->function_bytes;
 	}
-
-	return 0;
+#if PHP_VERSION_ID < 80000
+	zend_hash_sort(bytes, (compare_func_t)luasandbox_sort_profile, 0);
+#else
+	zend_hash_sort(bytes, luasandbox_sort_profile, 0);
+#endif
+	RETURN_ARR(zend_array_dup(bytes));
 }
+/* }}} */
 
-PHP_METHOD(LuaSandbox, callFunction)
+/** {{{ LuaSandbox::getMemoryUsage */
+PHP_METHOD(LuaSandbox, getMemoryUsage)
 {
-	struct LuaSandbox_callFunction_params p;
-	int status;
+	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
 
-	p.nameLength = 0;
-	p.numArgs = 0;
-	p.args = NULL;
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE) {
+		RETURN_FALSE;
+	}
 
-	p.sandbox = GET_LUASANDBOX_OBJ(getThis());
-	lua_State * L = p.sandbox->state;
-	CHECK_VALID_STATE(L);
+	RETURN_LONG(sandbox->alloc.memory_usage);
+}
+/* }}} */
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "s*",
-		&p.name, &p.nameLength, &p.args, &p.numArgs) == FAILURE)
-	{
+/** {{{ LuaSandbox::getPeakMemoryUsage */
+PHP_METHOD(LuaSandbox, getPeakMemoryUsage)
+{
+	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE) {
+		RETURN_FALSE;
+	}
+
+	RETURN_LONG(sandbox->alloc.peak_memory_usage);
+}
+/* }}} */
+
+struct luasandbox_gc_params {
+	int what;
+	int data;
+	int result;
+};
+
+/** {{{ luasandbox_gc_protected
+ *
+ * Call lua_gc() with the parameters in a luasandbox_gc_params, under
+ * lua_cpcall(). Finalizers and resizing of the string table can raise
+ * errors.
+ */
+static int luasandbox_gc_protected(lua_State * L)
+{
+	struct luasandbox_gc_params * p = (struct luasandbox_gc_params*)lua_touserdata(L, 1);
+	p->result = lua_gc(L, p->what, p->data);
+	return 0;
+}
+/* }}} */
+
+/** {{{ luasandbox_gc
+ *
+ * Run the garbage collector without a memory limit. Returns the result of
+ * lua_gc(), or -1 on error, in which case an exception has been thrown.
+ */
+static int luasandbox_gc(php_luasandbox_obj * sandbox, int what, int data)
+{
+	struct luasandbox_gc_params p;
+	size_t old_memory_limit;
+	int status;
+
+	p.what = what;
+	p.data = data;
+	p.result = 0;
+	old_memory_limit = sandbox->alloc.memory_limit;
+	sandbox->alloc.memory_limit = (size_t)-1;
+	sandbox->alloc.limit_lifted++;
+	status = lua_cpcall(sandbox->state, luasandbox_gc_protected, &p);
+	sandbox->alloc.limit_lifted--;
+	sandbox->alloc.memory_limit = old_memory_limit;
+	if (status != 0) {
+		luasandbox_handle_error(sandbox, status);
+		return -1;
+	}
+	return p.result;
+}
+/* }}} */
+
+/** {{{ proto int LuaSandbox::collectGarbage()
+ *
+ * Run a full garbage collection cycle. Return the number of bytes freed.
+ */
+PHP_METHOD(LuaSandbox, collectGarbage)
+{
+	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
+	size_t old_usage;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE) {
+		RETURN_FALSE;
+	}
+	CHECK_VALID_STATE(luasandbox_get_state(sandbox));
+
+	old_usage = sandbox->alloc.memory_usage;
+	if (luasandbox_gc(sandbox, LUA_GCCOLLECT, 0) < 0) {
+		RETURN_FALSE;
+	}
+	RETURN_LONG(old_usage > sandbox->alloc.memory_usage
+		? old_usage - sandbox->alloc.memory_usage : 0);
+}
+/* }}} */
+
+/** {{{ proto bool LuaSandbox::stepGarbageCollector(int kb)
+ *
+ * Do an incremental step of garbage collection, of roughly the amount of work
+ * needed to collect the given number of kilobytes. Return true if the step
+ * finished a collection cycle.
+ */
+PHP_METHOD(LuaSandbox, stepGarbageCollector)
+{
+	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
+	zend_long kb;
+	int result;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "l", &kb) == FAILURE) {
+		RETURN_FALSE;
+	}
+	CHECK_VALID_STATE(luasandbox_get_state(sandbox));
+	if (kb < 0 || kb > INT_MAX) {
+		php_error_docref(NULL, E_WARNING, "step size out of range");
+		RETURN_FALSE;
+	}
+
+	result = luasandbox_gc(sandbox, LUA_GCSTEP, (int)kb);
+	if (result < 0) {
+		RETURN_FALSE;
+	}
+	RETURN_BOOL(result);
+}
+/* }}} */
+
+/** {{{ proto bool LuaSandbox::setGCParameters(?int pause, ?int stepmul = null)
+ *
+ * Set the GC pause and step multiplier, in percent. Null leaves a parameter
+ * unchanged. Setting the pause fixes it, replacing the adjustment made as the
+ * memory usage approaches the limit.
+ */
+PHP_METHOD(LuaSandbox, setGCParameters)
+{
+	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
+	lua_State * L;
+	zend_long pause = 0, stepmul = 0;
+	zend_bool pause_null = 1, stepmul_null = 1;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "l!|l!",
+		&pause, &pause_null, &stepmul, &stepmul_null) == FAILURE)
+	{
+		RETURN_FALSE;
+	}
+	L = luasandbox_get_state(sandbox);
+	CHECK_VALID_STATE(L);
+	if ((!pause_null && (pause < 0 || pause > INT_MAX))
+		|| (!stepmul_null && (stepmul < 1 || stepmul > INT_MAX)))
+	{
+		php_error_docref(NULL, E_WARNING, "GC parameter out of range");
+		RETURN_FALSE;
+	}
+
+	if (!pause_null) {
+		sandbox->alloc.gc_pause_floor = sandbox->alloc.gc_pause_ceiling = (int)pause;
+		lua_gc(L, LUA_GCSETPAUSE, (int)pause);
+	}
+	if (!stepmul_null) {
+		sandbox->gc_stepmul = (int)stepmul;
+		lua_gc(L, LUA_GCSETSTEPMUL, luasandbox_call_stepmul(sandbox));
+	}
+	RETURN_TRUE;
+}
+/* }}} */
+
+/** {{{ proto bool LuaSandbox::setIdleGCBudget(int usec, ?int stepmul = null)
+ *
+ * After each top-level call returns, spend up to the given number of
+ * microseconds on incremental GC steps, outside of the CPU limit. While Lua
+ * code runs, the step multiplier is reduced to the given value, by default
+ * 200, so that less GC work is done during calls. Zero disables idle GC.
+ */
+PHP_METHOD(LuaSandbox, setIdleGCBudget)
+{
+	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
+	lua_State * L;
+	zend_long usec, stepmul = 200;
+	zend_bool stepmul_null = 1;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "l|l!",
+		&usec, &stepmul, &stepmul_null) == FAILURE)
+	{
+		RETURN_FALSE;
+	}
+	L = luasandbox_get_state(sandbox);
+	CHECK_VALID_STATE(L);
+	if (stepmul_null) {
+		stepmul = 200;
+	}
+	if (usec < 0 || stepmul < 1 || stepmul > INT_MAX) {
+		php_error_docref(NULL, E_WARNING, "GC parameter out of range");
+		RETURN_FALSE;
+	}
+
+	sandbox->idle_gc_budget = usec;
+	sandbox->idle_gc_call_stepmul = (int)stepmul;
+	sandbox->idle_gc_usage = 0;
+	lua_gc(L, LUA_GCSETSTEPMUL, luasandbox_call_stepmul(sandbox));
+	RETURN_TRUE;
+}
+/* }}} */
+
+/** {{{ luasandbox_idle_gc
+ *
+ * Run GC steps with the full step multiplier until a cycle finishes or the
+ * given number of microseconds is spent. Nothing is done if memory usage has
+ * not grown since the last cycle finished here. This runs after a call has
+ * finished, so an error is reported as a warning rather than thrown, and the
+ * call's results are kept. The stack is left as it was. Returns 1 if a cycle
+ * was finished, 0 otherwise.
+ */
+static int luasandbox_idle_gc(php_luasandbox_obj * sandbox, zend_long budget)
+{
+	lua_State * L = sandbox->state;
+	struct luasandbox_gc_params p;
+	size_t old_memory_limit;
+	int status, finished = 0;
+#ifndef LUASANDBOX_NO_CLOCK
+	struct timespec start, now;
+	double elapsed;
+#endif
+
+	if (sandbox->alloc.memory_usage <= sandbox->idle_gc_usage) {
+		return 0;
+	}
+#ifndef LUASANDBOX_NO_CLOCK
+	clock_gettime(CLOCK_MONOTONIC, &start);
+#endif
+
+	lua_gc(L, LUA_GCSETSTEPMUL, sandbox->gc_stepmul);
+	old_memory_limit = sandbox->alloc.memory_limit;
+	sandbox->alloc.memory_limit = (size_t)-1;
+	sandbox->alloc.limit_lifted++;
+	for (;;) {
+		p.what = LUA_GCSTEP;
+		p.data = 0;
+		p.result = 0;
+		status = lua_cpcall(L, luasandbox_gc_protected, &p);
+		if (status != 0) {
+			php_error_docref(NULL, E_WARNING, "idle garbage collection failed: %s",
+				luasandbox_error_to_string(L, -1));
+			lua_pop(L, 1);
+			break;
+		}
+		if (p.result) {
+			sandbox->idle_gc_usage = sandbox->alloc.memory_usage;
+			finished = 1;
+		}
+#ifndef LUASANDBOX_NO_CLOCK
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) * 1e-9;
+		if (p.result || elapsed * 1e6 >= budget) {
+			break;
+		}
+#else
+		break;
+#endif
+	}
+	sandbox->alloc.limit_lifted--;
+	sandbox->alloc.memory_limit = old_memory_limit;
+	lua_gc(L, LUA_GCSETSTEPMUL, luasandbox_call_stepmul(sandbox));
+	return finished;
+}
+/* }}} */
+
+/** {{{ proto bool LuaSandbox::runIdleGC(int usec)
+ *
+ * Spend up to the given number of microseconds on incremental GC steps now,
+ * as is done after each call if an idle GC budget is set. Returns true if a
+ * collection cycle was finished.
+ */
+PHP_METHOD(LuaSandbox, runIdleGC)
+{
+	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
+	zend_long usec;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "l", &usec) == FAILURE) {
+		RETURN_FALSE;
+	}
+	CHECK_VALID_STATE(luasandbox_get_state(sandbox));
+	if (usec < 0) {
+		php_error_docref(NULL, E_WARNING, "GC parameter out of range");
+		RETURN_FALSE;
+	}
+	RETURN_BOOL(luasandbox_idle_gc(sandbox, usec));
+}
+/* }}} */
+
+/** {{{ proto array LuaSandbox::getGCStats()
+ *
+ * Get garbage collector statistics
+ */
+PHP_METHOD(LuaSandbox, getGCStats)
+{
+	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
+	lua_State * L;
+	int pause, stepmul;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE) {
+		RETURN_FALSE;
+	}
+	L = luasandbox_get_state(sandbox);
+	CHECK_VALID_STATE(L);
+
+	// There is no way to read these without setting them
+	pause = lua_gc(L, LUA_GCSETPAUSE, 0);
+	lua_gc(L, LUA_GCSETPAUSE, pause);
+	stepmul = lua_gc(L, LUA_GCSETSTEPMUL, 0);
+	lua_gc(L, LUA_GCSETSTEPMUL, stepmul);
+
+	array_init_size(return_value, 4);
+	add_assoc_long(return_value, "collections", (zend_long)sandbox->alloc.gc_cycles);
+	add_assoc_long(return_value, "bytesReleased", (zend_long)sandbox->alloc.released_bytes);
+	add_assoc_long(return_value, "pause", pause);
+	add_assoc_long(return_value, "stepMul", stepmul);
+}
+/* }}} */
+
+/** {{{ proto array LuaSandbox::getAllocatorStats()
+ *
+ * Get the allocation counters enabled by the allocatorStats constructor
+ * option. The histogram maps the smallest size in each log2 size class to
+ * the number of allocations and reallocations in that class.
+ */
+PHP_METHOD(LuaSandbox, getAllocatorStats)
+{
+	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
+	luasandbox_alloc_stats * stats;
+	zval histogram;
+	int i;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE) {
+		RETURN_FALSE;
+	}
+	CHECK_VALID_STATE(luasandbox_get_state(sandbox));
+	stats = sandbox->alloc.stats;
+	if (!stats) {
+		php_error_docref(NULL, E_WARNING,
+			"allocator statistics are not enabled, use the allocatorStats option");
+		RETURN_FALSE;
+	}
+
+	array_init(&histogram);
+	for (i = 0; i < LUASANDBOX_ALLOC_HISTOGRAM_SIZE; i++) {
+		if (stats->histogram[i]) {
+			add_index_long(&histogram, (zend_ulong)1 << i, (zend_long)stats->histogram[i]);
+		}
+	}
+
+	array_init_size(return_value, 5);
+	add_assoc_long(return_value, "allocations", (zend_long)stats->allocations);
+	add_assoc_long(return_value, "frees", (zend_long)stats->frees);
+	add_assoc_long(return_value, "reallocations", (zend_long)stats->reallocations);
+	add_assoc_long(return_value, "bytesAllocated", (zend_long)stats->bytes_allocated);
+	add_assoc_zval(return_value, "histogram", &histogram);
+}
+/* }}} */
+
+/** {{{ luasandbox_add_breakdown_entry
+ *
+ * Add an array with the count and estimated size of one object type to a
+ * getMemoryBreakdown() result, and return it so that more can be added.
+ */
+static zval * luasandbox_add_breakdown_entry(zval * return_value, const char * name,
+	luasandbox_memory_breakdown * breakdown, int type)
+{
+	zval entry;
+
+	array_init(&entry);
+	add_assoc_long(&entry, "count", (zend_long)breakdown->count[type]);
+	add_assoc_long(&entry, "bytes", (zend_long)breakdown->bytes[type]);
+	return zend_hash_str_update(Z_ARRVAL_P(return_value), name, strlen(name), &entry);
+}
+/* }}} */
+
+/** {{{ proto array LuaSandbox::getMemoryBreakdown()
+ *
+ * Walk the objects reachable from the registry, the global table and the
+ * stack of the main thread, and return the number and estimated size of
+ * each type of object. The sizes are estimated from the Lua 5.1 object
+ * layout, so the total is approximate. The memory usage not accounted for by
+ * any reachable object is reported as "other". The walk's own allocations
+ * don't affect the peak usage, and no garbage collection is done, so the GC
+ * statistics are unchanged.
+ */
+PHP_METHOD(LuaSandbox, getMemoryBreakdown)
+{
+	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
+	luasandbox_memory_breakdown breakdown;
+	lua_State * L;
+	zval * entry;
+	size_t total = 0;
+	int status, i;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE) {
+		RETURN_FALSE;
+	}
+	L = luasandbox_get_state(sandbox);
+	CHECK_VALID_STATE(L);
+
+	status = luasandbox_memory_breakdown_state(sandbox, &breakdown);
+	if (status) {
+		luasandbox_handle_error(sandbox, status);
+		RETURN_FALSE;
+	}
+	for (i = 0; i < LUASANDBOX_BREAKDOWN_NUM_TYPES; i++) {
+		total += breakdown.bytes[i];
+	}
+
+	array_init_size(return_value, LUASANDBOX_BREAKDOWN_NUM_TYPES + 1);
+	luasandbox_add_breakdown_entry(return_value, "string", &breakdown,
+		LUASANDBOX_BREAKDOWN_STRING);
+	entry = luasandbox_add_breakdown_entry(return_value, "table", &breakdown,
+		LUASANDBOX_BREAKDOWN_TABLE);
+	add_assoc_long(entry, "arrayBytes", (zend_long)breakdown.table_array_bytes);
+	add_assoc_long(entry, "hashBytes", (zend_long)breakdown.table_hash_bytes);
+	luasandbox_add_breakdown_entry(return_value, "function", &breakdown,
+		LUASANDBOX_BREAKDOWN_FUNCTION);
+	luasandbox_add_breakdown_entry(return_value, "proto", &breakdown,
+		LUASANDBOX_BREAKDOWN_PROTO);
+	luasandbox_add_breakdown_entry(return_value, "cfunction", &breakdown,
+		LUASANDBOX_BREAKDOWN_CFUNCTION);
+	entry = luasandbox_add_breakdown_entry(return_value, "userdata", &breakdown,
+		LUASANDBOX_BREAKDOWN_USERDATA);
+	add_assoc_long(entry, "phpValues", (zend_long)breakdown.zval_userdata);
+	luasandbox_add_breakdown_entry(return_value, "thread", &breakdown,
+		LUASANDBOX_BREAKDOWN_THREAD);
+	add_assoc_long(return_value, "other",
+		breakdown.memory_usage > total ? (zend_long)(breakdown.memory_usage - total) : 0);
+}
+/* }}} */
+
+/** {{{ proto array LuaSandbox::callFunction(string name, ...$args )
+ *
+ * Call a function in the global variable with the given name. The name may
+ * contain "." characters, in which case the function is located via recursive
+ * table accesses, as if the name were a Lua expression.
+ *
+ * If the variable does not exist, or is not a function, false will be returned
+ * and a warning issued.
+ *
+ * Any arguments specified after the name will be passed through as arguments
+ * to the function.
+ *
+ * For more information about calling Lua functions and the return values, see
+ * LuaSandboxFunction::call().
+ *
+ * For catching Lua errors that might be raised, we need a struct and a helper
+ * function too.
+ */
+
+struct LuaSandbox_callFunction_params {
+	php_luasandbox_obj * sandbox;
+	zval *zthis;
+	zval *return_value;
+
+	char *name;
+	str_param_len_t nameLength;
+	int numArgs;
+	star_param_t args;
+};
+
+static int LuaSandbox_callFunction_protected(lua_State* L) {
+	struct LuaSandbox_callFunction_params *p = (struct LuaSandbox_callFunction_params *)lua_touserdata(L, 1);
+	zval *return_value = p->return_value;
+
+	// Find the function
+	if (!luasandbox_find_field(L, LUA_GLOBALSINDEX, p->name, p->nameLength)) {
+		php_error_docref(NULL, E_WARNING,
+			"The specified lua function does not exist");
+		RETVAL_FALSE;
+	} else {
+		// Call it
+		luasandbox_call_helper(L, p->zthis, p->sandbox, p->args, p->numArgs, return_value);
+	}
+
+	return 0;
+}
+
+PHP_METHOD(LuaSandbox, callFunction)
+{
+	luasandbox_call_function_helper(0, INTERNAL_FUNCTION_PARAM_PASSTHRU);
+}
+/* }}} */
+
+/** {{{ proto array LuaSandbox::callFunctionWithOptions(string name, array options, ...$args )
+ *
+ * Like callFunction(), with options which apply to this call only. See
+ * luasandbox_set_call_options().
+ */
+PHP_METHOD(LuaSandbox, callFunctionWithOptions)
+{
+	luasandbox_call_function_helper(1, INTERNAL_FUNCTION_PARAM_PASSTHRU);
+}
+/* }}} */
+
+/** {{{ luasandbox_call_function_helper
+ *
+ * Common code for callFunction() and callFunctionWithOptions()
+ */
+static void luasandbox_call_function_helper(int with_options, INTERNAL_FUNCTION_PARAMETERS)
+{
+	struct LuaSandbox_callFunction_params p;
+	HashTable * options = NULL;
+	int status, parse_status;
+
+	p.nameLength = 0;
+	p.numArgs = 0;
+	p.args = NULL;
+
+	p.sandbox = GET_LUASANDBOX_OBJ(getThis());
+	lua_State * L = luasandbox_get_state(p.sandbox);
+	CHECK_VALID_STATE(L);
+
+	if (with_options) {
+		parse_status = zend_parse_parameters(ZEND_NUM_ARGS(), "sh*",
+			&p.name, &p.nameLength, &options, &p.args, &p.numArgs);
+	} else {
+		parse_status = zend_parse_parameters(ZEND_NUM_ARGS(), "s*",
+			&p.name, &p.nameLength, &p.args, &p.numArgs);
+	}
+	if (parse_status == FAILURE) {
+		RETURN_FALSE;
+	}
+	if (options && !luasandbox_set_call_options(p.sandbox, options)) {
 		RETURN_FALSE;
 	}
 
 	p.zthis = getThis();
 	p.return_value = return_value;
 	status = lua_cpcall(L, LuaSandbox_callFunction_protected, &p);
+	p.sandbox->call_memory_allowance = (size_t)-1;
 
 	// Handle any error from Lua
 	if (status != 0) {
@@ -1185,6 +2447,62 @@ PHP_METHOD(LuaSandbox, callFunction)
 }
 /* }}} */
 
+/** {{{ luasandbox_set_call_options
+ *
+ * Apply options for the next call into Lua. The options are:
+ *   - memoryLimit: The number of bytes which the call may allocate in
+ *     addition to the memory usage when it starts. The sandbox's memory
+ *     limit still applies.
+ *
+ * Returns 0 and raises a warning if an option is invalid, in which case none
+ * of the options are applied.
+ */
+static int luasandbox_set_call_options(php_luasandbox_obj * sandbox, HashTable * options)
+{
+	zend_string * key;
+	zval * value;
+	size_t allowance = (size_t)-1;
+
+	ZEND_HASH_FOREACH_STR_KEY_VAL(options, key, value) {
+		if (!key) {
+			php_error_docref(NULL, E_WARNING, "option names must be strings");
+			return 0;
+		} else if (zend_string_equals_literal(key, "memoryLimit")) {
+			zend_long limit = zval_get_long(value);
+			if (limit < 0) {
+				php_error_docref(NULL, E_WARNING, "invalid value for option \"%s\"", ZSTR_VAL(key));
+				return 0;
+			}
+			allowance = (size_t)limit;
+		} else {
+			php_error_docref(NULL, E_WARNING, "unknown option \"%s\"", ZSTR_VAL(key));
+			return 0;
+		}
+	} ZEND_HASH_FOREACH_END();
+	sandbox->call_memory_allowance = allowance;
+	return 1;
+}
+/* }}} */
+
+/** {{{ proto array LuaSandbox::getLastCallMemoryDelta()
+ *
+ * Get the change in memory usage over the last top-level call into Lua, and
+ * the peak usage during the call relative to the usage when it started.
+ */
+PHP_METHOD(LuaSandbox, getLastCallMemoryDelta)
+{
+	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE) {
+		RETURN_FALSE;
+	}
+
+	array_init_size(return_value, 2);
+	add_assoc_long(return_value, "net", sandbox->last_call_memory_delta);
+	add_assoc_long(return_value, "peak", (zend_long)sandbox->last_call_peak_delta);
+}
+/* }}} */
+
 /** {{{ proto LuaSandboxFunction LuaSandbox::wrapPhpFunction(callable function)
  *
  * Wrap a PHP callable in a LuaSandboxFunction, so it can be passed into Lua as
@@ -1231,7 +2549,7 @@ PHP_METHOD(LuaSandbox, wrapPhpFunction)
 
 	p.zthis = getThis();
 	sandbox = GET_LUASANDBOX_OBJ(p.zthis);
-	L = sandbox->state;
+	L = luasandbox_get_state(sandbox);
 	CHECK_VALID_STATE(L);
 
 	if (zend_parse_parameters(ZEND_NUM_ARGS(), "z",
@@ -1341,14 +2659,36 @@ static int LuaSandboxFunction_call_protected(lua_State* L) {
 	luasandbox_call_helper(L, LUASANDBOXFUNCTION_GET_SANDBOX_ZVALPTR(p->func),
 			p->sandbox, p->args, p->numArgs, return_value);
 
-	return 0;
+	return 0;
+}
+
+PHP_METHOD(LuaSandboxFunction, call)
+{
+	luasandboxfunction_call_helper(0, INTERNAL_FUNCTION_PARAM_PASSTHRU);
+}
+/** }}} */
+
+/** {{{ proto array LuaSandboxFunction::callWithOptions(array options, ...$args)
+ *
+ * Like call(), with options which apply to this call only. See
+ * luasandbox_set_call_options().
+ */
+PHP_METHOD(LuaSandboxFunction, callWithOptions)
+{
+	luasandboxfunction_call_helper(1, INTERNAL_FUNCTION_PARAM_PASSTHRU);
 }
+/** }}} */
 
-PHP_METHOD(LuaSandboxFunction, call)
+/** {{{ luasandboxfunction_call_helper
+ *
+ * Common code for call() and callWithOptions()
+ */
+static void luasandboxfunction_call_helper(int with_options, INTERNAL_FUNCTION_PARAMETERS)
 {
 	struct LuaSandboxFunction_call_params p;
+	HashTable * options = NULL;
 	lua_State * L;
-	int status;
+	int status, parse_status;
 
 	p.return_value = return_value;
 	p.numArgs = 0;
@@ -1358,14 +2698,23 @@ PHP_METHOD(LuaSandboxFunction, call)
 		RETURN_FALSE;
 	}
 
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "*",
-		&p.args, &p.numArgs) == FAILURE)
-	{
+	if (with_options) {
+		parse_status = zend_parse_parameters(ZEND_NUM_ARGS(), "h*",
+			&options, &p.args, &p.numArgs);
+	} else {
+		parse_status = zend_parse_parameters(ZEND_NUM_ARGS(), "*",
+			&p.args, &p.numArgs);
+	}
+	if (parse_status == FAILURE) {
+		RETURN_FALSE;
+	}
+	if (options && !luasandbox_set_call_options(p.sandbox, options)) {
 		RETURN_FALSE;
 	}
 
 	// Call the function
 	status = lua_cpcall(L, LuaSandboxFunction_call_protected, &p);
+	p.sandbox->call_memory_allowance = (size_t)-1;
 
 	// Handle any error from Lua
 	if (status != 0) {
@@ -1388,14 +2737,26 @@ int luasandbox_call_lua(php_luasandbox_obj * sandbox, zval * sandbox_zval,
 	zval old_zval;
 	int was_paused;
 	int old_allow_pause;
+	size_t allowance = sandbox->call_memory_allowance;
+	size_t old_memory_limit = sandbox->alloc.memory_limit;
+	size_t start_usage = sandbox->alloc.memory_usage;
+
+	// The per-call limit applies to this call only, not to nested calls
+	sandbox->call_memory_allowance = (size_t)-1;
 
 	// Initialise the CPU limit timer
 	if (!sandbox->in_lua) {
-		if (luasandbox_timer_is_expired(&sandbox->timer)) {
+		if (luasandbox_timer_is_expired(&sandbox->timer)
+			|| luasandbox_timer_instructions_expired(sandbox))
+		{
 			zend_throw_exception(luasandboxtimeouterror_ce, luasandbox_timeout_message,
 				LUA_ERRRUN);
 			return 0;
 		}
+		// A timeout error clears all hooks, including the instruction hook
+		if (sandbox->instruction_limit && !lua_gethook(sandbox->state)) {
+			luasandbox_timer_restore_hook(sandbox->state, sandbox);
+		}
 		if (luasandbox_timer_start(&sandbox->timer)) {
 			timer_started = 1;
 		} else {
@@ -1416,12 +2777,35 @@ int luasandbox_call_lua(php_luasandbox_obj * sandbox, zval * sandbox_zval,
 	old_allow_pause = sandbox->allow_pause;
 	sandbox->allow_pause = ( !sandbox->in_lua || was_paused );
 
+	// Apply the per-call memory limit, if it is lower than the sandbox limit
+	if (allowance != (size_t)-1 && start_usage < old_memory_limit
+		&& allowance < old_memory_limit - start_usage)
+	{
+		sandbox->alloc.memory_limit = start_usage + allowance;
+	} else {
+		allowance = (size_t)-1;
+	}
+	if (!sandbox->in_lua) {
+		sandbox->alloc.call_peak_usage = start_usage;
+	}
+
 	// Call the function
 	sandbox->in_lua++;
 	status = lua_pcall(sandbox->state, nargs, nresults, errfunc);
 	sandbox->in_lua--;
 	ZVAL_COPY_VALUE(&sandbox->current_zval, &old_zval);
 
+	if (allowance != (size_t)-1) {
+		sandbox->alloc.memory_limit = old_memory_limit;
+	}
+	if (!sandbox->in_lua) {
+		sandbox->last_call_memory_delta =
+			(zend_long)sandbox->alloc.memory_usage - (zend_long)start_usage;
+		sandbox->last_call_peak_delta = sandbox->alloc.call_peak_usage - start_usage;
+		// A deferred soft limit check which never ran is moot now
+		sandbox->soft_limit_pending = 0;
+	}
+
 	// Restore pause state
 	sandbox->allow_pause = old_allow_pause;
 	if (was_paused) {
@@ -1433,6 +2817,11 @@ int luasandbox_call_lua(php_luasandbox_obj * sandbox, zval * sandbox_zval,
 		luasandbox_timer_stop(&sandbox->timer);
 	}
 
+	// Collect the garbage left by the call now that the timers are stopped
+	if (!status && !sandbox->in_lua && sandbox->idle_gc_budget > 0) {
+		luasandbox_idle_gc(sandbox, sandbox->idle_gc_budget);
+	}
+
 	// Handle normal errors
 	if (status) {
 		luasandbox_handle_error(sandbox, status);
@@ -1539,6 +2928,7 @@ static int luasandbox_find_field(lua_State * L, int index,
 	for (i = 0; i <= specLength; i++) {
 		if (i == specLength || spec[i] == '.') {
 			// Put the next item into top+2
+			luasandbox_lib_materialize(L, top + 1);
 			lua_pushlstring(L, spec + tokenStart, i - tokenStart);
 			lua_rawget(L, top + 1);
 
@@ -1557,129 +2947,731 @@ static int luasandbox_find_field(lua_State * L, int index,
 			lua_remove(L, top+1);
 		}
 	}
-
-	efree(spec);
-	return 1;
+
+	efree(spec);
+	return 1;
+}
+/* }}} */
+
+/** {{{ luasandbox_get_php_obj
+ *
+ * Get the object data for a lua state.
+ */
+php_luasandbox_obj * luasandbox_get_php_obj(lua_State * L)
+{
+	php_luasandbox_obj * obj;
+	lua_getfield(L, LUA_REGISTRYINDEX, "php_luasandbox_obj");
+	obj = (php_luasandbox_obj*)lua_touserdata(L, -1);
+	assert(obj != NULL);
+	lua_pop(L, 1);
+	return obj;
+}
+/* }}} */
+
+/** {{{ luasandbox_format_function_name
+ *
+ * Format the name of a function for a profiler report. ar must have been
+ * filled by lua_getinfo() with at least "Sn". If name is NULL, the name
+ * known to Lua is used.
+ */
+zend_string * luasandbox_format_function_name(lua_Debug * ar, const char * name)
+{
+	zend_string * zstr;
+	char * prof_name;
+	size_t prof_name_size;
+
+	if (!name) {
+		if (ar->namewhat[0] != '\0') {
+			name = ar->name;
+		} else if (ar->what[0] == 'm') {
+			name = "[main chunk]";
+		}
+	}
+	prof_name_size = strlen(ar->short_src)
+		+ sizeof(ar->linedefined) * 4 + sizeof("  <:>");
+	if (name) {
+		prof_name_size += strlen(name);
+	}
+
+	zstr = zend_string_alloc(prof_name_size, 0);
+	prof_name = ZSTR_VAL(zstr);
+
+	if (!name) {
+		if (ar->linedefined > 0) {
+			snprintf(prof_name, prof_name_size, "<%s:%d>", ar->short_src, ar->linedefined);
+		} else {
+			strcpy(prof_name, "?");
+		}
+	} else {
+		if (ar->what[0] == 'm') {
+			snprintf(prof_name, prof_name_size, "%s <%s>", name, ar->short_src);
+		} else if (ar->linedefined > 0) {
+			snprintf(prof_name, prof_name_size, "%s <%s:%d>", name, ar->short_src, ar->linedefined);
+		} else {
+			snprintf(prof_name, prof_name_size, "%s", name);
+		}
+	}
+	ZSTR_LEN(zstr) = strlen(prof_name);
+	return zstr;
+}
+/* }}} */
+
+/** {{{ proto void LuaSandbox::registerLibrary(string libname, array functions)
+ *
+ * Register a set of PHP functions as a Lua library, so that Lua can call the
+ * relevant PHP code.
+ *
+ * The first parameter is the name of the library. In the Lua state, the global
+ * variable of this name will be set to the table of functions. If the table
+ * already exists, the new functions will be added to it.
+ *
+ * The second parameter is an array, where each key is a function name, and
+ * each value is a corresponding PHP callback.
+ *
+ * Both Lua and PHP allow functions to be called with any number of arguments.
+ * The parameters to the Lua function will be passed through to the PHP.
+ *
+ * Lua supports multiple return values. The PHP function should return either
+ * null (for zero return values) or an array of return values. The keys of the
+ * return array will not be used, rather the values will be taken in their
+ * internal order.
+ *
+ * For catching Lua errors that might be raised, we need a struct and a helper
+ * function too.
+ */
+
+struct LuaSandbox_registerLibrary_params {
+	char *libname;
+	str_param_len_t libname_len;
+	HashTable *functions;
+};
+
+static int LuaSandbox_registerLibrary_protected(lua_State* L) {
+	struct LuaSandbox_registerLibrary_params *p = (struct LuaSandbox_registerLibrary_params *)lua_touserdata(L, 1);
+	HashTable * functions = p->functions;
+
+	// Determine if the library exists already
+	// Make a copy of the library name on the stack for rawset later
+	lua_pushlstring(L, p->libname, p->libname_len);
+	lua_pushvalue(L, -1);
+	lua_rawget(L, LUA_GLOBALSINDEX);
+	if (lua_type(L, -1) == LUA_TNIL) {
+		// Remove the nil
+		lua_pop(L, 1);
+
+		// Create the new table
+		lua_createtable(L, 0, zend_hash_num_elements(functions));
+	} else {
+		luasandbox_lib_materialize(L, -1);
+	}
+
+	zend_ulong lkey;
+	zend_string *key;
+	zval *callback;
+	ZEND_HASH_FOREACH_KEY_VAL(functions, lkey, key, callback)
+	{
+		// Push the key
+		if ( key ) {
+			lua_pushlstring(L, ZSTR_VAL(key), ZSTR_LEN(key));
+		} else {
+			lua_pushinteger(L, lkey);
+		}
+
+		// Push the callback zval and create the closure
+		luasandbox_push_zval_userdata(L, callback);
+		lua_pushcclosure(L, luasandbox_call_php, 1);
+
+		// Add it to the table
+		lua_rawset(L, -3);
+	} ZEND_HASH_FOREACH_END();
+
+	// Move the new table to the global namespace
+	// The key is on the stack already
+	lua_rawset(L, LUA_GLOBALSINDEX);
+
+	return 0;
+}
+
+PHP_METHOD(LuaSandbox, registerLibrary)
+{
+	struct LuaSandbox_registerLibrary_params p;
+	lua_State * L;
+	int status;
+	zval * zfunctions = NULL;
+
+	L = luasandbox_state_from_zval(getThis());
+
+	CHECK_VALID_STATE(L);
+
+	p.libname = NULL;
+	p.libname_len = 0;
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "sa",
+		&p.libname, &p.libname_len, &zfunctions) == FAILURE)
+	{
+		RETURN_FALSE;
+	}
+
+	p.functions = Z_ARRVAL_P(zfunctions);
+
+	status = lua_cpcall(L, LuaSandbox_registerLibrary_protected, &p);
+
+	// Handle any error from Lua
+	if (status != 0) {
+		luasandbox_handle_error(GET_LUASANDBOX_OBJ(getThis()), status);
+		RETVAL_FALSE;
+	}
+}
+/* }}} */
+
+/** {{{ proto LuaSandbox LuaSandbox::cloneFrom(LuaSandbox template)
+ *
+ * Create a new LuaSandbox whose global environment is a copy of the global
+ * environment of the given sandbox. This allows a sandbox with its libraries
+ * and modules already loaded to be used as a template, so that the setup
+ * code does not need to be parsed and run again for each new sandbox.
+ *
+ * The new sandbox is independent of the template. Tables are copied
+ * recursively, Lua functions are copied as bytecode along with their
+ * upvalues, and PHP callbacks registered with registerLibrary() or
+ * wrapPhpFunction() refer to the same PHP callables. Closures which share an
+ * upvalue get the same copy of a table, function or userdata it holds, but
+ * not a shared variable. A template with closures sharing an upvalue which
+ * holds any other value can't be cloned, and an error is thrown.
+ *
+ * The result is always a LuaSandbox, even if the template or the class
+ * called is a subclass, since no constructor is run. The memory limit, soft
+ * memory limit and its callback, CPU limit and random seed are copied from
+ * the template. Usage counters, the profiler and LuaSandboxFunction objects
+ * are not.
+ */
+PHP_METHOD(LuaSandbox, cloneFrom)
+{
+	zval * zsource = NULL;
+	php_luasandbox_obj * source, * sandbox;
+	int status;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "O",
+		&zsource, luasandbox_ce) == FAILURE)
+	{
+		RETURN_FALSE;
+	}
+
+	source = GET_LUASANDBOX_OBJ(zsource);
+	CHECK_VALID_STATE(luasandbox_get_state(source));
+
+	object_init_ex(return_value, luasandbox_ce);
+	sandbox = GET_LUASANDBOX_OBJ(return_value);
+	sandbox->lazy_libraries = source->lazy_libraries;
+	sandbox->slim_profile = source->slim_profile;
+	sandbox->alloc.allocator = source->alloc.allocator;
+	sandbox->alloc.region_size = source->alloc.region_size;
+	sandbox->alloc.huge_pages = source->alloc.huge_pages;
+	sandbox->alloc.gc_pause_floor = source->alloc.gc_pause_floor;
+	sandbox->alloc.gc_pause_ceiling = source->alloc.gc_pause_ceiling;
+	sandbox->alloc.gc_bands = source->alloc.gc_bands;
+	sandbox->gc_stepmul = source->gc_stepmul;
+	sandbox->alloc.collect_stats = source->alloc.collect_stats;
+	if (!Z_ISUNDEF(source->group)) {
+		luasandbox_set_group(sandbox, &source->group);
+	}
+	sandbox->state = luasandbox_newstate(sandbox);
+	sandbox->alloc.memory_limit = source->alloc.memory_limit;
+#ifndef LUASANDBOX_NO_CLOCK
+	sandbox->is_cpu_limited = source->is_cpu_limited;
+	luasandbox_timer_set_limit(&sandbox->timer, &source->timer.limiter_limit);
+	luasandbox_timer_set_wall_limit(&sandbox->timer, &source->timer.wall_limit);
+#endif
+
+	status = luasandbox_clone_state(source, sandbox);
+	if (status != 0) {
+		luasandbox_handle_error(sandbox, status);
+		zval_ptr_dtor(return_value);
+		RETURN_FALSE;
+	}
+	// Set after copying, so that the copy doesn't call the callback
+	sandbox->alloc.soft_memory_limit = source->alloc.soft_memory_limit;
+	if (!Z_ISUNDEF(source->soft_limit_callback)) {
+		ZVAL_COPY(&sandbox->soft_limit_callback, &source->soft_limit_callback);
+	}
+	luasandbox_timer_set_instruction_limit(sandbox, source->instruction_limit);
+}
+/* }}} */
+
+/** {{{ proto LuaSandbox LuaSandbox::getPersistent(string name, callable initializer = null, array options = [])
+ *
+ * Get a sandbox whose Lua state survives from one request to the next within
+ * the same PHP process, so that libraries and modules loaded into it by the
+ * initializer do not have to be loaded again on every request.
+ *
+ * The first time a name is used in a process, a new sandbox is created and
+ * the initializer, if given, is called with it as its only argument. The
+ * global environment it leaves behind becomes the baseline for the sandbox.
+ * At the end of each request, or when the object is destroyed, the globals
+ * table is put back, every table reachable from the globals or the string
+ * metatable is restored to its baseline contents and metatable, and every
+ * reachable function gets back its baseline upvalues and environment.
+ * Chunks loaded with loadString() are discarded and a full garbage
+ * collection is done. Later calls with the same name return a
+ * sandbox in that state, without calling the initializer.
+ *
+ * While the sandbox is in use, further calls with the same name return the
+ * same object. Limits and usage counters are not persistent: the memory and
+ * CPU limits start out unlimited on each request, as for a new sandbox.
+ *
+ * A PHP callback can't outlive the request that registered it, so the
+ * initializer should not register any. Call registerLibrary() on the
+ * returned object instead, the library table will be removed by the reset.
+ * If a PHP callback is still reachable after the reset, the state is closed
+ * with a warning and will be created again on next use.
+ *
+ * The options are used when the state is created, and are ignored when an
+ * existing state is returned. Only "allocator", "mmapSize" and "hugePages"
+ * are accepted, with the same meaning as for the constructor, except that
+ * the slab allocator is not available. The region of the mmap allocator
+ * belongs to the state, and is unmapped when the state is closed.
+ */
+PHP_METHOD(LuaSandbox, getPersistent)
+{
+	zend_string * name, * key;
+	zend_fcall_info fci = empty_fcall_info;
+	zend_fcall_info_cache fcc = empty_fcall_info_cache;
+	HashTable * options = NULL;
+	HashTable * pool;
+	php_luasandbox_persistent * entry;
+	php_luasandbox_obj * sandbox;
+	int status, ok = 1;
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "S|f!h",
+		&name, &fci, &fcc, &options) == FAILURE)
+	{
+		RETURN_FALSE;
+	}
+	if (options) {
+		ZEND_HASH_FOREACH_STR_KEY(options, key) {
+			if (!key || !(zend_string_equals_literal(key, "allocator")
+				|| zend_string_equals_literal(key, "mmapSize")
+				|| zend_string_equals_literal(key, "hugePages")))
+			{
+				php_error_docref(NULL, E_WARNING,
+					"option \"%s\" is not supported by getPersistent()",
+					key ? ZSTR_VAL(key) : "");
+				RETURN_FALSE;
+			}
+		} ZEND_HASH_FOREACH_END();
+	}
+
+	pool = LUASANDBOX_G(persistent_sandboxes);
+	if (!pool) {
+		pool = pemalloc(sizeof(HashTable), 1);
+		zend_hash_init(pool, 0, NULL, NULL, 1);
+		LUASANDBOX_G(persistent_sandboxes) = pool;
+	}
+
+	entry = (php_luasandbox_persistent*)zend_hash_find_ptr(pool, name);
+	if (entry && entry->object) {
+		// Already in use by this request
+		ZVAL_OBJ(return_value, entry->object);
+		Z_ADDREF_P(return_value);
+		return;
+	}
+
+	object_init_ex(return_value, luasandbox_ce);
+	sandbox = GET_LUASANDBOX_OBJ(return_value);
+	if (entry) {
+		luasandbox_persistent_attach(entry, sandbox);
+		return;
+	}
+
+	entry = pecalloc(1, sizeof(php_luasandbox_persistent), 1);
+	entry->name = zend_string_init(ZSTR_VAL(name), ZSTR_LEN(name), 1);
+	entry->object = &sandbox->std;
+	sandbox->persistent = entry;
+	sandbox->alloc.persistent = 1;
+	if (options) {
+		luasandbox_set_options(sandbox, options);
+		if (sandbox->alloc.allocator == LUASANDBOX_ALLOCATOR_SLAB) {
+			php_error_docref(NULL, E_WARNING,
+				"the slab allocator can't be used by a persistent sandbox");
+			sandbox->alloc.allocator = LUASANDBOX_ALLOCATOR_DEFAULT;
+		}
+	}
+	sandbox->state = entry->state = luasandbox_newstate(sandbox);
+	zend_hash_add_ptr(pool, entry->name, entry);
+
+	if (ZEND_FCI_INITIALIZED(fci)) {
+		zval retval;
+		ZVAL_UNDEF(&retval);
+		fci.retval = &retval;
+		fci.params = return_value;
+		fci.param_count = 1;
+		ok = zend_call_function(&fci, &fcc) == SUCCESS && !EG(exception);
+		zval_ptr_dtor(&retval);
+	}
+
+	if (ok) {
+		status = lua_cpcall(sandbox->state, luasandbox_baseline_save_protected, NULL);
+		if (status != 0) {
+			luasandbox_handle_error(sandbox, status);
+			ok = 0;
+		}
+	}
+
+	if (!ok) {
+		// Forget the entry. The object still refers to the state, which will
+		// be closed when the object is destroyed.
+		zend_hash_del(pool, entry->name);
+		zend_string_release(entry->name);
+		pefree(entry, 1);
+		sandbox->persistent = NULL;
+		zval_ptr_dtor(return_value);
+		RETURN_FALSE;
+	}
+}
+/* }}} */
+
+/** {{{ luasandbox_persistent_attach
+ *
+ * Attach an idle persistent state to a newly created LuaSandbox object.
+ */
+static void luasandbox_persistent_attach(php_luasandbox_persistent * entry,
+	php_luasandbox_obj * sandbox)
+{
+	lua_State * L = entry->state;
+
+	sandbox->persistent = entry;
+	sandbox->state = L;
+	sandbox->alloc = entry->alloc;
+	sandbox->alloc.memory_limit = (size_t)-1;
+	sandbox->alloc.soft_memory_limit = (size_t)-1;
+	sandbox->alloc.peak_memory_usage = sandbox->alloc.memory_usage;
+	sandbox->alloc.call_peak_usage = sandbox->alloc.memory_usage;
+	entry->object = &sandbox->std;
+	luasandbox_alloc_attach_state(&sandbox->alloc, L, sandbox);
+
+	// The registry key already exists, so this can't allocate
+	lua_pushlightuserdata(L, (void*)sandbox);
+	lua_setfield(L, LUA_REGISTRYINDEX, "php_luasandbox_obj");
+}
+/* }}} */
+
+/** {{{ luasandbox_persistent_release
+ *
+ * Called when a LuaSandbox object with a persistent state is destroyed.
+ * Reset the state to its baseline and detach it, or close it if it can't be
+ * safely kept.
+ */
+static void luasandbox_persistent_release(php_luasandbox_obj * sandbox)
+{
+	php_luasandbox_persistent * entry = sandbox->persistent;
+	lua_State * L = sandbox->state;
+	int status;
+
+	sandbox->alloc.memory_limit = (size_t)-1;
+	sandbox->alloc.limit_lifted++;
+	lua_sethook(L, NULL, 0, 0);
+	status = lua_cpcall(L, luasandbox_baseline_restore_protected, NULL);
+	if (status != 0) {
+		lua_pop(L, 1);
+	}
+	sandbox->alloc.limit_lifted--;
+
+	if (status != 0 || sandbox->zval_userdata_count != 0) {
+		php_error_docref(NULL, E_WARNING,
+			"unable to reset persistent LuaSandbox \"%s\", it will be recreated",
+			ZSTR_VAL(entry->name));
+		zend_hash_del(LUASANDBOX_G(persistent_sandboxes), entry->name);
+		// Close the state with the allocator state it is using, so that its
+		// mmap region is freed
+		entry->alloc = sandbox->alloc;
+		luasandbox_persistent_free(entry);
+	} else {
+		entry->alloc = sandbox->alloc;
+		entry->object = NULL;
+		luasandbox_alloc_detach_state(&entry->alloc, L);
+	}
+	sandbox->persistent = NULL;
+	sandbox->state = NULL;
 }
 /* }}} */
 
-/** {{{ luasandbox_get_php_obj
+/** {{{ luasandbox_persistent_free
  *
- * Get the object data for a lua state.
+ * Close a persistent state and free its pool entry. The caller must remove
+ * the entry from the pool.
  */
-php_luasandbox_obj * luasandbox_get_php_obj(lua_State * L)
+static void luasandbox_persistent_free(php_luasandbox_persistent * entry)
 {
-	php_luasandbox_obj * obj;
-	lua_getfield(L, LUA_REGISTRYINDEX, "php_luasandbox_obj");
-	obj = (php_luasandbox_obj*)lua_touserdata(L, -1);
-	assert(obj != NULL);
-	lua_pop(L, 1);
-	return obj;
+	luasandbox_alloc_delete_state(&entry->alloc, entry->state);
+	zend_string_release(entry->name);
+	pefree(entry, 1);
 }
 /* }}} */
 
-/** {{{ proto void LuaSandbox::registerLibrary(string libname, array functions)
- *
- * Register a set of PHP functions as a Lua library, so that Lua can call the
- * relevant PHP code.
- *
- * The first parameter is the name of the library. In the Lua state, the global
- * variable of this name will be set to the table of functions. If the table
- * already exists, the new functions will be added to it.
- *
- * The second parameter is an array, where each key is a function name, and
- * each value is a corresponding PHP callback.
+/** {{{ luasandbox_baseline_save_protected
  *
- * Both Lua and PHP allow functions to be called with any number of arguments.
- * The parameters to the Lua function will be passed through to the PHP.
- *
- * Lua supports multiple return values. The PHP function should return either
- * null (for zero return values) or an array of return values. The keys of the
- * return array will not be used, rather the values will be taken in their
- * internal order.
+ * Save the globals table, and a shallow copy of every table and function
+ * reachable from it or from the string metatable, in the registry for
+ * luasandbox_baseline_restore_protected()
+ */
+static int luasandbox_baseline_save_protected(lua_State * L)
+{
+	int baseline;
+
+	lua_newtable(L);
+	baseline = lua_gettop(L);
+	luasandbox_baseline_add(L, baseline, LUA_GLOBALSINDEX);
+	lua_pushliteral(L, "");
+	if (lua_getmetatable(L, -1)) {
+		luasandbox_baseline_add(L, baseline, lua_gettop(L));
+	}
+	lua_settop(L, baseline);
+	lua_setfield(L, LUA_REGISTRYINDEX, "php_luasandbox_baseline");
+	lua_pushvalue(L, LUA_GLOBALSINDEX);
+	lua_setfield(L, LUA_REGISTRYINDEX, "php_luasandbox_baseline_globals");
+	return 0;
+}
+/* }}} */
+
+/** {{{ luasandbox_baseline_add
  *
- * For catching Lua errors that might be raised, we need a struct and a helper
- * function too.
+ * Add the table or function at the given absolute or pseudo-index to the
+ * baseline, and recursively anything it refers to. Each table is mapped to a
+ * record holding a copy of its contents and its metatable. Each function is
+ * mapped to a record holding a copy of its upvalues and its environment.
+ * Other values are ignored.
  */
+static void luasandbox_baseline_add(lua_State * L, int baseline, int index)
+{
+	int contents, i;
 
-struct LuaSandbox_registerLibrary_params {
-	char *libname;
-	str_param_len_t libname_len;
-	HashTable *functions;
-};
+	if (!lua_istable(L, index) && !lua_isfunction(L, index)) {
+		return;
+	}
+	luaL_checkstack(L, 10, "saving LuaSandbox baseline");
 
-static int LuaSandbox_registerLibrary_protected(lua_State* L) {
-	struct LuaSandbox_registerLibrary_params *p = (struct LuaSandbox_registerLibrary_params *)lua_touserdata(L, 1);
-	HashTable * functions = p->functions;
+	lua_pushvalue(L, index);
+	lua_rawget(L, baseline);
+	if (!lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pop(L, 1);
 
-	// Determine if the library exists already
-	// Make a copy of the library name on the stack for rawset later
-	lua_pushlstring(L, p->libname, p->libname_len);
+	lua_pushvalue(L, index);
+	lua_createtable(L, 2, 0);
+	lua_newtable(L);
 	lua_pushvalue(L, -1);
-	lua_rawget(L, LUA_GLOBALSINDEX);
-	if (lua_type(L, -1) == LUA_TNIL) {
-		// Remove the nil
+	lua_rawseti(L, -3, 1);
+	if (lua_isfunction(L, index)) {
+		lua_getfenv(L, index);
+		lua_rawseti(L, -3, 2);
+	} else if (lua_getmetatable(L, index)) {
+		lua_rawseti(L, -3, 2);
+	}
+	lua_insert(L, -3);
+	lua_rawset(L, baseline);
+	contents = lua_gettop(L);
+
+	if (lua_isfunction(L, index)) {
+		// Upvalues shared with other closures are restored through each of
+		// them, to the same value
+		for (i = 1; lua_getupvalue(L, index, i) != NULL; i++) {
+			luasandbox_baseline_add(L, baseline, lua_gettop(L));
+			lua_rawseti(L, contents, i);
+		}
+		lua_getfenv(L, index);
+		luasandbox_baseline_add(L, baseline, lua_gettop(L));
+		lua_pop(L, 2);
+		return;
+	}
+
+	lua_pushnil(L);
+	while (lua_next(L, index) != 0) {
+		lua_pushvalue(L, -2);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, contents);
+		luasandbox_baseline_add(L, baseline, lua_gettop(L) - 1);
+		luasandbox_baseline_add(L, baseline, lua_gettop(L));
 		lua_pop(L, 1);
+	}
 
-		// Create the new table
-		lua_createtable(L, 0, zend_hash_num_elements(functions));
+	if (lua_getmetatable(L, index)) {
+		luasandbox_baseline_add(L, baseline, lua_gettop(L));
+		lua_pop(L, 1);
 	}
+	lua_pop(L, 1);
+}
+/* }}} */
 
-	zend_ulong lkey;
-	zend_string *key;
-	zval *callback;
-	ZEND_HASH_FOREACH_KEY_VAL(functions, lkey, key, callback)
-	{
-		// Push the key
-		if ( key ) {
-			lua_pushlstring(L, ZSTR_VAL(key), ZSTR_LEN(key));
-		} else {
-			lua_pushinteger(L, lkey);
-		}
+/** {{{ luasandbox_baseline_restore_protected
+ *
+ * Restore the globals, tables and functions saved by
+ * luasandbox_baseline_save_protected(), discard all loaded chunks and
+ * collect the garbage.
+ */
+static int luasandbox_baseline_restore_protected(lua_State * L)
+{
+	int baseline, table, i;
 
-		// Push the callback zval and create the closure
-		luasandbox_push_zval_userdata(L, callback);
-		lua_pushcclosure(L, luasandbox_call_php, 1);
+	// setfenv(0, t) replaces the globals
+	lua_getfield(L, LUA_REGISTRYINDEX, "php_luasandbox_baseline_globals");
+	if (lua_istable(L, -1)) {
+		lua_replace(L, LUA_GLOBALSINDEX);
+	} else {
+		lua_pop(L, 1);
+	}
 
-		// Add it to the table
-		lua_rawset(L, -3);
-	} ZEND_HASH_FOREACH_END();
+	lua_getfield(L, LUA_REGISTRYINDEX, "php_luasandbox_baseline");
+	baseline = lua_gettop(L);
+	if (lua_istable(L, baseline)) {
+		lua_pushnil(L);
+		while (lua_next(L, baseline) != 0) {
+			table = lua_gettop(L) - 1;
+
+			if (lua_isfunction(L, table)) {
+				lua_rawgeti(L, table + 1, 1);
+				for (i = 1; lua_getupvalue(L, table, i) != NULL; i++) {
+					lua_pop(L, 1);
+					lua_rawgeti(L, -1, i);
+					lua_setupvalue(L, table, i);
+				}
+				lua_pop(L, 1);
 
-	// Move the new table to the global namespace
-	// The key is on the stack already
-	lua_rawset(L, LUA_GLOBALSINDEX);
+				lua_rawgeti(L, table + 1, 2);
+				if (lua_istable(L, -1)) {
+					lua_setfenv(L, table);
+				} else {
+					lua_pop(L, 1);
+				}
+				lua_pop(L, 1);
+				continue;
+			}
+
+			// Remove all members. Assigning nil to an existing field during
+			// traversal is allowed.
+			lua_pushnil(L);
+			while (lua_next(L, table) != 0) {
+				lua_pop(L, 1);
+				lua_pushvalue(L, -1);
+				lua_pushnil(L);
+				lua_rawset(L, table);
+			}
+
+			lua_rawgeti(L, table + 1, 1);
+			lua_pushnil(L);
+			while (lua_next(L, -2) != 0) {
+				lua_pushvalue(L, -2);
+				lua_insert(L, -2);
+				lua_rawset(L, table);
+			}
+			lua_pop(L, 1);
+
+			lua_rawgeti(L, table + 1, 2);
+			lua_setmetatable(L, table);
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 1);
 
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, "php_luasandbox_chunks");
+	lua_gc(L, LUA_GCCOLLECT, 0);
 	return 0;
 }
+/* }}} */
 
-PHP_METHOD(LuaSandbox, registerLibrary)
+/** {{{ proto bool LuaSandbox::reset()
+ *
+ * Return the sandbox to the state it was in after construction, reusing the
+ * existing lua_State rather than closing it and creating a new one. The
+ * global environment and the standard library are recreated, loaded chunks
+ * are discarded, and the old environment is garbage collected. For a
+ * sandbox from getPersistent(), the environment is restored to the
+ * baseline left by the initializer instead.
+ *
+ * CPU usage and profiler data are cleared, and the peak memory usage is set
+ * to the current usage. The memory and CPU limits are kept.
+ * LuaSandboxFunction objects created before the reset can no longer be
+ * called.
+ */
+PHP_METHOD(LuaSandbox, reset)
 {
-	struct LuaSandbox_registerLibrary_params p;
+	php_luasandbox_obj * sandbox = GET_LUASANDBOX_OBJ(getThis());
 	lua_State * L;
+	size_t old_memory_limit;
 	int status;
-	zval * zfunctions = NULL;
 
-	L = luasandbox_state_from_zval(getThis());
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE) {
+		RETURN_FALSE;
+	}
 
+	L = luasandbox_get_state(sandbox);
 	CHECK_VALID_STATE(L);
-
-	p.libname = NULL;
-	p.libname_len = 0;
-	if (zend_parse_parameters(ZEND_NUM_ARGS(), "sa",
-		&p.libname, &p.libname_len, &zfunctions) == FAILURE)
-	{
+	if (sandbox->in_lua) {
+		php_error_docref(NULL, E_WARNING,
+			"cannot reset a LuaSandbox while Lua code is running");
 		RETURN_FALSE;
 	}
 
-	p.functions = Z_ARRVAL_P(zfunctions);
+	lua_sethook(L, NULL, 0, 0);
+	luasandbox_timer_reset(&sandbox->timer);
+	luasandbox_memory_profiler_disable(sandbox);
+	sandbox->timed_out = 0;
+	sandbox->random_seed = 0;
 
-	status = lua_cpcall(L, LuaSandbox_registerLibrary_protected, &p);
+	// The new environment is not subject to the limit, as in the constructor
+	old_memory_limit = sandbox->alloc.memory_limit;
+	sandbox->alloc.memory_limit = (size_t)-1;
+	sandbox->alloc.limit_lifted++;
+	if (sandbox->persistent) {
+		status = lua_cpcall(L, luasandbox_baseline_restore_protected, NULL);
+	} else {
+		status = lua_cpcall(L, luasandbox_reset_protected, NULL);
+	}
+	sandbox->alloc.limit_lifted--;
+	sandbox->alloc.memory_limit = old_memory_limit;
+	sandbox->alloc.peak_memory_usage = sandbox->alloc.memory_usage;
+	sandbox->alloc.call_peak_usage = sandbox->alloc.memory_usage;
+	sandbox->instruction_count = 0;
+	luasandbox_timer_set_instruction_limit(sandbox, sandbox->instruction_limit);
 
-	// Handle any error from Lua
 	if (status != 0) {
-		luasandbox_handle_error(GET_LUASANDBOX_OBJ(getThis()), status);
-		RETVAL_FALSE;
+		luasandbox_handle_error(sandbox, status);
+		RETURN_FALSE;
 	}
+	RETURN_TRUE;
+}
+/* }}} */
+
+/** {{{ luasandbox_reset_protected
+ *
+ * Replace the globals with a new standard environment, discard all loaded
+ * chunks and collect the garbage. Called under lua_cpcall() by
+ * LuaSandbox::reset().
+ */
+static int luasandbox_reset_protected(lua_State * L)
+{
+	php_luasandbox_obj * sandbox;
+
+	// C functions take the environment of the function which creates them,
+	// so switch this function's environment as well as the globals, or the
+	// new library functions would keep the old globals alive.
+	lua_newtable(L);
+	lua_pushvalue(L, -1);
+	lua_replace(L, LUA_ENVIRONINDEX);
+	lua_replace(L, LUA_GLOBALSINDEX);
+
+	// luaL_register() would reuse the old library tables from _LOADED
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, "_LOADED");
+
+	sandbox = luasandbox_get_php_obj(L);
+	luasandbox_lib_register(L, sandbox->lazy_libraries, sandbox->slim_profile);
+
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, "php_luasandbox_chunks");
+	lua_gc(L, LUA_GCCOLLECT, 0);
+	return 0;
 }
 /* }}} */
 
@@ -1801,31 +3793,41 @@ int luasandbox_call_php(lua_State * L)
 
 	// If an exception occurred, convert it to a Lua error
 	if (EG(exception)) {
-		// Get the error message and push it to the stack
-		zval exception, rv;
-		ZVAL_OBJ(&exception, EG(exception));
-		zend_class_entry * ce = Z_OBJCE(exception);
-		zval * zmsg = luasandbox_read_property(ce, &exception, "message", sizeof("message")-1, 1, &rv);
-
-		if (zmsg && Z_TYPE_P(zmsg) == IS_STRING) {
-			lua_pushlstring(L, Z_STRVAL_P(zmsg), Z_STRLEN_P(zmsg));
-		} else {
-			lua_pushliteral(L, "[unknown exception]");
-		}
-
-		// If the exception was a LuaSandboxRuntimeError or a subclass, clear the
-		// exception and raise a non-fatal (catchable) error
-		if (luasandbox_instanceof(ce, luasandboxruntimeerror_ce)) {
-			zend_clear_exception();
-		} else {
-			luasandbox_wrap_fatal(L);
-		}
-		lua_error(L);
+		luasandbox_raise_php_exception(L);
 	}
 	return num_results;
 }
 /* }}} */
 
+/** {{{ luasandbox_raise_php_exception
+ *
+ * Convert the current PHP exception to a Lua error and raise it
+ */
+static void luasandbox_raise_php_exception(lua_State * L)
+{
+	// Get the error message and push it to the stack
+	zval exception, rv;
+	ZVAL_OBJ(&exception, EG(exception));
+	zend_class_entry * ce = Z_OBJCE(exception);
+	zval * zmsg = luasandbox_read_property(ce, &exception, "message", sizeof("message")-1, 1, &rv);
+
+	if (zmsg && Z_TYPE_P(zmsg) == IS_STRING) {
+		lua_pushlstring(L, Z_STRVAL_P(zmsg), Z_STRLEN_P(zmsg));
+	} else {
+		lua_pushliteral(L, "[unknown exception]");
+	}
+
+	// If the exception was a LuaSandboxRuntimeError or a subclass, clear the
+	// exception and raise a non-fatal (catchable) error
+	if (luasandbox_instanceof(ce, luasandboxruntimeerror_ce)) {
+		zend_clear_exception();
+	} else {
+		luasandbox_wrap_fatal(L);
+	}
+	lua_error(L);
+}
+/* }}} */
+
 /** {{{ string LuaSandboxFunction::dump()
  *
  * Dump the function as a precompiled binary blob. Returns a string which may
@@ -1897,6 +3899,124 @@ static int luasandbox_dump_writer(lua_State * L, const void * p, size_t sz, void
 	return 0;
 }
 /* }}} */
+
+/** {{{ luasandbox_set_group
+ *
+ * Make the sandbox a member of a LuaSandboxGroup. This must be done before
+ * the Lua state is created.
+ */
+static void luasandbox_set_group(php_luasandbox_obj * sandbox, zval * zgroup)
+{
+	zval_ptr_dtor(&sandbox->group);
+	ZVAL_COPY(&sandbox->group, zgroup);
+	sandbox->alloc.group = GET_LUASANDBOXGROUP_OBJ(zgroup);
+}
+/* }}} */
+
+/** {{{ luasandbox_leave_group
+ *
+ * Stop accounting the sandbox's memory to its group, and take its current
+ * usage off the group's usage. The reference to the group object is kept
+ * until the sandbox is freed.
+ */
+static void luasandbox_leave_group(php_luasandbox_obj * sandbox)
+{
+	php_luasandbox_group * group = sandbox->alloc.group;
+
+	if (!group) {
+		return;
+	}
+	if (group->memory_usage > sandbox->alloc.memory_usage) {
+		group->memory_usage -= sandbox->alloc.memory_usage;
+	} else {
+		group->memory_usage = 0;
+	}
+	sandbox->alloc.group = NULL;
+}
+/* }}} */
+
+/** {{{ luasandboxgroup_new
+ *
+ * "new" handler for the LuaSandboxGroup class.
+ */
+static object_constructor_ret_t luasandboxgroup_new(zend_class_entry *ce)
+{
+	php_luasandbox_group * intern;
+
+#if PHP_VERSION_ID < 70300
+	intern = (php_luasandbox_group*)ecalloc(1, sizeof(php_luasandbox_group) + zend_object_properties_size(ce));
+#else
+	intern = (php_luasandbox_group*)zend_object_alloc(sizeof(php_luasandbox_group), ce);
+#endif
+
+	zend_object_std_init(&intern->std, ce);
+	object_properties_init(&intern->std, ce);
+	intern->std.handlers = &luasandboxgroup_object_handlers;
+	intern->memory_limit = (size_t)-1;
+	return &intern->std;
+}
+/* }}} */
+
+/** {{{ luasandboxgroup_free_storage
+ *
+ * "Free storage" handler for LuaSandboxGroup objects. Each member sandbox
+ * holds a reference, and leaves the group in its destructor, so no member
+ * refers to the group once it is freed, even if they are freed together
+ * as a garbage cycle.
+ */
+static void luasandboxgroup_free_storage(zend_object *object)
+{
+	zend_object_std_dtor(object);
+}
+/* }}} */
+
+/** {{{ proto void LuaSandboxGroup::setMemoryLimit(int limit)
+ *
+ * Set the limit on the total memory usage of the sandboxes in the group. It
+ * is checked whenever a member allocates memory, except while the limit of
+ * the member is lifted.
+ */
+PHP_METHOD(LuaSandboxGroup, setMemoryLimit)
+{
+	long_param_t limit;
+	php_luasandbox_group * group = GET_LUASANDBOXGROUP_OBJ(getThis());
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "l", &limit) == FAILURE) {
+		RETURN_FALSE;
+	}
+	group->memory_limit = limit;
+}
+/* }}} */
+
+/** {{{ proto int LuaSandboxGroup::getMemoryUsage()
+ *
+ * Get the total memory usage of the sandboxes in the group
+ */
+PHP_METHOD(LuaSandboxGroup, getMemoryUsage)
+{
+	php_luasandbox_group * group = GET_LUASANDBOXGROUP_OBJ(getThis());
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE) {
+		RETURN_FALSE;
+	}
+	RETURN_LONG(group->memory_usage);
+}
+/* }}} */
+
+/** {{{ proto int LuaSandboxGroup::getPeakMemoryUsage()
+ *
+ * Get the peak total memory usage of the sandboxes in the group
+ */
+PHP_METHOD(LuaSandboxGroup, getPeakMemoryUsage)
+{
+	php_luasandbox_group * group = GET_LUASANDBOXGROUP_OBJ(getThis());
+
+	if (zend_parse_parameters(ZEND_NUM_ARGS(), "") == FAILURE) {
+		RETURN_FALSE;
+	}
+	RETURN_LONG(group->peak_memory_usage);
+}
+/* }}} */
 /*
  * Local variables:
  * tab-width: 4
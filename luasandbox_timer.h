@@ -9,15 +9,25 @@ void luasandbox_timer_mshutdown();
 void luasandbox_timer_create(luasandbox_timer_set * lts, struct _php_luasandbox_obj * sandbox);
 void luasandbox_timer_set_limit(luasandbox_timer_set * lts,
 		struct timespec * timeout);
+void luasandbox_timer_set_wall_limit(luasandbox_timer_set * lts,
+		struct timespec * timeout);
 int luasandbox_timer_enable_profiler(luasandbox_timer_set * lts, struct timespec * period);
 int luasandbox_timer_start(luasandbox_timer_set * lts);
 void luasandbox_timer_stop(luasandbox_timer_set * lts);
 void luasandbox_timer_destroy(luasandbox_timer_set * lts);
+void luasandbox_timer_reset(luasandbox_timer_set * lts);
 void luasandbox_timer_get_usage(luasandbox_timer_set * lts, struct timespec * ts);
+void luasandbox_timer_get_wall_usage(luasandbox_timer_set * lts, struct timespec * ts);
 void luasandbox_timer_pause(luasandbox_timer_set * lts);
 void luasandbox_timer_unpause(luasandbox_timer_set * lts);
 int luasandbox_timer_is_paused(luasandbox_timer_set * lts);
 void luasandbox_timer_timeout_error(lua_State *L);
 int luasandbox_timer_is_expired(luasandbox_timer_set * lts);
 
+void luasandbox_timer_set_instruction_limit(struct _php_luasandbox_obj * sandbox,
+		zend_long limit);
+int luasandbox_timer_instructions_expired(struct _php_luasandbox_obj * sandbox);
+void luasandbox_timer_restore_hook(lua_State * L, struct _php_luasandbox_obj * sandbox);
+int luasandbox_timer_hook_is_pending(lua_State * L);
+
 #endif /*LUASANDBOX_TIMER_H*/
@@ -5,6 +5,7 @@
 
 #ifndef LUASANDBOX_NO_CLOCK
 #include <semaphore.h>
+#include <pthread.h>
 #endif
 
 #ifdef LUASANDBOX_NO_CLOCK
@@ -27,18 +28,44 @@ struct _php_luasandbox_obj;
 
 typedef struct _luasandbox_timer {
 	struct _php_luasandbox_obj * sandbox;
-	timer_t timer;
 	clockid_t clock_id;
 	int type;
 	sem_t semaphore;
-	int id;
+	// The registry slot number in the low 32 bits, and the generation of the
+	// slot in the high 32 bits, so that a stale ID never finds a reused slot
+	uint64_t id;
+	// The next slot in the registry free list
+	uint32_t next_free;
+	// The thread whose CPU clock the timer measures
+	pthread_t thread;
+	// Nonzero while a one-shot limiter is armed for the current call
+	volatile int armed;
+	// The CPU clock reading in nanoseconds at which the timer expires, or
+	// zero if disarmed. Accessed atomically, so that a limiter can be armed
+	// and disarmed without taking the service mutex.
+	volatile int64_t expiry;
+	// The monotonic time in nanoseconds at which the service thread will next
+	// check the timer, or zero if it is not queued. Written with the service
+	// mutex held, but may be read atomically without it.
+	volatile int64_t wake;
+
+	// The following are protected by the timer service mutex.
+	// The period of a periodic timer, or zero for a one-shot timer
+	struct timespec interval;
+	// The number of periods missed at the last expiry of a periodic timer
+	long overrun;
+	// The position of the timer in the service heap, or -1 if not queued
+	ssize_t heap_index;
 } luasandbox_timer;
 
 typedef struct {
 	luasandbox_timer *limiter_timer;
 	luasandbox_timer *profiler_timer;
+	luasandbox_timer *wall_timer;
 	struct timespec limiter_limit, limiter_remaining;
+	struct timespec wall_limit, wall_remaining;
 	struct timespec usage_start, usage;
+	struct timespec wall_usage_start, wall_usage;
 	struct timespec pause_start, pause_delta;
 	struct timespec limiter_expired_at;
 	struct timespec profiler_period;
@@ -46,6 +73,7 @@ typedef struct {
 	int is_running;
 	int limiter_running;
 	int profiler_running;
+	int wall_running;
 
 	// A HashTable storing the number of times each function was hit by the
 	// profiler. The data is a size_t because that hits a special case in
@@ -66,18 +94,157 @@ typedef struct {
 #endif /*LUASANDBOX_NO_CLOCK*/
 
 ZEND_BEGIN_MODULE_GLOBALS(luasandbox)
-	HashTable * allowed_globals;
 	long active_count;
+	// Named sandboxes which survive across requests, see LuaSandbox::getPersistent()
+	HashTable * persistent_sandboxes;
+	// The mmap allocator regions of this request, so that any which are left
+	// after a bailout can be unmapped at the end of the request
+	struct _luasandbox_mmap_region * mmap_regions;
 ZEND_END_MODULE_GLOBALS(luasandbox)
 
+/**
+ * Memory allocation backends for Lua states, see the "allocator" constructor
+ * option
+ */
+enum {
+	LUASANDBOX_ALLOCATOR_DEFAULT,
+	LUASANDBOX_ALLOCATOR_SLAB,
+	LUASANDBOX_ALLOCATOR_MMAP
+};
+
+struct _luasandbox_slab_arena;
+struct _luasandbox_mmap_region;
+struct _php_luasandbox_group;
+
+/** The default and minimum size of the region reserved by the mmap allocator */
+#define LUASANDBOX_DEFAULT_MMAP_SIZE ((size_t)256 * 1024 * 1024)
+#define LUASANDBOX_MIN_MMAP_SIZE 65536
+/** The amount of the mmap allocator's region made accessible at a time */
+#define LUASANDBOX_MMAP_COMMIT_SIZE ((size_t)1024 * 1024)
+
+/** The deepest call stack recorded by the memory profiler */
+#define LUASANDBOX_MEMORY_PROFILER_MAX_DEPTH 64
+
+/** The number of log2 size classes in luasandbox_alloc_stats */
+#define LUASANDBOX_ALLOC_HISTOGRAM_SIZE 32
+
+/**
+ * Allocation counters, kept if the allocatorStats constructor option is set
+ */
+typedef struct {
+	zend_ulong allocations;
+	zend_ulong frees;
+	zend_ulong reallocations;
+	zend_ulong bytes_allocated;
+	// The number of allocations and reallocations by new size. Element i
+	// counts sizes from 2^i to 2^(i+1)-1, the last element counts all larger
+	// sizes.
+	zend_ulong histogram[LUASANDBOX_ALLOC_HISTOGRAM_SIZE];
+} luasandbox_alloc_stats;
+
+/** The object types counted by LuaSandbox::getMemoryBreakdown() */
+enum {
+	LUASANDBOX_BREAKDOWN_STRING,
+	LUASANDBOX_BREAKDOWN_TABLE,
+	LUASANDBOX_BREAKDOWN_FUNCTION,
+	LUASANDBOX_BREAKDOWN_PROTO,
+	LUASANDBOX_BREAKDOWN_CFUNCTION,
+	LUASANDBOX_BREAKDOWN_USERDATA,
+	LUASANDBOX_BREAKDOWN_THREAD,
+	LUASANDBOX_BREAKDOWN_NUM_TYPES
+};
+
+/**
+ * The estimated size of the reachable objects in a Lua state, by type
+ */
+typedef struct {
+	size_t count[LUASANDBOX_BREAKDOWN_NUM_TYPES];
+	size_t bytes[LUASANDBOX_BREAKDOWN_NUM_TYPES];
+	// The part of the table bytes used by array parts and hash parts
+	size_t table_array_bytes;
+	size_t table_hash_bytes;
+	// The number of userdata which hold a PHP value
+	size_t zval_userdata;
+	// The sandbox's memory usage before the walk
+	size_t memory_usage;
+} luasandbox_memory_breakdown;
+
 typedef struct {
 	lua_Alloc old_alloc;
 	void * old_alloc_ud;
 	size_t memory_limit;
+	// See LuaSandbox::setSoftMemoryLimit()
+	size_t soft_memory_limit;
 	size_t memory_usage;
 	size_t peak_memory_usage;
+	// Nonzero to allocate from the persistent (malloc) heap rather than the
+	// request heap
+	int persistent;
+	// One of the LUASANDBOX_ALLOCATOR_* constants
+	int allocator;
+	// Small block free lists, for LUASANDBOX_ALLOCATOR_SLAB
+	struct _luasandbox_slab_arena * slab;
+	// The memory region for LUASANDBOX_ALLOCATOR_MMAP, its size, and whether
+	// to ask for transparent huge pages
+	struct _luasandbox_mmap_region * region;
+	size_t region_size;
+	int huge_pages;
+	// Nonzero to allocate stats when the state is created
+	int collect_stats;
+	luasandbox_alloc_stats * stats;
+	// GC pause controller settings, see luasandbox_update_gc_pause()
+	int gc_pause_floor;
+	int gc_pause_ceiling;
+	int gc_bands;
+	// The usage band in which the current GC pause applies, and the limit it
+	// was computed for
+	size_t gc_band_low;
+	size_t gc_band_high;
+	size_t gc_band_limit;
+	size_t gc_band_group_limit;
+	// The number of completed collection cycles, see luasandbox_alloc_gc_init()
+	size_t gc_cycles;
+	// The total number of bytes released by freeing or shrinking blocks,
+	// whether by the collector or not
+	size_t released_bytes;
+	// The group whose memory budget is shared, or NULL
+	struct _php_luasandbox_group * group;
+	// Nonzero while memory_limit is lifted for internal work, such as
+	// creating the state or handling an error. The group limit is not
+	// enforced either while this is set.
+	int limit_lifted;
+	// The peak memory usage since the current top-level call started
+	size_t call_peak_usage;
 } php_luasandbox_alloc;
 
+/**
+ * The sampling memory profiler, see LuaSandbox::enableMemoryProfiler()
+ */
+typedef struct {
+	// The number of bytes allocated between samples
+	size_t interval;
+	// The number of bytes left to allocate before the next sample
+	size_t countdown;
+	// The number of bytes attributed to each function name
+	HashTable * function_bytes;
+	// The number of bytes attributed to each call stack, as function names
+	// separated by ";", outermost first
+	HashTable * stack_bytes;
+} luasandbox_memory_profiler;
+
+/**
+ * A lua_State held in the module globals between requests. While a request
+ * is using it, it is attached to a LuaSandbox object, which takes over its
+ * allocator state.
+ */
+typedef struct {
+	zend_string * name;
+	lua_State * state;
+	php_luasandbox_alloc alloc;
+	// The LuaSandbox object it is attached to, or NULL
+	zend_object * object;
+} php_luasandbox_persistent;
+
 struct _php_luasandbox_obj {
 	lua_State * state;
 	php_luasandbox_alloc alloc;
@@ -86,14 +253,70 @@ struct _php_luasandbox_obj {
 	zval current_zval; /* The zval for the LuaSandbox which is currently executing Lua code */
 	volatile int timed_out;
 	int is_cpu_limited;
+	// The limit set by LuaSandbox::setInstructionLimit(), or zero
+	zend_long instruction_limit;
+	// The number of VM instructions counted while a limit was set
+	zend_long instruction_count;
+	// The value of instruction_count at which the limit is reached
+	zend_long instruction_deadline;
+	// The count which the instruction hook is currently set with
+	int instruction_interval;
 	luasandbox_timer_set timer;
 	int function_index;
 	unsigned int random_seed;
 	int allow_pause;
+	// Constructor option: load math, os and debug on first access
+	int lazy_libraries;
+	// Constructor option: create only the base, string, table and math
+	// libraries, and compact the new state
+	int slim_profile;
+	// The GC step multiplier set when the state is created
+	int gc_stepmul;
+	// The time in microseconds to spend on GC steps after each top-level
+	// call, or zero to disable idle GC
+	zend_long idle_gc_budget;
+	// The GC step multiplier used while Lua code runs, if idle GC is enabled
+	int idle_gc_call_stepmul;
+	// The memory usage when idle GC last finished a cycle
+	size_t idle_gc_usage;
+	// The number of live userdata created by luasandbox_push_zval_userdata()
+	int zval_userdata_count;
+	php_luasandbox_persistent * persistent;
+	luasandbox_memory_profiler * memory_profiler;
+	// Nonzero if the soft limit was handled and usage has not dropped below it
+	int soft_limit_handled;
+	// Nonzero if luasandbox_soft_limit_hook() is due to run
+	int soft_limit_pending;
+	// The soft memory limit callback, or undef
+	zval soft_limit_callback;
+	// The LuaSandboxGroup this sandbox belongs to, or undef
+	zval group;
+#if PHP_VERSION_ID < 70400
+	// The zvals shown to the cycle collector by luasandbox_get_gc(), which
+	// has no buffer API before PHP 7.4
+	zval gc_table[2];
+#endif
+	// The memory which the next call may allocate, set by the call options,
+	// or (size_t)-1
+	size_t call_memory_allowance;
+	// The net and peak change in memory usage over the last top-level call
+	zend_long last_call_memory_delta;
+	size_t last_call_peak_delta;
 	zend_object std;
 };
 typedef struct _php_luasandbox_obj php_luasandbox_obj;
 
+/**
+ * A memory budget shared by a group of sandboxes, see LuaSandboxGroup
+ */
+struct _php_luasandbox_group {
+	size_t memory_limit;
+	size_t memory_usage;
+	size_t peak_memory_usage;
+	zend_object std;
+};
+typedef struct _php_luasandbox_group php_luasandbox_group;
+
 struct _php_luasandboxfunction_obj {
 	zval sandbox;
 	int index;
@@ -110,8 +333,13 @@ static inline php_luasandboxfunction_obj *php_luasandboxfunction_fetch_object(ze
 	return (php_luasandboxfunction_obj *)((char*)(obj) - offsetof(php_luasandboxfunction_obj, std));
 }
 
+static inline php_luasandbox_group *php_luasandbox_group_fetch_object(zend_object *obj) {
+	return (php_luasandbox_group *)((char*)(obj) - offsetof(php_luasandbox_group, std));
+}
+
 #define GET_LUASANDBOX_OBJ(z) php_luasandbox_fetch_object(Z_OBJ_P(z))
 #define GET_LUASANDBOXFUNCTION_OBJ(z) php_luasandboxfunction_fetch_object(Z_OBJ_P(z))
+#define GET_LUASANDBOXGROUP_OBJ(z) php_luasandbox_group_fetch_object(Z_OBJ_P(z))
 #define LUASANDBOXFUNCTION_SANDBOX_IS_OK(pfunc) !Z_ISUNDEF((pfunc)->sandbox)
 #define LUASANDBOXFUNCTION_GET_SANDBOX_ZVALPTR(pfunc) &((pfunc)->sandbox)
 #define LUASANDBOX_GET_CURRENT_ZVAL_PTR(psandbox) &((psandbox)->current_zval)
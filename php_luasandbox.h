@@ -24,6 +24,13 @@
 
 lua_State * luasandbox_alloc_new_state(php_luasandbox_alloc * alloc, php_luasandbox_obj * sandbox);
 void luasandbox_alloc_delete_state(php_luasandbox_alloc * alloc, lua_State * L);
+void luasandbox_alloc_attach_state(php_luasandbox_alloc * alloc, lua_State * L,
+	php_luasandbox_obj * sandbox);
+void luasandbox_alloc_detach_state(php_luasandbox_alloc * alloc, lua_State * L);
+void luasandbox_alloc_gc_init(lua_State * L);
+void luasandbox_alloc_post_deactivate();
+void luasandbox_memory_profiler_enable(php_luasandbox_obj * sandbox, size_t interval);
+void luasandbox_memory_profiler_disable(php_luasandbox_obj * sandbox);
 
 /* luasandbox.c */
 
@@ -44,6 +51,8 @@ extern zend_module_entry luasandbox_module_entry;
 #endif
 
 int luasandbox_call_php(lua_State * L);
+void luasandbox_soft_limit_exceeded(php_luasandbox_obj * sandbox);
+void luasandbox_soft_limit_hook(lua_State * L, lua_Debug * ar);
 int luasandbox_call_lua(php_luasandbox_obj * sandbox, zval * sandbox_zval,
 	int nargs, int nresults, int errfunc);
 
@@ -52,27 +61,55 @@ PHP_MSHUTDOWN_FUNCTION(luasandbox);
 PHP_RSHUTDOWN_FUNCTION(luasandbox);
 PHP_MINFO_FUNCTION(luasandbox);
 
+PHP_METHOD(LuaSandbox, __construct);
 PHP_METHOD(LuaSandbox, getVersionInfo);
 PHP_METHOD(LuaSandbox, loadString);
 PHP_METHOD(LuaSandbox, loadBinary);
+PHP_METHOD(LuaSandbox, loadPreloaded);
 PHP_METHOD(LuaSandbox, setMemoryLimit);
+PHP_METHOD(LuaSandbox, setSoftMemoryLimit);
 PHP_METHOD(LuaSandbox, getMemoryUsage);
 PHP_METHOD(LuaSandbox, getPeakMemoryUsage);
+PHP_METHOD(LuaSandbox, collectGarbage);
+PHP_METHOD(LuaSandbox, stepGarbageCollector);
+PHP_METHOD(LuaSandbox, setGCParameters);
+PHP_METHOD(LuaSandbox, getGCStats);
+PHP_METHOD(LuaSandbox, setIdleGCBudget);
+PHP_METHOD(LuaSandbox, runIdleGC);
+PHP_METHOD(LuaSandbox, getAllocatorStats);
+PHP_METHOD(LuaSandbox, getMemoryBreakdown);
 PHP_METHOD(LuaSandbox, setCPULimit);
 PHP_METHOD(LuaSandbox, getCPUUsage);
+PHP_METHOD(LuaSandbox, setWallClockLimit);
+PHP_METHOD(LuaSandbox, getWallClockUsage);
+PHP_METHOD(LuaSandbox, setInstructionLimit);
+PHP_METHOD(LuaSandbox, getInstructionCount);
 PHP_METHOD(LuaSandbox, pauseUsageTimer);
 PHP_METHOD(LuaSandbox, unpauseUsageTimer);
 PHP_METHOD(LuaSandbox, enableProfiler);
 PHP_METHOD(LuaSandbox, disableProfiler);
 PHP_METHOD(LuaSandbox, getProfilerFunctionReport);
+PHP_METHOD(LuaSandbox, enableMemoryProfiler);
+PHP_METHOD(LuaSandbox, disableMemoryProfiler);
+PHP_METHOD(LuaSandbox, getMemoryProfilerReport);
 PHP_METHOD(LuaSandbox, callFunction);
+PHP_METHOD(LuaSandbox, callFunctionWithOptions);
+PHP_METHOD(LuaSandbox, getLastCallMemoryDelta);
 PHP_METHOD(LuaSandbox, wrapPhpFunction);
 PHP_METHOD(LuaSandbox, registerLibrary);
+PHP_METHOD(LuaSandbox, cloneFrom);
+PHP_METHOD(LuaSandbox, getPersistent);
+PHP_METHOD(LuaSandbox, reset);
 
 PHP_METHOD(LuaSandboxFunction, __construct);
 PHP_METHOD(LuaSandboxFunction, call);
+PHP_METHOD(LuaSandboxFunction, callWithOptions);
 PHP_METHOD(LuaSandboxFunction, dump);
 
+PHP_METHOD(LuaSandboxGroup, setMemoryLimit);
+PHP_METHOD(LuaSandboxGroup, getMemoryUsage);
+PHP_METHOD(LuaSandboxGroup, getPeakMemoryUsage);
+
 #ifdef ZTS
 #define LUASANDBOX_G(v) TSRMG(luasandbox_globals_id, zend_luasandbox_globals *, v)
 #else
@@ -81,6 +118,7 @@ PHP_METHOD(LuaSandboxFunction, dump);
 
 
 php_luasandbox_obj * luasandbox_get_php_obj(lua_State * L);
+zend_string * luasandbox_format_function_name(lua_Debug * ar, const char * name);
 
 /** {{{ luasandbox_enter_php
  *
@@ -125,8 +163,27 @@ static inline void luasandbox_leave_php(lua_State * L, php_luasandbox_obj * inte
 
 /* library.c */
 
-void luasandbox_lib_register(lua_State * L);
-void luasandbox_lib_destroy_globals();
+int luasandbox_lib_minit();
+void luasandbox_lib_mshutdown();
+void luasandbox_lib_register(lua_State * L, int lazy, int slim);
+int luasandbox_lib_is_placeholder(lua_State * L, int index);
+void luasandbox_lib_materialize(lua_State * L, int index);
+int luasandbox_lib_materialize_protected(lua_State * L);
+
+/* preload.c */
+
+void luasandbox_preload_minit(const char * paths);
+void luasandbox_preload_mshutdown();
+zend_string * luasandbox_preload_find(zend_string * name);
+
+/* breakdown.c */
+
+int luasandbox_memory_breakdown_state(php_luasandbox_obj * sandbox,
+	luasandbox_memory_breakdown * result);
+
+/* clone.c */
+
+int luasandbox_clone_state(php_luasandbox_obj * source, php_luasandbox_obj * dest);
 
 /* luasandbox_lstrlib.c */
 
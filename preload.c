@@ -0,0 +1,144 @@
+/**
+ * Compilation of the Lua modules listed in the luasandbox.preload INI
+ * setting, for LuaSandbox::loadPreloaded().
+ *
+ * The files are compiled once at startup, and the bytecode is kept in a
+ * process-wide table which is read-only after MINIT, so it can be shared by
+ * all threads.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <string.h>
+
+#include "php.h"
+#include "php_luasandbox.h"
+#include "zend_smart_str.h"
+
+static HashTable luasandbox_preloaded;
+
+static void luasandbox_preload_file(lua_State * L, const char * path);
+static int luasandbox_preload_writer(lua_State * L, const void * data, size_t sz, void * ud);
+static void luasandbox_preload_dtor(zval * zv);
+
+/** {{{ luasandbox_preload_minit
+ *
+ * Compile the files in the given path list, which is separated by
+ * ZEND_PATHS_SEPARATOR. A file which can't be compiled raises a startup
+ * warning and is skipped.
+ */
+void luasandbox_preload_minit(const char * paths)
+{
+	char * list, * path, * next;
+	lua_State * L;
+
+	zend_hash_init(&luasandbox_preloaded, 0, NULL, luasandbox_preload_dtor, 1);
+	if (!paths || !*paths) {
+		return;
+	}
+
+	L = luaL_newstate();
+	if (!L) {
+		php_error_docref(NULL, E_CORE_WARNING,
+			"unable to create a Lua state for luasandbox.preload");
+		return;
+	}
+
+	list = pestrdup(paths, 1);
+	for (path = list; path; path = next) {
+		next = strchr(path, ZEND_PATHS_SEPARATOR);
+		if (next) {
+			*next++ = '\0';
+		}
+		if (*path) {
+			luasandbox_preload_file(L, path);
+		}
+	}
+	pefree(list, 1);
+	lua_close(L);
+}
+/* }}} */
+
+/** {{{ luasandbox_preload_mshutdown */
+void luasandbox_preload_mshutdown()
+{
+	zend_hash_destroy(&luasandbox_preloaded);
+}
+/* }}} */
+
+/** {{{ luasandbox_preload_find
+ *
+ * Get the bytecode of the preloaded module with the given name, or NULL if
+ * there is no such module.
+ */
+zend_string * luasandbox_preload_find(zend_string * name)
+{
+	return (zend_string*)zend_hash_find_ptr(&luasandbox_preloaded, name);
+}
+/* }}} */
+
+/** {{{ luasandbox_preload_file
+ *
+ * Compile one file and add it to the table, under its base name without the
+ * extension.
+ */
+static void luasandbox_preload_file(lua_State * L, const char * path)
+{
+	const char * name, * p, * ext = NULL;
+	smart_str buf = {0};
+
+	name = path;
+	for (p = path; *p; p++) {
+		if (*p == '/' || *p == DEFAULT_SLASH) {
+			name = p + 1;
+			ext = NULL;
+		} else if (*p == '.') {
+			ext = p;
+		}
+	}
+	if (!ext || ext == name) {
+		ext = p;
+	}
+
+	if (luaL_loadfile(L, path) != 0) {
+		php_error_docref(NULL, E_CORE_WARNING,
+			"unable to preload \"%s\": %s", path, lua_tostring(L, -1));
+		lua_pop(L, 1);
+		return;
+	}
+	lua_dump(L, luasandbox_preload_writer, &buf);
+	lua_pop(L, 1);
+	if (!buf.s) {
+		php_error_docref(NULL, E_CORE_WARNING, "unable to preload \"%s\"", path);
+		return;
+	}
+
+	if (zend_hash_str_exists(&luasandbox_preloaded, name, ext - name)) {
+		php_error_docref(NULL, E_CORE_WARNING,
+			"\"%s\" has the same module name as a previous file in luasandbox.preload", path);
+	}
+	zend_hash_str_update_ptr(&luasandbox_preloaded, name, ext - name, buf.s);
+}
+/* }}} */
+
+/** {{{ luasandbox_preload_writer
+ *
+ * Writer function for lua_dump(), appending to a persistent smart_str
+ */
+static int luasandbox_preload_writer(lua_State * L, const void * data, size_t sz, void * ud)
+{
+	smart_str_appendl_ex((smart_str*)ud, (const char*)data, sz, 1);
+	return 0;
+}
+/* }}} */
+
+/** {{{ luasandbox_preload_dtor */
+static void luasandbox_preload_dtor(zval * zv)
+{
+	zend_string_release((zend_string*)Z_PTR_P(zv));
+}
+/* }}} */
@@ -10,6 +10,58 @@ class LuaSandbox {
 	const SECONDS = 1;
 	const PERCENT = 2;
 
+	/**
+	 * Create a new Lua environment
+	 *
+	 * @param array $options Associative array of options:
+	 *  - lazyLibraries: (bool) Load the math, os and debug libraries when
+	 *    they are first accessed rather than on construction. This saves
+	 *    memory and time in sandboxes which don't use them. A library is
+	 *    loaded when it is indexed, iterated, or passed to next(), rawget(),
+	 *    rawset(), getmetatable(), setmetatable() or table.foreach(), and its
+	 *    members are then in the same order as in a sandbox without this
+	 *    option. To do this, those functions are replaced by C wrappers, which
+	 *    are different function values from the ones in a sandbox without
+	 *    this option, and each call to them costs slightly more. Sandboxes
+	 *    without this option are not affected.
+	 *  - profile: (string) "full" (the default) or "slim". A slim sandbox has
+	 *    only the base, string, table and math libraries, and is garbage
+	 *    collected after setup. Use this when creating many sandboxes, to
+	 *    reduce the memory used by each of them.
+	 *  - allocator: (string) "default", "slab" or "mmap". The slab allocator
+	 *    keeps free lists of small blocks for each sandbox, which is faster for
+	 *    code which creates many small strings and tables. Its memory is
+	 *    released when the sandbox is destroyed. The mmap allocator serves all
+	 *    blocks from a memory region reserved for the sandbox, which is
+	 *    unmapped in one call when the sandbox is destroyed. Its memory is not
+	 *    counted against the PHP memory_limit. It is not available on Windows.
+	 *    Memory usage and the sandbox memory limit are not affected by the
+	 *    choice of allocator.
+	 *  - mmapSize: (int) The size of the region reserved by the mmap
+	 *    allocator, in bytes. The region is made usable 1 MiB at a time as
+	 *    the sandbox grows, and only that part counts towards the system's
+	 *    commit limit. When the region is full, malloc() is used. The default
+	 *    is 256 MiB, or twice the memory limit when a smaller limit is set
+	 *    before the Lua state is created.
+	 *  - hugePages: (bool) Ask for the mmap allocator's region to be backed by
+	 *    transparent huge pages, where the kernel supports it.
+	 *  - gcPauseFloor, gcPauseCeiling: (int) The range of the garbage
+	 *    collector pause, in percent. The pause is reduced as memory usage
+	 *    approaches the limit, so that garbage is collected before the limit
+	 *    is hit. Without a memory limit, the pause is the ceiling. The
+	 *    defaults are 0 and 200.
+	 *  - gcBands: (int) The pause is only recomputed when memory usage moves
+	 *    into a different band. The memory limit is divided into this many
+	 *    equal bands. The default is 32.
+	 *  - gcStepMul: (int) The garbage collector step multiplier, in percent.
+	 *    The default is 2000.
+	 *  - allocatorStats: (bool) Count allocations, for getAllocatorStats().
+	 *  - group: (LuaSandboxGroup) A group whose memory limit this sandbox
+	 *    shares with the other members.
+	 */
+	public function __construct( array $options = [] ) {
+	}
+
 	/**
 	 * Return the versions of LuaSandbox and Lua
 	 * @return array With two keys
@@ -44,6 +96,20 @@ class LuaSandbox {
 	public function loadBinary( $binary, $chunkName = '' ) {
 	}
 
+	/**
+	 * Load a module compiled at startup from the luasandbox.preload INI
+	 * setting
+	 *
+	 * luasandbox.preload is a list of Lua source files, separated by ":"
+	 * (";" on Windows). Each is compiled once when PHP starts, and can then
+	 * be loaded into any sandbox without parsing it again.
+	 *
+	 * @param string $name File name without directory or extension
+	 * @return LuaSandboxFunction|false
+	 */
+	public function loadPreloaded( $name ) {
+	}
+
 	/**
 	 * Set the memory limit for the Lua environment.
 	 *
@@ -54,6 +120,27 @@ class LuaSandbox {
 	public function setMemoryLimit( $limit ) {
 	}
 
+	/**
+	 * Set a soft memory limit for the Lua environment.
+	 *
+	 * When Lua code allocates memory beyond the soft limit, a full garbage
+	 * collection is done before its next instruction, since much of the
+	 * memory may be garbage which has not been collected yet. If the memory
+	 * usage is still above the soft limit, the callback is called with the
+	 * sandbox and the memory usage in bytes. It may, for example, log the
+	 * event or raise the memory limit with setMemoryLimit(). Exceptions
+	 * thrown by the callback are raised in Lua in the same way as exceptions
+	 * from library functions.
+	 *
+	 * The soft limit is not checked again until the memory usage has dropped
+	 * below it.
+	 *
+	 * @param int $limit Soft limit in bytes, or zero to disable it
+	 * @param callable|null $callback
+	 */
+	public function setSoftMemoryLimit( $limit, ?callable $callback = null ) {
+	}
+
 	/**
 	 * Fetch the current memory usage of the Lua environment.
 	 * @return int Current memory usage in bytes.
@@ -68,6 +155,161 @@ class LuaSandbox {
 	public function getPeakMemoryUsage() {
 	}
 
+	/**
+	 * Run a full garbage collection cycle.
+	 *
+	 * This can be used to collect garbage at a time when the cost doesn't
+	 * matter, for example between calls, rather than during a later call.
+	 * The memory limit does not apply during the collection.
+	 *
+	 * @return int|false The number of bytes freed
+	 */
+	public function collectGarbage() {
+	}
+
+	/**
+	 * Do an incremental step of garbage collection.
+	 *
+	 * @param int $kb The size of the step. The amount of work done is roughly
+	 *  what is needed to collect this many kilobytes, scaled by the step
+	 *  multiplier.
+	 * @return bool True if the step finished a collection cycle
+	 */
+	public function stepGarbageCollector( $kb ) {
+	}
+
+	/**
+	 * Set the garbage collector parameters.
+	 *
+	 * The pause controls how long the collector waits before starting a new
+	 * cycle: a new cycle starts when memory usage reaches this percentage of
+	 * the usage after the previous collection. By default the pause is
+	 * reduced as memory usage approaches the limit, setting it here fixes it
+	 * at the given value.
+	 *
+	 * The step multiplier controls how much work the collector does
+	 * relative to the rate of allocation, in percent.
+	 *
+	 * @param int|null $pause The pause, or null to leave it unchanged
+	 * @param int|null $stepmul The step multiplier, or null to leave it
+	 *  unchanged
+	 * @return bool
+	 */
+	public function setGCParameters( $pause, $stepmul = null ) {
+	}
+
+	/**
+	 * Get garbage collector statistics.
+	 *
+	 * @return array With the following keys:
+	 *  - collections: (int) The number of collection cycles completed
+	 *  - bytesReleased: (int) The total number of bytes released by freeing
+	 *    or shrinking blocks. This includes memory released outside the
+	 *    collector, for example when a table is resized, which can't be told
+	 *    apart from collection with the Lua 5.1 API.
+	 *  - pause: (int) The current pause, in percent
+	 *  - stepMul: (int) The current step multiplier, in percent
+	 */
+	public function getGCStats() {
+	}
+
+	/**
+	 * Collect garbage between calls.
+	 *
+	 * After each call from PHP into Lua returns successfully, and its timers
+	 * have stopped, incremental garbage collection steps are run until a
+	 * cycle is finished or the budget is spent. This time is not counted
+	 * against the CPU limit. To move work out of the calls, the step
+	 * multiplier used while Lua code is running is reduced. Nothing is done
+	 * if the memory usage has not increased since the last cycle was
+	 * finished. If a step fails, a warning is raised and the call's results
+	 * are still returned.
+	 *
+	 * The steps delay the return of the call by up to the budget. To run
+	 * them at another time, for example after the response has been sent,
+	 * leave the budget at zero and call runIdleGC() instead.
+	 *
+	 * @param int $usec The time to spend after each call, in microseconds.
+	 *  Zero disables idle collection.
+	 * @param int|null $stepmul The step multiplier used while Lua code is
+	 *  running, in percent. The default is 200. Idle steps use the step
+	 *  multiplier set by setGCParameters() or the gcStepMul option.
+	 * @return bool
+	 */
+	public function setIdleGCBudget( $usec, $stepmul = null ) {
+	}
+
+	/**
+	 * Collect garbage now.
+	 *
+	 * Incremental garbage collection steps are run until a cycle is finished
+	 * or the given time is spent, as is done after each call by
+	 * setIdleGCBudget(). Use this to collect garbage at a time when the
+	 * caller is not waiting, for example after the response has been sent.
+	 * Nothing is done if the memory usage has not increased since the last
+	 * cycle was finished here or after a call. If a step fails, a warning is
+	 * raised.
+	 *
+	 * @param int $usec The maximum time to spend, in microseconds
+	 * @return bool True if a collection cycle was finished
+	 */
+	public function runIdleGC( $usec ) {
+	}
+
+	/**
+	 * Get allocation counters.
+	 *
+	 * This is only available if the allocatorStats constructor option was
+	 * set. The counters cover all memory allocated by the Lua environment
+	 * since it was created, which shows how much churn a script generates,
+	 * even if its peak memory usage is low.
+	 *
+	 * @return array|false With the following keys:
+	 *  - allocations: (int) The number of new blocks allocated
+	 *  - frees: (int) The number of blocks freed
+	 *  - reallocations: (int) The number of blocks resized
+	 *  - bytesAllocated: (int) The total size of new blocks, plus the growth
+	 *    of resized blocks
+	 *  - histogram: (array) The number of allocations and reallocations by
+	 *    size. Each key is a power of two, and its value is the number of
+	 *    requests with a new size from that value up to the next power of
+	 *    two.
+	 */
+	public function getAllocatorStats() {
+	}
+
+	/**
+	 * Get the estimated memory usage of the Lua environment by object type.
+	 *
+	 * The objects reachable from the global table, the registry and the
+	 * stack of the main thread are walked, so this takes time proportional
+	 * to the size of the heap. Lua does not report the size of objects, so
+	 * the sizes are estimated from the layout of Lua 5.1's data structures.
+	 * A function prototype is estimated from the size of its bytecode dump,
+	 * and prototypes with identical dumps are counted once. The memory used
+	 * by the walk itself is not counted in the peak usage. No garbage
+	 * collection is done, so getGCStats() is not affected.
+	 *
+	 * @return array|false With the following keys. Each has a value which is
+	 *   an array with the number of objects under "count" and their total
+	 *   estimated size in bytes under "bytes".
+	 *  - string: (array) Strings, including table keys
+	 *  - table: (array) Tables. Also has "arrayBytes" and "hashBytes", the
+	 *    part of the size used by array parts and hash parts.
+	 *  - function: (array) Lua function closures and their upvalues
+	 *  - proto: (array) The compiled code of Lua functions
+	 *  - cfunction: (array) C functions, including wrapped PHP callbacks
+	 *  - userdata: (array) Userdata. Also has "phpValues", the number of
+	 *    userdata holding a PHP value passed into Lua. The PHP values
+	 *    themselves are not counted.
+	 *  - thread: (array) The main thread and any coroutines, with their
+	 *    stacks counted at their initial size
+	 *  - other: (int) The part of getMemoryUsage() not counted above, such
+	 *    as garbage which has not been collected yet and interpreter state
+	 */
+	public function getMemoryBreakdown() {
+	}
+
 	/**
 	 * Set the CPU time limit for the Lua environment.
 	 *
@@ -95,6 +337,65 @@ class LuaSandbox {
 	public function getCPUUsage() {
 	}
 
+	/**
+	 * Set the wall clock time limit for the Lua environment.
+	 *
+	 * If the real time spent in calls into the environment after the call to
+	 * this method exceeds this limit, a LuaSandboxTimeoutError exception is
+	 * thrown.
+	 *
+	 * Unlike the CPU limit, this includes time spent waiting, for example for
+	 * a slow PHP callback or while the thread is not scheduled, and it is not
+	 * paused by pauseUsageTimer(). A timeout in a PHP callback takes effect
+	 * when the callback returns to Lua.
+	 *
+	 * @param float|false $limit Limit in seconds, or false for no limit
+	 */
+	public function setWallClockLimit( $limit ) {
+	}
+
+	/**
+	 * Fetch the wall clock time spent in calls into the Lua environment.
+	 *
+	 * This includes time spent in PHP callbacks, and is counted separately
+	 * from getCPUUsage().
+	 *
+	 * @return float Wall clock time usage in seconds
+	 */
+	public function getWallClockUsage() {
+	}
+
+	/**
+	 * Set a limit on the number of Lua VM instructions executed.
+	 *
+	 * The limit is counted from the call to this method, over all calls into
+	 * the environment. When it is reached, a LuaSandboxTimeoutError exception
+	 * is thrown. Unlike the CPU limit, the point at which a script is stopped
+	 * does not depend on the machine or its load.
+	 *
+	 * Instructions are counted by a hook which runs every 10000 instructions.
+	 * If the profiler or the soft memory limit interrupts the hook, the
+	 * instructions since it last ran are not counted. Since profiler samples
+	 * are taken on a timer, the count, and so the point at which the limit is
+	 * reached, is not reproducible while the profiler is enabled.
+	 *
+	 * @param int|false $limit The number of instructions, or false for no limit
+	 */
+	public function setInstructionLimit( $limit ) {
+	}
+
+	/**
+	 * Get the number of Lua VM instructions counted against the instruction
+	 * limit.
+	 *
+	 * Instructions are only counted while a limit is set. The count is
+	 * updated every 10000 instructions, and when the limit is reached.
+	 *
+	 * @return int
+	 */
+	public function getInstructionCount() {
+	}
+
 	/**
 	 * Pause the CPU usage timer
 	 *
@@ -160,6 +461,51 @@ class LuaSandbox {
 	public function getProfilerFunctionReport( $units = LuaSandbox::SECONDS ) {
 	}
 
+	/**
+	 * Enable the memory profiler.
+	 *
+	 * While Lua code is running, the call stack is sampled each time
+	 * another `$interval` bytes have been allocated, and each sample
+	 * attributes `$interval` bytes to the running function and to the stack.
+	 * The report shows which functions allocate the most memory, including
+	 * memory which has since been freed. An allocation which is denied by a
+	 * memory limit is always sampled, weighted as the number of intervals it
+	 * would have spanned, and the report is kept after the
+	 * LuaSandboxMemoryError, so it can be used to find the cause.
+	 *
+	 * Any previous report is discarded.
+	 *
+	 * @param int $interval Sampling interval in bytes
+	 * @return bool
+	 */
+	public function enableMemoryProfiler( $interval = 65536 ) {
+	}
+
+	/**
+	 * Disable the memory profiler and discard its report.
+	 */
+	public function disableMemoryProfiler() {
+	}
+
+	/**
+	 * Fetch memory profiler data.
+	 *
+	 * Returns an associative array mapping function names, formatted as in
+	 * getProfilerFunctionReport(), to the estimated number of bytes they
+	 * allocated, in descending order.
+	 *
+	 * If `$stacks` is true, the array maps each sampled call stack to the
+	 * bytes attributed to it instead. A stack is given as the function names
+	 * separated by ";", outermost first, which is the "folded" format read by
+	 * flame graph tools. Stacks deeper than 64 calls are truncated, and begin
+	 * with "...".
+	 *
+	 * @param bool $stacks Whether to report call stacks rather than functions
+	 * @return array
+	 */
+	public function getMemoryProfilerReport( $stacks = false ) {
+	}
+
 	/**
 	 * Call a function in a Lua global variable
 	 *
@@ -179,6 +525,39 @@ class LuaSandbox {
 	public function callFunction( $name /* ... */ ) {
 	}
 
+	/**
+	 * Call a function in a Lua global variable, with options for this call
+	 *
+	 * This is the same as callFunction(), except for the options.
+	 *
+	 * @param string $name Variable name
+	 * @param array $options Associative array of options:
+	 *  - memoryLimit: (int) The number of bytes which the call may allocate,
+	 *    on top of the memory usage when it starts. If it allocates more, a
+	 *    LuaSandboxMemoryError is thrown. The sandbox's own memory limit
+	 *    still applies. Calls back into Lua from PHP callbacks share the
+	 *    allowance.
+	 * @param mixed $args,... Arguments to the function
+	 * @return array|bool Return values from the function
+	 */
+	public function callFunctionWithOptions( $name, array $options /* ... */ ) {
+	}
+
+	/**
+	 * Get the change in memory usage over the last call into Lua
+	 *
+	 * Nested calls made from PHP callbacks are included in the call which
+	 * made the callback.
+	 *
+	 * @return array With the following keys:
+	 *  - net: (int) The memory usage after the call, minus the usage before
+	 *    it. This is negative if the call freed more than it allocated.
+	 *  - peak: (int) The peak memory usage during the call, minus the usage
+	 *    before it.
+	 */
+	public function getLastCallMemoryDelta() {
+	}
+
 	/**
 	 * Wrap a PHP callable in a LuaSandboxFunction, so it can be passed into
 	 * Lua as an anonymous function.
@@ -218,4 +597,87 @@ class LuaSandbox {
 	 */
 	public function registerLibrary( $libName, array $functions ) {
 	}
+
+	/**
+	 * Create a new sandbox with a copy of the global environment of an
+	 * existing sandbox.
+	 *
+	 * This allows a fully initialised sandbox, with its libraries and modules
+	 * loaded, to be used as a template. The setup code does not need to be
+	 * parsed or run again for each copy.
+	 *
+	 * The copy is independent of the template. Tables are copied recursively,
+	 * Lua functions are copied as bytecode along with their upvalues, and PHP
+	 * callbacks refer to the same PHP callables. Closures which share an
+	 * upvalue holding a table, function or userdata get the same copy of it,
+	 * but not a shared variable, so assigning the variable in one closure is
+	 * not seen by the others. If closures share an upvalue holding any other
+	 * value, such as a counter, the template can't be cloned and a
+	 * LuaSandboxRuntimeError is thrown.
+	 *
+	 * The result is always a LuaSandbox, even when called on a subclass,
+	 * since no constructor is run. The memory limit, soft memory limit and
+	 * its callback, CPU limit and random seed are copied from the template.
+	 * Usage counters, profiler data and LuaSandboxFunction objects are not.
+	 *
+	 * @param LuaSandbox $template The sandbox to copy
+	 * @return LuaSandbox|false The new sandbox
+	 */
+	public static function cloneFrom( LuaSandbox $template ) {
+	}
+
+	/**
+	 * Get a sandbox whose Lua environment persists across requests in the
+	 * same PHP process.
+	 *
+	 * The first time a name is used in a process, a new sandbox is created
+	 * and passed to the initializer, which may load libraries and modules
+	 * into it. The resulting global environment is saved as the baseline.
+	 * When the object is destroyed, every table reachable from the globals is
+	 * restored to its baseline contents, every reachable function gets back
+	 * its baseline upvalues and environment, loaded chunks are discarded, and
+	 * the environment is kept for the next call with the same name, which
+	 * will not call the initializer again. While the sandbox is in use, calling
+	 * this again with the same name returns the same object.
+	 *
+	 * Memory and CPU limits are not persistent, they should be set on each
+	 * request. PHP callbacks can't be kept across requests, so the
+	 * initializer should not register any: call registerLibrary() on the
+	 * returned object instead. If a PHP callback is still reachable after the
+	 * reset, a warning is raised and the environment will be recreated.
+	 *
+	 * The options are only used when the environment is created. The
+	 * "allocator", "mmapSize" and "hugePages" options of the constructor are
+	 * accepted, except for the slab allocator. An mmap allocator region
+	 * belongs to the environment and is kept across requests with it.
+	 *
+	 * @param string $name Pool key
+	 * @param callable|null $initializer Called with the new sandbox
+	 * @param array $options Allocator options
+	 * @return LuaSandbox|false
+	 */
+	public static function getPersistent( $name, ?callable $initializer = null, array $options = [] ) {
+	}
+
+	/**
+	 * Return the sandbox to the state it was in after construction.
+	 *
+	 * This reuses the existing Lua state, which is cheaper than destroying
+	 * the sandbox and creating a new one. The global environment and the
+	 * standard library are recreated and loaded chunks are discarded. For a
+	 * sandbox from getPersistent(), the environment returns to the state left
+	 * by the initializer.
+	 *
+	 * CPU usage is cleared, both profilers are disabled and their data
+	 * discarded, and the peak memory usage is set to the current usage. The
+	 * memory and CPU limits are kept.
+	 * LuaSandboxFunction objects created before the reset can no longer be
+	 * called.
+	 *
+	 * This can't be called while Lua code is running.
+	 *
+	 * @return bool
+	 */
+	public function reset() {
+	}
 }
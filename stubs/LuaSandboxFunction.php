@@ -59,6 +59,19 @@ class LuaSandboxFunction {
 	public function call( /*...*/ ) {
 	}
 
+	/**
+	 * Call a Lua function, with options for this call
+	 *
+	 * This is the same as call(), except for the options, which are as for
+	 * LuaSandbox::callFunctionWithOptions().
+	 *
+	 * @param array $options Associative array of options
+	 * @param mixed $args,... Arguments passed to the function.
+	 * @return array|false Return values from the function.
+	 */
+	public function callWithOptions( array $options /*...*/ ) {
+	}
+
 	/**
 	 * Dump the function as a binary blob
 	 * @return string To be passed to LuaSandbox::loadBinary()
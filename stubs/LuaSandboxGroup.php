@@ -0,0 +1,44 @@
+<?php
+
+/**
+ * A memory budget shared by several sandboxes.
+ *
+ * A sandbox joins a group with the "group" constructor option. Memory
+ * allocated by each member counts towards both its own limit and the
+ * group's limit, so the total can be capped without giving each sandbox a
+ * small share of it.
+ *
+ * The group limit is enforced wherever the limit of each sandbox is,
+ * including while loading chunks and converting arguments. Memory allocated
+ * while creating or resetting a sandbox and handling errors is counted, but
+ * is not refused.
+ */
+class LuaSandboxGroup {
+
+	/**
+	 * Set the limit on the total memory usage of the member sandboxes.
+	 *
+	 * When a member would exceed the limit, a LuaSandboxMemoryError is
+	 * thrown, as for LuaSandbox::setMemoryLimit().
+	 *
+	 * @param int $limit Memory limit in bytes
+	 */
+	public function setMemoryLimit( $limit ) {
+	}
+
+	/**
+	 * Get the total memory usage of the member sandboxes.
+	 *
+	 * @return int Current memory usage in bytes
+	 */
+	public function getMemoryUsage() {
+	}
+
+	/**
+	 * Get the peak total memory usage of the member sandboxes.
+	 *
+	 * @return int Peak memory usage in bytes
+	 */
+	public function getPeakMemoryUsage() {
+	}
+}
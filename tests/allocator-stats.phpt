@@ -0,0 +1,51 @@
+--TEST--
+LuaSandbox::getAllocatorStats()
+--FILE--
+<?php
+
+$sandbox = new LuaSandbox( [ 'allocatorStats' => true ] );
+$before = $sandbox->getAllocatorStats();
+var_dump( array_keys( $before ) );
+var_dump( $before['allocations'] > 0 );
+
+$sandbox->loadString( '
+	local t = {}
+	for i = 1, 1000 do
+		t[i] = ("x"):rep( 5000 + i )
+	end
+' )->call();
+$sandbox->collectGarbage();
+$after = $sandbox->getAllocatorStats();
+var_dump( $after['allocations'] - $before['allocations'] >= 1000 );
+var_dump( $after['frees'] - $before['frees'] >= 1000 );
+var_dump( $after['reallocations'] > $before['reallocations'] );
+var_dump( $after['bytesAllocated'] - $before['bytesAllocated'] > 5000000 );
+var_dump( $after['histogram'][4096] - ( $before['histogram'][4096] ?? 0 ) >= 1000 );
+var_dump( array_sum( $after['histogram'] ) === $after['allocations'] + $after['reallocations'] );
+
+$sandbox = new LuaSandbox;
+var_dump( $sandbox->getAllocatorStats() );
+
+--EXPECTF--
+array(5) {
+  [0]=>
+  string(11) "allocations"
+  [1]=>
+  string(5) "frees"
+  [2]=>
+  string(13) "reallocations"
+  [3]=>
+  string(14) "bytesAllocated"
+  [4]=>
+  string(9) "histogram"
+}
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+
+Warning: LuaSandbox::getAllocatorStats(): allocator statistics are not enabled, use the allocatorStats option in %s on line %d
+bool(false)
@@ -0,0 +1,84 @@
+--TEST--
+Per-call memory limit and memory delta
+--FILE--
+<?php
+
+$sandbox = new LuaSandbox;
+$sandbox->loadString( '
+	function grow( n )
+		local t = {}
+		for i = 1, n do
+			t[i] = tostring( i )
+		end
+		kept = t
+		return #t
+	end
+	function churn( n )
+		for i = 1, n do
+			local s = tostring( i )
+		end
+	end
+' )->call();
+
+var_dump( $sandbox->callFunctionWithOptions( 'grow', [ 'memoryLimit' => 1000000 ], 1000 ) );
+$delta = $sandbox->getLastCallMemoryDelta();
+var_dump( $delta['net'] > 0, $delta['peak'] >= $delta['net'] );
+
+try {
+	$sandbox->callFunctionWithOptions( 'grow', [ 'memoryLimit' => 10000 ], 100000 );
+} catch ( LuaSandboxMemoryError $e ) {
+	echo get_class( $e ), "\n";
+}
+
+// The allowance only applies to the call it was given for
+var_dump( $sandbox->callFunction( 'grow', 100000 ) );
+
+$sandbox->loadString( 'kept = nil' )->call();
+$sandbox->collectGarbage();
+$churn = $sandbox->loadString( 'churn( ... )' );
+$churn->callWithOptions( [ 'memoryLimit' => 1000000 ], 10000 );
+$delta = $sandbox->getLastCallMemoryDelta();
+var_dump( $delta['peak'] > 0, $delta['peak'] >= $delta['net'] );
+
+try {
+	$sandbox->loadString( 'local t = {} for i = 1, 1e6 do t[i] = i .. "" end' )
+		->callWithOptions( [ 'memoryLimit' => 10000 ] );
+} catch ( LuaSandboxMemoryError $e ) {
+	echo get_class( $e ), "\n";
+}
+
+var_dump( $sandbox->callFunctionWithOptions( 'grow', [ 'memoryLimit' => -1 ], 1 ) );
+var_dump( $sandbox->callFunctionWithOptions( 'grow', [ 'x' => 1 ], 1 ) );
+
+// A rejected option list leaves no allowance behind for the next call
+var_dump( $sandbox->callFunctionWithOptions( 'grow', [ 'memoryLimit' => 10, 'x' => 1 ], 1 ) );
+var_dump( $sandbox->callFunction( 'grow', 100000 ) );
+
+--EXPECTF--
+array(1) {
+  [0]=>
+  int(1000)
+}
+bool(true)
+bool(true)
+LuaSandboxMemoryError
+array(1) {
+  [0]=>
+  int(100000)
+}
+bool(true)
+bool(true)
+LuaSandboxMemoryError
+
+Warning: LuaSandbox::callFunctionWithOptions(): invalid value for option "memoryLimit" in %s on line %d
+bool(false)
+
+Warning: LuaSandbox::callFunctionWithOptions(): unknown option "x" in %s on line %d
+bool(false)
+
+Warning: LuaSandbox::callFunctionWithOptions(): unknown option "x" in %s on line %d
+bool(false)
+array(1) {
+  [0]=>
+  int(100000)
+}
@@ -0,0 +1,149 @@
+--TEST--
+LuaSandbox::cloneFrom()
+--FILE--
+<?php
+
+function double( $x ) {
+	return [ $x * 2 ];
+}
+
+$template = new LuaSandbox;
+$template->setMemoryLimit( 1000000 );
+$template->registerLibrary( 'php', [ 'double' => 'double' ] );
+$template->loadString( '
+	mod = { count = 0 }
+	mod.self = mod
+	local helper = function ( x ) return x + 1 end
+	function mod.inc()
+		mod.count = helper( mod.count )
+		return mod.count
+	end
+	function mod.double( x )
+		return php.double( x )
+	end
+	string.extra = function () return "extra" end
+	local function fact( n )
+		if n <= 1 then return 1 end
+		return n * fact( n - 1 )
+	end
+	mod.fact = fact
+	local state = { n = 0 }
+	function mod.bump()
+		state.n = state.n + 1
+	end
+	function mod.peek()
+		return state.n
+	end
+' )->call();
+$template->callFunction( 'mod.inc' );
+$template->callFunction( 'mod.bump' );
+
+$clone = LuaSandbox::cloneFrom( $template );
+var_dump( get_class( $clone ) );
+var_dump( $clone->callFunction( 'mod.inc' ) );
+var_dump( $clone->callFunction( 'mod.inc' ) );
+var_dump( $template->callFunction( 'mod.inc' ) );
+var_dump( $clone->callFunction( 'mod.double', 21 ) );
+var_dump( $clone->callFunction( 'mod.fact', 5 ) );
+// Closures which share an upvalue holding a table share the copy of the table
+var_dump( $clone->loadString( 'mod.bump(); mod.bump(); return mod.peek()' )->call() );
+var_dump( $template->callFunction( 'mod.peek' ) );
+var_dump( $clone->loadString( '
+	return mod.self == mod, ("x"):extra(), string.extra == getmetatable("").__index.extra,
+		type(os.date), os.execute == nil, type(pcall)
+' )->call() );
+
+// Changes to the clone don't affect the template
+$clone->loadString( 'mod.count = 100; string.extra = nil' )->call();
+var_dump( $template->loadString( 'return mod.count, string.extra ~= nil' )->call() );
+
+// Closures which share a variable holding a plain value can't be cloned
+$counter = new LuaSandbox;
+$counter->loadString( '
+	local n = 0
+	function bump() n = n + 1 end
+	function peek() return n end
+' )->call();
+try {
+	LuaSandbox::cloneFrom( $counter );
+} catch ( LuaSandboxError $e ) {
+	echo get_class( $e ), ": ", $e->getMessage(), "\n";
+}
+// The template is unchanged
+$counter->callFunction( 'bump' );
+var_dump( $counter->callFunction( 'peek' ) );
+
+// The soft memory limit and its callback are copied
+$soft = new LuaSandbox;
+$soft->setSoftMemoryLimit( $soft->getMemoryUsage() + 100000, static function ( $sandbox, $usage ) {
+	echo "soft limit exceeded\n";
+	$sandbox->setSoftMemoryLimit( 0 );
+} );
+LuaSandbox::cloneFrom( $soft )->loadString( '
+	local t = {}
+	for i = 1, 100 do
+		t[i] = ("x"):rep( 2000 ) .. i
+	end
+' )->call();
+
+class ExtendedLuaSandbox extends LuaSandbox {
+}
+var_dump( get_class( ExtendedLuaSandbox::cloneFrom( new ExtendedLuaSandbox ) ) );
+
+--EXPECT--
+string(10) "LuaSandbox"
+array(1) {
+  [0]=>
+  int(2)
+}
+array(1) {
+  [0]=>
+  int(3)
+}
+array(1) {
+  [0]=>
+  int(2)
+}
+array(1) {
+  [0]=>
+  int(42)
+}
+array(1) {
+  [0]=>
+  int(120)
+}
+array(1) {
+  [0]=>
+  int(3)
+}
+array(1) {
+  [0]=>
+  int(1)
+}
+array(6) {
+  [0]=>
+  bool(true)
+  [1]=>
+  string(5) "extra"
+  [2]=>
+  bool(true)
+  [3]=>
+  string(8) "function"
+  [4]=>
+  bool(true)
+  [5]=>
+  string(8) "function"
+}
+array(2) {
+  [0]=>
+  int(2)
+  [1]=>
+  bool(true)
+}
+LuaSandboxRuntimeError: cannot clone closures which share an upvalue holding a number
+array(1) {
+  [0]=>
+  int(1)
+}
+soft limit exceeded
+string(10) "LuaSandbox"
@@ -0,0 +1,46 @@
+--TEST--
+Global environment
+--FILE--
+<?php
+
+$sandbox = new LuaSandbox;
+var_dump( $sandbox->loadString( '
+	local function keys( t )
+		local ret = {}
+		for k in pairs( t ) do
+			ret[#ret + 1] = k
+		end
+		table.sort( ret )
+		return table.concat( ret, " " )
+	end
+	return keys( _G ), keys( os ), keys( debug ), keys( table ),
+		_G == getfenv(), _VERSION, math.pi == 4 * math.atan( 1 ), math.huge > 1e308,
+		type( math.random ), ipairs( { "x" } ) ~= nil, next( { "y" } )
+' )->call() );
+--EXPECT--
+array(12) {
+  [0]=>
+  string(184) "_G _VERSION assert debug error getfenv getmetatable ipairs math next os pairs pcall rawequal rawget rawset select setfenv setmetatable string table tonumber tostring type unpack xpcall"
+  [1]=>
+  string(23) "clock date difftime time"
+  [2]=>
+  string(9) "traceback"
+  [3]=>
+  string(57) "concat foreach foreachi getn insert maxn remove setn sort"
+  [4]=>
+  bool(true)
+  [5]=>
+  string(7) "Lua 5.1"
+  [6]=>
+  bool(true)
+  [7]=>
+  bool(true)
+  [8]=>
+  string(8) "function"
+  [9]=>
+  bool(true)
+  [10]=>
+  int(1)
+  [11]=>
+  string(1) "y"
+}
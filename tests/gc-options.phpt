@@ -0,0 +1,57 @@
+--TEST--
+GC pause controller options
+--FILE--
+<?php
+
+// Make lots of garbage close to the memory limit
+$code = '
+	local keep = {}
+	for i = 1, 2000 do
+		keep[i] = ("k"):rep( 100 ) .. i
+	end
+	for i = 1, 50000 do
+		local t = { i, tostring( i ) }
+	end
+	return #keep
+';
+
+foreach ( [
+	[],
+	[ 'gcBands' => 1 ],
+	[ 'gcBands' => 1000, 'gcPauseFloor' => 100, 'gcPauseCeiling' => 150, 'gcStepMul' => 200 ],
+] as $options ) {
+	$sandbox = new LuaSandbox( $options );
+	$sandbox->setMemoryLimit( $sandbox->getMemoryUsage() + 500000 );
+	var_dump( $sandbox->loadString( $code )->call() );
+}
+
+// Without a memory limit, the ceiling is used
+$sandbox = new LuaSandbox( [ 'gcPauseCeiling' => 150 ] );
+$sandbox->loadString( $code )->call();
+var_dump( $sandbox->getGCStats()['pause'] );
+$sandbox = new LuaSandbox( [ 'gcPauseFloor' => 300, 'gcPauseCeiling' => 400 ] );
+$sandbox->loadString( 'return {}' )->call();
+var_dump( $sandbox->getGCStats()['pause'] );
+
+new LuaSandbox( [ 'gcBands' => 0 ] );
+new LuaSandbox( [ 'gcPauseFloor' => 300 ] );
+
+--EXPECTF--
+array(1) {
+  [0]=>
+  int(2000)
+}
+array(1) {
+  [0]=>
+  int(2000)
+}
+array(1) {
+  [0]=>
+  int(2000)
+}
+int(150)
+int(400)
+
+Warning: LuaSandbox::__construct(): invalid value for option "gcBands" in %s on line %d
+
+Warning: LuaSandbox::__construct(): gcPauseFloor is greater than gcPauseCeiling, using the ceiling for both in %s on line %d
@@ -0,0 +1,69 @@
+--TEST--
+Garbage collector control and statistics
+--FILE--
+<?php
+
+$sandbox = new LuaSandbox;
+$stats = $sandbox->getGCStats();
+var_dump( array_keys( $stats ) );
+
+$sandbox->loadString( '
+	garbage = {}
+	for i = 1, 1000 do
+		garbage[i] = { tostring( i ) }
+	end
+' )->call();
+$sandbox->loadString( 'garbage = nil' )->call();
+$usage = $sandbox->getMemoryUsage();
+$freed = $sandbox->collectGarbage();
+var_dump( $freed > 0 );
+var_dump( $usage - $sandbox->getMemoryUsage() === $freed );
+
+$newStats = $sandbox->getGCStats();
+var_dump( $newStats['collections'] > $stats['collections'] );
+var_dump( $newStats['bytesReleased'] - $stats['bytesReleased'] >= $freed );
+
+var_dump( $sandbox->setGCParameters( 150, 300 ) );
+var_dump( array_slice( $sandbox->getGCStats(), 2 ) );
+var_dump( $sandbox->setGCParameters( null, 400 ) );
+var_dump( array_slice( $sandbox->getGCStats(), 2 ) );
+
+// A big enough step finishes the cycle
+$sandbox->setGCParameters( 200, 200 );
+var_dump( $sandbox->stepGarbageCollector( 1000000 ) );
+
+var_dump( $sandbox->setGCParameters( -1 ) );
+
+--EXPECTF--
+array(4) {
+  [0]=>
+  string(11) "collections"
+  [1]=>
+  string(13) "bytesReleased"
+  [2]=>
+  string(5) "pause"
+  [3]=>
+  string(7) "stepMul"
+}
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+array(2) {
+  ["pause"]=>
+  int(150)
+  ["stepMul"]=>
+  int(300)
+}
+bool(true)
+array(2) {
+  ["pause"]=>
+  int(150)
+  ["stepMul"]=>
+  int(400)
+}
+bool(true)
+
+Warning: LuaSandbox::setGCParameters(): GC parameter out of range in %s on line %d
+bool(false)
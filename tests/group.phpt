@@ -0,0 +1,75 @@
+--TEST--
+LuaSandboxGroup shared memory limit
+--FILE--
+<?php
+
+$group = new LuaSandboxGroup;
+$a = new LuaSandbox( [ 'group' => $group ] );
+$b = new LuaSandbox( [ 'group' => $group ] );
+var_dump( $group->getMemoryUsage() === $a->getMemoryUsage() + $b->getMemoryUsage() );
+
+$grow = 'big = {} for i = 1, 10000 do big[i] = tostring( i ) end';
+$a->loadString( $grow )->call();
+var_dump( $group->getMemoryUsage() === $a->getMemoryUsage() + $b->getMemoryUsage() );
+var_dump( $group->getPeakMemoryUsage() >= $group->getMemoryUsage() );
+
+// Neither sandbox has a limit of its own, but together they are capped
+$group->setMemoryLimit( $group->getMemoryUsage() + 300000 );
+try {
+	$b->loadString( 'local t = {} for i = 1, 1e6 do t[i] = i .. "" end' )->call();
+} catch ( LuaSandboxMemoryError $e ) {
+	echo get_class( $e ), "\n";
+}
+
+// Freeing memory in one sandbox makes room in the other
+$a->loadString( 'big = nil' )->call();
+$a->collectGarbage();
+var_dump( $b->loadString( $grow . ' return #big' )->call() );
+
+// Compiling a chunk counts against the group limit too
+$group->setMemoryLimit( $group->getMemoryUsage() + 1000 );
+try {
+	$b->loadString( str_repeat( 'local x = "' . str_repeat( 'x', 100 ) . '" ', 1000 ) );
+} catch ( LuaSandboxMemoryError $e ) {
+	echo get_class( $e ), "\n";
+}
+$group->setMemoryLimit( PHP_INT_MAX );
+
+// A clone joins the same group
+$c = LuaSandbox::cloneFrom( $b );
+var_dump( $group->getMemoryUsage() ===
+	$a->getMemoryUsage() + $b->getMemoryUsage() + $c->getMemoryUsage() );
+
+// Destroying a member releases its memory
+$c = null;
+var_dump( $group->getMemoryUsage() === $a->getMemoryUsage() + $b->getMemoryUsage() );
+
+// A group and its members freed together as a garbage cycle
+class CyclicGroup extends LuaSandboxGroup {
+	public $members = [];
+}
+$cyclic = new CyclicGroup;
+for ( $i = 0; $i < 3; $i++ ) {
+	$cyclic->members[] = new LuaSandbox( [ 'group' => $cyclic ] );
+}
+$cyclic->members[0]->loadString( $grow )->call();
+$cyclic = null;
+var_dump( gc_collect_cycles() >= 4 );
+
+new LuaSandbox( [ 'group' => 'x' ] );
+
+--EXPECTF--
+bool(true)
+bool(true)
+bool(true)
+LuaSandboxMemoryError
+array(1) {
+  [0]=>
+  int(10000)
+}
+LuaSandboxMemoryError
+bool(true)
+bool(true)
+bool(true)
+
+Warning: LuaSandbox::__construct(): the group option must be a LuaSandboxGroup in %s on line %d
@@ -0,0 +1,60 @@
+--TEST--
+LuaSandbox::setIdleGCBudget
+--FILE--
+<?php
+
+$sandbox = new LuaSandbox;
+var_dump( $sandbox->setIdleGCBudget( 1000000, 150 ) );
+var_dump( $sandbox->getGCStats()['stepMul'] );
+
+$makeGarbage = $sandbox->loadString( '
+	for i = 1, 1000 do
+		local t = { tostring( i ) }
+	end
+' );
+$before = $sandbox->getGCStats()['collections'];
+// The garbage is collected after the call, and the budget is big enough to
+// finish a cycle
+var_dump( $makeGarbage->call() );
+var_dump( $sandbox->getGCStats()['collections'] > $before );
+// The step multiplier is restored after the idle steps
+var_dump( $sandbox->getGCStats()['stepMul'] );
+
+$sandbox->setGCParameters( null, 300 );
+var_dump( $sandbox->getGCStats()['stepMul'] );
+
+var_dump( $sandbox->setIdleGCBudget( 0 ) );
+var_dump( $sandbox->getGCStats()['stepMul'] );
+
+var_dump( $sandbox->setIdleGCBudget( -1 ) );
+
+// Explicit idle GC, with no budget set. Live data makes sure the memory
+// usage has grown since the last idle cycle.
+$sandbox->loadString( '
+	keep = {}
+	for i = 1, 1000 do
+		keep[i] = { tostring( i ) }
+	end
+' )->call();
+$before = $sandbox->getGCStats()['collections'];
+var_dump( $sandbox->runIdleGC( 1000000 ) );
+var_dump( $sandbox->getGCStats()['collections'] > $before );
+// Nothing more to do until memory usage grows
+var_dump( $sandbox->runIdleGC( 1000000 ) );
+
+--EXPECTF--
+bool(true)
+int(150)
+array(0) {
+}
+bool(true)
+int(150)
+int(150)
+bool(true)
+int(300)
+
+Warning: LuaSandbox::setIdleGCBudget(): GC parameter out of range in %s on line %d
+bool(false)
+bool(true)
+bool(true)
+bool(false)
@@ -0,0 +1,87 @@
+--TEST--
+setInstructionLimit() and getInstructionCount()
+--FILE--
+<?php
+function run( $limit ) {
+	$sandbox = new LuaSandbox;
+	$sandbox->setInstructionLimit( $limit );
+	try {
+		$sandbox->loadString( 'n = 0 while true do n = n + 1 end' )->call();
+	} catch ( LuaSandboxTimeoutError $e ) {
+		echo get_class( $e ) . ': ' . $e->getMessage() . "\n";
+	}
+	$count = $sandbox->getInstructionCount();
+	$sandbox->setInstructionLimit( false );
+	list( $n ) = $sandbox->loadString( 'return n' )->call();
+	return [ $count, $n ];
+}
+
+$sandbox = new LuaSandbox;
+var_dump( $sandbox->getInstructionCount() );
+$sandbox->setInstructionLimit( 100000 );
+$sum = $sandbox->loadString( 'local n = 0 for i = 1, 1000 do n = n + i end return n' );
+var_dump( $sum->call() );
+var_dump( $sandbox->getInstructionCount() <= 10000 );
+
+echo "Infinite loop: ";
+try {
+	$sandbox->loadString( 'while true do end' )->call();
+} catch ( LuaSandboxTimeoutError $e ) {
+	echo get_class( $e ) . ': ' . $e->getMessage() . "\n";
+}
+var_dump( $sandbox->getInstructionCount() );
+
+echo "Call after the limit: ";
+try {
+	$sum->call();
+} catch ( LuaSandboxTimeoutError $e ) {
+	echo get_class( $e ) . ': ' . $e->getMessage() . "\n";
+}
+
+echo "New limit: ";
+$sandbox->setInstructionLimit( 50000 );
+var_dump( $sum->call() );
+
+echo "Reproducible: ";
+var_dump( run( 25000 ) === run( 25000 ) );
+
+echo "Timeout during a callback which sets a limit: ";
+$sandbox = new LuaSandbox;
+$sandbox->setCPULimit( 0.1 );
+$sandbox->registerLibrary( 'php', [
+	'spin' => static function () use ( $sandbox ) {
+		$t = microtime( true );
+		while ( microtime( true ) - $t < 0.5 );
+		$sandbox->setInstructionLimit( 1e9 );
+	}
+] );
+try {
+	$sandbox->loadString( 'php.spin() local n = 0 for i = 1, 1e7 do n = n + 1 end return n' )->call();
+	echo "no timeout\n";
+} catch ( LuaSandboxTimeoutError $e ) {
+	echo get_class( $e ) . ': ' . $e->getMessage() . "\n";
+}
+
+echo "Invalid: ";
+var_dump( $sandbox->setInstructionLimit( -1 ) );
+--EXPECTF--
+int(0)
+array(1) {
+  [0]=>
+  int(500500)
+}
+bool(true)
+Infinite loop: LuaSandboxTimeoutError: The maximum execution time for this script was exceeded
+int(100000)
+Call after the limit: LuaSandboxTimeoutError: The maximum execution time for this script was exceeded
+New limit: array(1) {
+  [0]=>
+  int(500500)
+}
+Reproducible: LuaSandboxTimeoutError: The maximum execution time for this script was exceeded
+LuaSandboxTimeoutError: The maximum execution time for this script was exceeded
+bool(true)
+Timeout during a callback which sets a limit: LuaSandboxTimeoutError: The maximum execution time for this script was exceeded
+Invalid: 
+Warning: LuaSandbox::setInstructionLimit(): the instruction limit must be positive in %s on line %d
+bool(false)
@@ -0,0 +1,68 @@
+--TEST--
+lazyLibraries option
+--FILE--
+<?php
+
+$eager = new LuaSandbox;
+$lazy = new LuaSandbox( [ 'lazyLibraries' => true ] );
+var_dump( $lazy->getMemoryUsage() < $eager->getMemoryUsage() );
+
+$code = '
+	local n = 0
+	for k in pairs( os ) do
+		n = n + 1
+	end
+	local t = {}
+	table.foreach( debug, function ( k ) t[#t + 1] = k end )
+	local keys = {}
+	for k in pairs( math ) do
+		keys[#keys + 1] = k
+	end
+	return n, t[1], type( rawget( math, "floor" ) ), getmetatable( math ), ( next( debug ) ),
+		table.concat( keys, "," )
+';
+var_dump( $lazy->loadString( $code )->call() === $eager->loadString( $code )->call() );
+
+$lazy->reset();
+var_dump( $lazy->callFunction( 'math.floor', 1.5 ) );
+var_dump( count( $lazy->loadString( 'return os' )->call()[0] ) );
+var_dump( $lazy->loadString( 'debug.x = 1; return debug.x, rawget( debug, "traceback" ) ~= nil' )->call() );
+var_dump( $lazy->loadString( '
+	local mt = {}
+	setmetatable( math, mt )
+	return getmetatable( math ) == mt, math.abs( -1 )
+' )->call() );
+
+$lazy->registerLibrary( 'os', [ 'extra' => 'time' ] );
+var_dump( $lazy->loadString( 'return type( os.time ), type( os.extra )' )->call() );
+
+new LuaSandbox( [ 'nonexistent' => true ] );
+
+--EXPECTF--
+bool(true)
+bool(true)
+array(1) {
+  [0]=>
+  int(1)
+}
+int(4)
+array(2) {
+  [0]=>
+  int(1)
+  [1]=>
+  bool(true)
+}
+array(2) {
+  [0]=>
+  bool(true)
+  [1]=>
+  int(1)
+}
+array(2) {
+  [0]=>
+  string(8) "function"
+  [1]=>
+  string(8) "function"
+}
+
+Warning: LuaSandbox::__construct(): unknown option "nonexistent" in %s on line %d
@@ -0,0 +1,89 @@
+--TEST--
+LuaSandbox::getMemoryBreakdown
+--FILE--
+<?php
+
+$sandbox = new LuaSandbox;
+$before = $sandbox->getMemoryBreakdown();
+var_dump( array_keys( $before ) );
+
+$sandbox->loadString( '
+	strings = {}
+	for i = 1, 1000 do
+		strings[i] = ("x"):rep( 100 ) .. i
+	end
+	funcs = {}
+	for i = 1, 100 do
+		funcs[i] = function () return i end
+	end
+' )->call();
+$sandbox->registerLibrary( 'php', [ 'f' => 'strlen' ] );
+$sandbox->collectGarbage();
+$after = $sandbox->getMemoryBreakdown();
+
+// 1000 strings of more than 100 bytes
+var_dump( $after['string']['count'] - $before['string']['count'] >= 1000 );
+var_dump( $after['string']['bytes'] - $before['string']['bytes'] > 100000 );
+// The strings table has an array part of 1024 slots
+var_dump( $after['table']['arrayBytes'] - $before['table']['arrayBytes'] >= 1024 * 8 );
+// 100 closures sharing one prototype
+var_dump( $after['function']['count'] - $before['function']['count'] );
+var_dump( $after['proto']['count'] - $before['proto']['count'] );
+var_dump( $after['cfunction']['count'] > $before['cfunction']['count'] );
+
+$total = $after['other'];
+foreach ( $after as $type => $entry ) {
+	if ( is_array( $entry ) ) {
+		$total += $entry['bytes'];
+	}
+}
+var_dump( $total >= $sandbox->getMemoryUsage() );
+var_dump( $after['thread']['count'] );
+
+// A table only referenced from a local of a running function is counted
+$sandbox->registerLibrary( 'test', [
+	'breakdown' => function () use ( $sandbox ) {
+		return [ $sandbox->getMemoryBreakdown()['table']['count'] ];
+	}
+] );
+$ret = $sandbox->loadString( '
+	local before = test.breakdown()
+	local t = {}
+	return before, test.breakdown(), t
+' )->call();
+var_dump( $ret[1] - $ret[0] );
+
+// The walk doesn't collect garbage
+$stats = $sandbox->getGCStats();
+$sandbox->getMemoryBreakdown();
+var_dump( $sandbox->getGCStats()['collections'] === $stats['collections'] );
+
+--EXPECT--
+array(8) {
+  [0]=>
+  string(6) "string"
+  [1]=>
+  string(5) "table"
+  [2]=>
+  string(8) "function"
+  [3]=>
+  string(5) "proto"
+  [4]=>
+  string(9) "cfunction"
+  [5]=>
+  string(8) "userdata"
+  [6]=>
+  string(6) "thread"
+  [7]=>
+  string(5) "other"
+}
+bool(true)
+bool(true)
+bool(true)
+int(100)
+int(1)
+bool(true)
+bool(true)
+int(1)
+int(1)
+bool(true)
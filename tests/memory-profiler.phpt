@@ -0,0 +1,83 @@
+--TEST--
+Memory profiler
+--FILE--
+<?php
+
+$sandbox = new LuaSandbox;
+$sandbox->loadString( '
+	function big()
+		local t = {}
+		for i = 1, 100 do
+			t[i] = string.rep( "x", 10000 + i )
+		end
+		return t
+	end
+	function small()
+		local t = {}
+		for i = 1, 100 do
+			t[i] = {}
+		end
+		return t
+	end
+', 'test' )->call();
+
+var_dump( $sandbox->getMemoryProfilerReport() );
+var_dump( $sandbox->enableMemoryProfiler( 4096 ) );
+$sandbox->callFunction( 'big' );
+$sandbox->callFunction( 'small' );
+$report = $sandbox->getMemoryProfilerReport();
+$total = array_sum( $report );
+var_dump( $total > 1000000 );
+var_dump( $total % 4096 );
+
+// Most of the bytes are allocated by string.rep()
+var_dump( array_keys( $report )[0] );
+
+// Stacks are reported outermost first, with the same total
+$stacks = $sandbox->getMemoryProfilerReport( true );
+var_dump( array_sum( $stacks ) === $total );
+var_dump( preg_match( '/^[^;]+;rep$/', array_keys( $stacks )[0] ) );
+
+// The report is kept after a memory error
+$sandbox->enableMemoryProfiler( 1024 );
+$sandbox->setMemoryLimit( $sandbox->getMemoryUsage() + 100000 );
+try {
+	$sandbox->callFunction( 'big' );
+} catch ( LuaSandboxMemoryError $e ) {
+	echo get_class( $e ), "\n";
+}
+var_dump( count( $sandbox->getMemoryProfilerReport() ) > 0 );
+
+// The allocation which is denied is sampled, even if no interval has passed
+$sandbox->setMemoryLimit( 100000000 );
+$sandbox->enableMemoryProfiler( 1 << 30 );
+$sandbox->setMemoryLimit( $sandbox->getMemoryUsage() + 100000 );
+try {
+	$sandbox->callFunction( 'big' );
+} catch ( LuaSandboxMemoryError $e ) {
+	echo get_class( $e ), "\n";
+}
+var_dump( array_sum( $sandbox->getMemoryProfilerReport() ) );
+
+$sandbox->disableMemoryProfiler();
+var_dump( $sandbox->getMemoryProfilerReport() );
+var_dump( $sandbox->enableMemoryProfiler( 0 ) );
+
+--EXPECTF--
+array(0) {
+}
+bool(true)
+bool(true)
+int(0)
+string(3) "rep"
+bool(true)
+int(1)
+LuaSandboxMemoryError
+bool(true)
+LuaSandboxMemoryError
+int(1073741824)
+array(0) {
+}
+
+Warning: LuaSandbox::enableMemoryProfiler(): the interval must be at least 1 byte in %s on line %d
+bool(false)
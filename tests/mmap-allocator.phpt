@@ -0,0 +1,91 @@
+--TEST--
+mmap allocator
+--SKIPIF--
+<?php
+if ( PHP_OS_FAMILY === 'Windows' ) {
+	die( 'skip the mmap allocator is not available on Windows' );
+}
+--FILE--
+<?php
+
+$code = '
+	local t = {}
+	for i = 1, 2000 do
+		t[i] = { tostring( i ), ("x"):rep( i % 3000 ) }
+		if i % 3 == 0 then
+			t[i - 1] = nil
+		end
+	end
+	local s = ""
+	for i = 1, 200 do
+		s = s .. i
+	end
+	return #s
+';
+
+$default = new LuaSandbox;
+$mmap = new LuaSandbox( [ 'allocator' => 'mmap', 'hugePages' => true ] );
+var_dump( $mmap->getMemoryUsage() === $default->getMemoryUsage() );
+var_dump( $mmap->loadString( $code )->call() === $default->loadString( $code )->call() );
+var_dump( $mmap->getMemoryUsage() === $default->getMemoryUsage() );
+var_dump( $mmap->getPeakMemoryUsage() === $default->getPeakMemoryUsage() );
+
+$mmap->setMemoryLimit( $mmap->getMemoryUsage() + 50000 );
+try {
+	$mmap->loadString( 'local t = {} for i = 1, 1e6 do t[i] = i .. "" end' )->call();
+} catch ( LuaSandboxMemoryError $e ) {
+	echo get_class( $e ), "\n";
+}
+
+$mmap->reset();
+var_dump( LuaSandbox::cloneFrom( $mmap )->loadString( $code )->call() );
+
+// A region too small for the code, so that blocks spill over to malloc()
+$small = new LuaSandbox( [ 'allocator' => 'mmap', 'mmapSize' => 65536 ] );
+var_dump( $small->loadString( $code )->call() );
+
+new LuaSandbox( [ 'mmapSize' => 1 ] );
+
+// A persistent sandbox with a small region, which outlives its objects
+$init = function ( $sandbox ) use ( $code ) {
+	$sandbox->loadString( "function run() $code end" )->call();
+};
+$options = [ 'allocator' => 'mmap', 'mmapSize' => 65536 ];
+$persistent = LuaSandbox::getPersistent( 'mmap', $init, $options );
+var_dump( $persistent->callFunction( 'run' ) );
+unset( $persistent );
+$persistent = LuaSandbox::getPersistent( 'mmap', $init, $options );
+var_dump( $persistent->callFunction( 'run' ) );
+
+LuaSandbox::getPersistent( 'slab', null, [ 'allocator' => 'slab' ] );
+var_dump( LuaSandbox::getPersistent( 'group', null, [ 'memoryLimit' => 1 ] ) );
+
+--EXPECTF--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+LuaSandboxMemoryError
+array(1) {
+  [0]=>
+  int(492)
+}
+array(1) {
+  [0]=>
+  int(492)
+}
+
+Warning: LuaSandbox::__construct(): invalid value for option "mmapSize" in %s on line %d
+array(1) {
+  [0]=>
+  int(492)
+}
+array(1) {
+  [0]=>
+  int(492)
+}
+
+Warning: LuaSandbox::getPersistent(): the slab allocator can't be used by a persistent sandbox in %s on line %d
+
+Warning: LuaSandbox::getPersistent(): option "memoryLimit" is not supported by getPersistent() in %s on line %d
+bool(false)
@@ -0,0 +1,81 @@
+--TEST--
+LuaSandbox::getPersistent()
+--FILE--
+<?php
+
+function init( $sandbox ) {
+	echo "init\n";
+	$sandbox->loadString( '
+		mod = { count = 0 }
+		local cache = {}
+		local calls = 0
+		function mod.remember( v )
+			cache[1] = v
+		end
+		function mod.recall()
+			return cache[1]
+		end
+		function mod.inc()
+			mod.count = mod.count + 1
+			calls = calls + 1
+			return mod.count, calls
+		end
+	' )->call();
+}
+
+function double( $x ) {
+	return [ $x * 2 ];
+}
+
+$sandbox = LuaSandbox::getPersistent( 'test', 'init' );
+var_dump( $sandbox === LuaSandbox::getPersistent( 'test', 'init' ) );
+$sandbox->registerLibrary( 'php', [ 'double' => 'double' ] );
+var_dump( $sandbox->callFunction( 'mod.inc' ) );
+var_dump( $sandbox->loadString( 'x = 1; mod.extra = true; return php.double(21)' )->call() );
+// State which is only reachable through upvalues and function environments
+$sandbox->loadString( '
+	mod.remember( php.double )
+	mod.inc()
+	setfenv( mod.recall, { cache = "changed" } )
+' )->call();
+unset( $sandbox );
+
+// Reset to the state left by the initializer
+$sandbox = LuaSandbox::getPersistent( 'test', 'init' );
+var_dump( $sandbox->callFunction( 'mod.inc' ) );
+var_dump( $sandbox->loadString( 'return x, mod.extra, php, mod.recall()' )->call() );
+var_dump( $sandbox->loadString( 'return getfenv( mod.recall ) == _G' )->call() );
+
+--EXPECT--
+init
+bool(true)
+array(2) {
+  [0]=>
+  int(1)
+  [1]=>
+  int(1)
+}
+array(1) {
+  [0]=>
+  int(42)
+}
+array(2) {
+  [0]=>
+  int(1)
+  [1]=>
+  int(1)
+}
+array(4) {
+  [0]=>
+  NULL
+  [1]=>
+  NULL
+  [2]=>
+  NULL
+  [3]=>
+  NULL
+}
+array(1) {
+  [0]=>
+  bool(true)
+}
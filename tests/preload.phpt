@@ -0,0 +1,32 @@
+--TEST--
+luasandbox.preload and LuaSandbox::loadPreloaded()
+--INI--
+luasandbox.preload={PWD}/preload-module.lua
+--FILE--
+<?php
+
+$sandbox = new LuaSandbox;
+$f = $sandbox->loadPreloaded( 'preload-module' );
+var_dump( $f instanceof LuaSandboxFunction );
+$mod = $f->call()[0];
+var_dump( $mod['greet']->call( 'world' ) );
+
+// Another sandbox can load it too
+$sandbox2 = new LuaSandbox;
+var_dump( array_keys( $sandbox2->loadPreloaded( 'preload-module' )->call()[0] ) );
+
+var_dump( $sandbox->loadPreloaded( 'nonexistent' ) );
+
+--EXPECTF--
+bool(true)
+array(1) {
+  [0]=>
+  string(12) "Hello, world"
+}
+array(1) {
+  [0]=>
+  string(5) "greet"
+}
+
+Warning: LuaSandbox::loadPreloaded(): no preloaded module named "nonexistent" in %s on line %d
+bool(false)
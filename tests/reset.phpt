@@ -0,0 +1,70 @@
+--TEST--
+LuaSandbox::reset()
+--FILE--
+<?php
+
+$sandbox = new LuaSandbox;
+$sandbox->setMemoryLimit( 1000000 );
+$f = $sandbox->loadString( '
+	x = {}
+	for i = 1, 1000 do
+		x[i] = string.rep( "x", i )
+	end
+	string.upper = nil
+	math = nil
+	return 1
+' );
+$f->call();
+$usage = $sandbox->getMemoryUsage();
+
+var_dump( $sandbox->reset() );
+var_dump( $sandbox->getMemoryUsage() < $usage );
+var_dump( $sandbox->getPeakMemoryUsage() === $sandbox->getMemoryUsage() );
+var_dump( $sandbox->loadString( '
+	return x, ("a"):upper(), string.upper("b"), math.floor(1.5), type(pcall), os.execute
+' )->call() );
+
+try {
+	$f->call();
+} catch ( LuaSandboxError $e ) {
+	echo get_class( $e ), "\n";
+}
+
+// The memory limit is kept
+try {
+	$sandbox->loadString( 'string.rep( "x", 2000000 )' )->call();
+} catch ( LuaSandboxError $e ) {
+	echo $e->getMessage(), "\n";
+}
+
+function reenter() {
+	global $sandbox;
+	var_dump( $sandbox->reset() );
+	return [];
+}
+$sandbox->registerLibrary( 'php', [ 'reenter' => 'reenter' ] );
+$sandbox->loadString( 'php.reenter()' )->call();
+
+--EXPECTF--
+bool(true)
+bool(true)
+bool(true)
+array(6) {
+  [0]=>
+  NULL
+  [1]=>
+  string(1) "A"
+  [2]=>
+  string(1) "B"
+  [3]=>
+  int(1)
+  [4]=>
+  string(8) "function"
+  [5]=>
+  NULL
+}
+LuaSandboxRuntimeError
+not enough memory
+
+Warning: %s: cannot reset a LuaSandbox while Lua code is running in %s on line %d
+bool(false)
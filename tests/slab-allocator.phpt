@@ -0,0 +1,51 @@
+--TEST--
+Slab allocator
+--FILE--
+<?php
+
+$code = '
+	local t = {}
+	for i = 1, 2000 do
+		t[i] = { tostring( i ), ("x"):rep( i % 300 ) }
+		if i % 3 == 0 then
+			t[i - 1] = nil
+		end
+	end
+	local s = ""
+	for i = 1, 200 do
+		s = s .. i
+	end
+	return #s
+';
+
+$default = new LuaSandbox;
+$slab = new LuaSandbox( [ 'allocator' => 'slab' ] );
+var_dump( $slab->getMemoryUsage() === $default->getMemoryUsage() );
+var_dump( $slab->loadString( $code )->call() === $default->loadString( $code )->call() );
+var_dump( $slab->getMemoryUsage() === $default->getMemoryUsage() );
+var_dump( $slab->getPeakMemoryUsage() === $default->getPeakMemoryUsage() );
+
+$slab->setMemoryLimit( $slab->getMemoryUsage() + 50000 );
+try {
+	$slab->loadString( 'local t = {} for i = 1, 1e6 do t[i] = i .. "" end' )->call();
+} catch ( LuaSandboxMemoryError $e ) {
+	echo get_class( $e ), "\n";
+}
+
+$slab->reset();
+var_dump( LuaSandbox::cloneFrom( $slab )->loadString( $code )->call() );
+
+new LuaSandbox( [ 'allocator' => 'nonexistent' ] );
+
+--EXPECTF--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+LuaSandboxMemoryError
+array(1) {
+  [0]=>
+  int(492)
+}
+
+Warning: LuaSandbox::__construct(): unknown allocator "nonexistent" in %s on line %d
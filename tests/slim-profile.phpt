@@ -0,0 +1,52 @@
+--TEST--
+Slim profile
+--FILE--
+<?php
+
+$full = new LuaSandbox;
+$slim = new LuaSandbox( [ 'profile' => 'slim' ] );
+var_dump( $slim->getMemoryUsage() < $full->getMemoryUsage() );
+
+$code = 'return type( string ), type( table ), type( math ), type( os ), type( debug ), type( pcall )';
+var_dump( $slim->loadString( $code )->call() );
+var_dump( $slim->loadString( 'return ("x"):rep( 3 ), math.floor( 1.5 )' )->call() );
+
+$slim->reset();
+var_dump( $slim->loadString( 'return os' )->call() );
+
+var_dump( LuaSandbox::cloneFrom( $slim )->loadString( 'return debug' )->call() );
+
+new LuaSandbox( [ 'profile' => 'tiny' ] );
+
+--EXPECTF--
+bool(true)
+array(6) {
+  [0]=>
+  string(5) "table"
+  [1]=>
+  string(5) "table"
+  [2]=>
+  string(5) "table"
+  [3]=>
+  string(3) "nil"
+  [4]=>
+  string(3) "nil"
+  [5]=>
+  string(8) "function"
+}
+array(2) {
+  [0]=>
+  string(3) "xxx"
+  [1]=>
+  int(1)
+}
+array(1) {
+  [0]=>
+  NULL
+}
+array(1) {
+  [0]=>
+  NULL
+}
+
+Warning: LuaSandbox::__construct(): unknown profile "tiny" in %s on line %d
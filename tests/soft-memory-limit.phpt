@@ -0,0 +1,89 @@
+--TEST--
+LuaSandbox::setSoftMemoryLimit()
+--FILE--
+<?php
+
+function makeSandbox() {
+	$sandbox = new LuaSandbox;
+	// Make the collector lazy, so that garbage builds up
+	$sandbox->setGCParameters( 1000 );
+	$base = $sandbox->getMemoryUsage();
+	$sandbox->setMemoryLimit( $base + 1000000 );
+	$sandbox->setSoftMemoryLimit( $base + 500000, static function ( $sandbox, $usage ) use ( $base ) {
+		echo "soft limit exceeded\n";
+		var_dump( $usage > $base + 500000 );
+		$sandbox->setMemoryLimit( $base + 4000000 );
+	} );
+	return $sandbox;
+}
+
+// Garbage is collected, the callback is not called
+$sandbox = makeSandbox();
+$collections = $sandbox->getGCStats()['collections'];
+var_dump( $sandbox->loadString( '
+	for i = 1, 5000 do
+		local s = ("x"):rep( 1000 ) .. i
+	end
+	return true
+' )->call() );
+var_dump( $sandbox->getGCStats()['collections'] > $collections );
+
+// Live data: the callback is called once, and raises the hard limit
+$sandbox = makeSandbox();
+var_dump( $sandbox->loadString( '
+	local t = {}
+	for i = 1, 1500 do
+		t[i] = ("x"):rep( 1000 ) .. i
+	end
+	return #t
+' )->call() );
+
+// An exception from the callback is raised in Lua
+$sandbox = new LuaSandbox;
+$sandbox->setSoftMemoryLimit( $sandbox->getMemoryUsage() + 100000, static function () {
+	throw new LuaSandboxRuntimeError( 'too much memory' );
+} );
+var_dump( $sandbox->loadString( '
+	local t = {}
+	return pcall( function ()
+		for i = 1, 1000 do
+			t[i] = ("x"):rep( 1000 ) .. i
+		end
+	end )
+' )->call() );
+
+// A callback which refers to the sandbox is seen by the cycle collector
+class DestructedSandbox extends LuaSandbox {
+	public function __destruct() {
+		echo "destroyed\n";
+	}
+}
+$cyclic = new DestructedSandbox;
+$cyclic->setSoftMemoryLimit( 1000000, static function () use ( $cyclic ) {
+} );
+unset( $cyclic );
+echo "collecting\n";
+gc_collect_cycles();
+echo "collected\n";
+
+--EXPECT--
+array(1) {
+  [0]=>
+  bool(true)
+}
+bool(true)
+soft limit exceeded
+bool(true)
+array(1) {
+  [0]=>
+  int(1500)
+}
+array(2) {
+  [0]=>
+  bool(false)
+  [1]=>
+  string(15) "too much memory"
+}
+collecting
+destroyed
+collected
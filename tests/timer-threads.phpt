@@ -0,0 +1,81 @@
+--TEST--
+CPU limits in many threads at once
+--SKIPIF--
+<?php
+if ( !PHP_ZTS || !class_exists( 'parallel\Runtime' ) ) {
+	die( 'skip requires ZTS and the parallel extension' );
+}
+?>
+--FILE--
+<?php
+$worker = static function ( $n ) {
+	$timeouts = 0;
+	for ( $i = 0; $i < $n; $i++ ) {
+		// Every tenth sandbox runs out of time, the rest finish quickly
+		$expensive = $i % 10 === 0;
+		$sandbox = new LuaSandbox;
+		$sandbox->setCPULimit( $expensive ? 0.01 : 10 );
+		try {
+			$sandbox->loadString( $expensive ? 'while true do end' : 'return 1' )->call();
+		} catch ( LuaSandboxTimeoutError $e ) {
+			$timeouts++;
+		}
+	}
+
+	// A limiter which is armed and disarmed many times must not fire late
+	// for an earlier call
+	$sandbox = new LuaSandbox;
+	$sandbox->setCPULimit( 10 );
+	$func = $sandbox->loadString( 'return 1' );
+	$staleTimeouts = 0;
+	for ( $i = 0; $i < $n * 5; $i++ ) {
+		try {
+			$func->call();
+		} catch ( LuaSandboxTimeoutError $e ) {
+			$staleTimeouts++;
+		}
+	}
+
+	// The limit is shared by all calls, so it runs out part way through one
+	// of them, and not before the whole limit was used
+	$sandbox = new LuaSandbox;
+	$sandbox->setCPULimit( 0.05 );
+	$func = $sandbox->loadString( 'for i = 1, 1e5 do end' );
+	$calls = 0;
+	try {
+		while ( true ) {
+			$func->call();
+			$calls++;
+		}
+	} catch ( LuaSandboxTimeoutError $e ) {
+	}
+	$sharedLimit = $calls > 0 && $sandbox->getCPUUsage() >= 0.04;
+
+	return [ $timeouts, $staleTimeouts, $sharedLimit ];
+};
+
+$runtimes = [];
+$futures = [];
+for ( $i = 0; $i < 8; $i++ ) {
+	$runtimes[$i] = new parallel\Runtime;
+	$futures[$i] = $runtimes[$i]->run( $worker, [ 200 ] );
+}
+$timeouts = 0;
+$staleTimeouts = 0;
+$sharedLimit = true;
+foreach ( $futures as $future ) {
+	[ $t, $s, $l ] = $future->value();
+	$timeouts += $t;
+	$staleTimeouts += $s;
+	$sharedLimit = $sharedLimit && $l;
+}
+foreach ( $runtimes as $runtime ) {
+	$runtime->close();
+}
+var_dump( $timeouts );
+var_dump( $staleTimeouts );
+var_dump( $sharedLimit );
+--EXPECT--
+int(160)
+int(0)
+bool(true)
@@ -0,0 +1,42 @@
+--TEST--
+setWallClockLimit() and getWallClockUsage()
+--FILE--
+<?php
+$sandbox = new LuaSandbox;
+var_dump( $sandbox->getWallClockUsage() );
+$sandbox->registerLibrary( 'php', [
+	'sleep' => static function () {
+		usleep( 300000 );
+	},
+] );
+
+echo "Under the limit: ";
+$sandbox->setWallClockLimit( 10 );
+var_dump( $sandbox->loadString( 'return 1' )->call() );
+
+echo "Slow callback: ";
+$sandbox->setWallClockLimit( 0.1 );
+try {
+	$sandbox->loadString( 'php.sleep() while true do end' )->call();
+} catch ( LuaSandboxTimeoutError $e ) {
+	echo get_class( $e ) . ': ' . $e->getMessage() . "\n";
+}
+var_dump( $sandbox->getWallClockUsage() >= 0.3 );
+var_dump( $sandbox->getCPUUsage() < $sandbox->getWallClockUsage() );
+
+echo "Call after the limit: ";
+try {
+	$sandbox->loadString( 'return 1' )->call();
+} catch ( LuaSandboxTimeoutError $e ) {
+	echo get_class( $e ) . ': ' . $e->getMessage() . "\n";
+}
+--EXPECT--
+float(0)
+Under the limit: array(1) {
+  [0]=>
+  int(1)
+}
+Slow callback: LuaSandboxTimeoutError: The maximum execution time for this script was exceeded
+bool(true)
+bool(true)
+Call after the limit: LuaSandboxTimeoutError: The maximum execution time for this script was exceeded
@@ -12,12 +12,128 @@
 #include "luasandbox_timer.h"
 
 #ifndef LUASANDBOX_NO_CLOCK
+#include <stdint.h>
 #include <semaphore.h>
 #include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
 #endif
 
 char luasandbox_timeout_message[] = "The maximum execution time for this script was exceeded";
 
+// The number of instructions between calls to the instruction limit hook
+#define LUASANDBOX_INSTRUCTION_INTERVAL 10000
+
+static void luasandbox_timer_instruction_hook(lua_State *L, lua_Debug *ar);
+static void luasandbox_timer_timeout_hook(lua_State *L, lua_Debug *ar);
+#ifndef LUASANDBOX_NO_CLOCK
+static void luasandbox_timer_profiler_hook(lua_State *L, lua_Debug *ar);
+#endif
+
+void luasandbox_timer_timeout_error(lua_State *L)
+{
+	lua_pushstring(L, luasandbox_timeout_message);
+	luasandbox_wrap_fatal(L);
+	lua_error(L);
+}
+
+static void luasandbox_timer_timeout_hook(lua_State *L, lua_Debug *ar)
+{
+	// Avoid infinite recursion
+	lua_sethook(L, luasandbox_timer_timeout_hook, 0, 0);
+	// Do a longjmp to report the timeout error
+	luasandbox_timer_timeout_error(L);
+}
+
+/**
+ * Set the instruction limit, counted from the current instruction count, or
+ * remove it if limit is zero.
+ */
+void luasandbox_timer_set_instruction_limit(php_luasandbox_obj * sandbox,
+		zend_long limit)
+{
+	sandbox->instruction_limit = limit;
+	sandbox->instruction_deadline = limit ? sandbox->instruction_count + limit : 0;
+	if (sandbox->state) {
+		luasandbox_timer_restore_hook(sandbox->state, sandbox);
+	}
+}
+
+int luasandbox_timer_instructions_expired(php_luasandbox_obj * sandbox)
+{
+	return sandbox->instruction_limit
+		&& sandbox->instruction_count >= sandbox->instruction_deadline;
+}
+
+/**
+ * Set the hook which should be in place when no other hook is pending: the
+ * timeout hook if a timeout occurred during the current call, the
+ * instruction limit hook if there is a limit, otherwise none. Hooks set by
+ * the timers and the allocator replace this one, so they call this when they
+ * are done. Any instructions counted towards the next call of the replaced
+ * hook are lost.
+ */
+void luasandbox_timer_restore_hook(lua_State * L, php_luasandbox_obj * sandbox)
+{
+	zend_long remaining = sandbox->instruction_deadline - sandbox->instruction_count;
+
+	if (sandbox->timed_out && sandbox->in_lua) {
+		// The timeout error has not been raised yet, don't lose it
+		lua_sethook(L, luasandbox_timer_timeout_hook,
+			LUA_MASKCOUNT | LUA_MASKCALL | LUA_MASKRET | LUA_MASKLINE, 1);
+		return;
+	}
+	if (sandbox->soft_limit_pending && sandbox->in_lua) {
+		// Deferred by luasandbox_soft_limit_exceeded() until this hook ran
+		lua_sethook(L, luasandbox_soft_limit_hook, LUA_MASKCOUNT, 1);
+		return;
+	}
+	if (!sandbox->instruction_limit || remaining <= 0) {
+		sandbox->instruction_interval = 0;
+		lua_sethook(L, NULL, 0, 0);
+		return;
+	}
+
+	// Make the hook run exactly when the limit is reached
+	sandbox->instruction_interval = remaining < LUASANDBOX_INSTRUCTION_INTERVAL
+		? (int)remaining : LUASANDBOX_INSTRUCTION_INTERVAL;
+	lua_sethook(L, luasandbox_timer_instruction_hook, LUA_MASKCOUNT,
+		sandbox->instruction_interval);
+}
+
+/**
+ * Whether the current hook was set by a timer and has not run yet, in which
+ * case other hooks should not replace it
+ */
+int luasandbox_timer_hook_is_pending(lua_State * L)
+{
+	lua_Hook hook = lua_gethook(L);
+
+	return hook == luasandbox_timer_timeout_hook
+#ifndef LUASANDBOX_NO_CLOCK
+		|| hook == luasandbox_timer_profiler_hook
+#endif
+		;
+}
+
+static void luasandbox_timer_instruction_hook(lua_State *L, lua_Debug *ar)
+{
+	php_luasandbox_obj * sandbox = luasandbox_get_php_obj(L);
+
+	sandbox->instruction_count += sandbox->instruction_interval;
+	if (luasandbox_timer_instructions_expired(sandbox)) {
+		lua_sethook(L, NULL, 0, 0);
+		sandbox->timed_out = 1;
+		luasandbox_timer_timeout_error(L);
+	}
+	if (sandbox->instruction_deadline - sandbox->instruction_count
+		< sandbox->instruction_interval)
+	{
+		// Shorten the interval for the last stretch
+		luasandbox_timer_restore_hook(L, sandbox);
+	}
+}
+
 #ifdef LUASANDBOX_NO_CLOCK
 
 void luasandbox_timer_minit() {}
@@ -29,6 +145,8 @@ void luasandbox_timer_create(luasandbox_timer_set * lts,
 }
 void luasandbox_timer_set_limit(luasandbox_timer_set * lts,
 		struct timespec * timeout) {}
+void luasandbox_timer_set_wall_limit(luasandbox_timer_set * lts,
+		struct timespec * timeout) {}
 int luasandbox_timer_enable_profiler(luasandbox_timer_set * lts, struct timespec * period) {
 	return 0;
 }
@@ -37,10 +155,16 @@ int luasandbox_timer_start(luasandbox_timer_set * lts) {
 }
 void luasandbox_timer_stop(luasandbox_timer_set * lts) {}
 void luasandbox_timer_destroy(luasandbox_timer_set * lts) {}
+void luasandbox_timer_reset(luasandbox_timer_set * lts) {
+	lts->is_paused = 0;
+}
 
 void luasandbox_timer_get_usage(luasandbox_timer_set * lts, struct timespec * ts) {
 	ts->tv_sec = ts->tv_nsec = 0;
 }
+void luasandbox_timer_get_wall_usage(luasandbox_timer_set * lts, struct timespec * ts) {
+	ts->tv_sec = ts->tv_nsec = 0;
+}
 
 void luasandbox_timer_pause(luasandbox_timer_set * lts) {
 	lts->is_paused = 1;
@@ -52,7 +176,6 @@ int luasandbox_timer_is_paused(luasandbox_timer_set * lts) {
 	return lts->is_paused;
 }
 
-void luasandbox_timer_timeout_error(lua_State *L) {}
 int luasandbox_timer_is_expired(luasandbox_timer_set * lts) {
 	return 0;
 }
@@ -64,29 +187,59 @@ ZEND_EXTERN_MODULE_GLOBALS(luasandbox);
 
 enum {
 	LUASANDBOX_TIMER_LIMITER,
-	LUASANDBOX_TIMER_PROFILER
+	LUASANDBOX_TIMER_PROFILER,
+	LUASANDBOX_TIMER_WALL
 };
 
-// Value 0 to 1. Lower means more reallocating, higher means slower lookup.
-#define TIMER_HASH_LOAD_FACTOR 0.75
-pthread_rwlock_t timer_hash_rwlock;
-luasandbox_timer **timer_hash;
-size_t timer_hash_entries, timer_hash_size;
-int timer_next_id = 1;
-
-static void luasandbox_timer_handle_event(union sigval sv);
+// The timer registry. Timers live in slots which are allocated in chunks and
+// never freed until module shutdown, so a timer pointer obtained from an ID
+// always points to valid memory, and the semaphore in it is always usable.
+// Free slots are kept on a list. An ID includes a generation number which
+// changes when the slot is allocated or freed, so a stale ID never matches a
+// reused slot. Lookups take the rwlock for reading, allocation and release
+// take it for writing.
+#define TIMER_CHUNK_SIZE 256
+#define TIMER_MAX_CHUNKS 4096
+#define TIMER_SLOT_NONE UINT32_MAX
+#define TIMER_GENERATION ((uint64_t)1 << 32)
+pthread_rwlock_t timer_registry_rwlock;
+luasandbox_timer * timer_chunks[TIMER_MAX_CHUNKS];
+uint32_t timer_slots_used;
+uint32_t timer_free_head;
+
+// The timer service. A single thread per process checks all timers, which
+// are kept in a min-heap ordered by the monotonic time of their next check.
+// A thread's CPU clock cannot advance faster than real time, so a timer with
+// r nanoseconds of CPU time remaining cannot expire within r nanoseconds of
+// real time. The service thread sleeps until the earliest such point, then
+// reads the CPU clock of the timer's thread, and either fires the timer or
+// requeues it for the CPU time still remaining.
+pthread_mutex_t timer_service_mutex;
+pthread_cond_t timer_service_cond;
+pthread_t timer_service_thread;
+pid_t timer_service_pid = 0;
+int timer_service_running = 0;
+int timer_service_stopping = 0;
+luasandbox_timer **timer_heap;
+size_t timer_heap_size, timer_heap_capacity;
+
+static void luasandbox_timer_handle_event(uint64_t id);
 static void luasandbox_timer_handle_profiler(luasandbox_timer * lt);
 static void luasandbox_timer_handle_limiter(luasandbox_timer * lt);
+static void luasandbox_timer_handle_wall(luasandbox_timer * lt);
 static luasandbox_timer * luasandbox_timer_create_one(
 		php_luasandbox_obj * sandbox, int type);
 static luasandbox_timer * luasandbox_timer_alloc();
-static luasandbox_timer * luasandbox_timer_lookup(int id);
+static luasandbox_timer * luasandbox_timer_lookup(uint64_t id);
 static void luasandbox_timer_free(luasandbox_timer *lt);
-static void luasandbox_timer_timeout_hook(lua_State *L, lua_Debug *ar);
 static void luasandbox_timer_profiler_hook(lua_State *L, lua_Debug *ar);
 static void luasandbox_timer_set_one_time(luasandbox_timer * lt, struct timespec * ts);
 static void luasandbox_timer_set_periodic(luasandbox_timer * lt, struct timespec * period);
 static void luasandbox_timer_stop_one(luasandbox_timer * lt, struct timespec * remaining);
+static int luasandbox_timer_lock(luasandbox_timer * lt);
+static void luasandbox_timer_arm(luasandbox_timer * lt, struct timespec * ts);
+static void luasandbox_timer_disarm(luasandbox_timer * lt, struct timespec * remaining);
+static int luasandbox_timer_is_due(luasandbox_timer * lt);
 static void luasandbox_update_usage(luasandbox_timer_set * lts);
 
 static inline void luasandbox_timer_zero(struct timespec * ts)
@@ -125,12 +278,12 @@ static inline void luasandbox_timer_add(
 // Note this function is not async-signal safe. If you need to call this from a
 // signal handler, you'll need to refactor the "Set a hook" part into a
 // separate function and call that from the signal handler instead.
-static void luasandbox_timer_handle_event(union sigval sv)
+static void luasandbox_timer_handle_event(uint64_t id)
 {
 	luasandbox_timer * lt;
 
 	while (1) {
-		lt = luasandbox_timer_lookup(sv.sival_int);
+		lt = luasandbox_timer_lookup(id);
 
 		if (!lt || !lt->sandbox) { // lt is invalid
 			return;
@@ -145,8 +298,15 @@ static void luasandbox_timer_handle_event(union sigval sv)
 		}
 	}
 
-	if (lt->type == LUASANDBOX_TIMER_PROFILER) {
+	// The timer may have been freed, and its slot reused, while we waited
+	if (luasandbox_timer_lookup(id) != lt || !lt->sandbox) {
+		// Do nothing
+	} else if (lt->type == LUASANDBOX_TIMER_PROFILER) {
 		luasandbox_timer_handle_profiler(lt);
+	} else if (!luasandbox_timer_is_due(lt)) {
+		// Stale event
+	} else if (lt->type == LUASANDBOX_TIMER_WALL) {
+		luasandbox_timer_handle_wall(lt);
 	} else {
 		luasandbox_timer_handle_limiter(lt);
 	}
@@ -174,7 +334,7 @@ static void luasandbox_timer_handle_profiler(luasandbox_timer * lt)
 		lua_State * L = sandbox->state;
 		lua_sethook(L, luasandbox_timer_profiler_hook,
 			LUA_MASKCOUNT | LUA_MASKCALL | LUA_MASKRET | LUA_MASKLINE, 1);
-		overrun = timer_getoverrun(sandbox->timer.profiler_timer->timer);
+		overrun = lt->overrun;
 		sandbox->timer.profiler_signal_count += overrun + 1;
 		sandbox->timer.overrun_count += overrun;
 
@@ -210,19 +370,13 @@ static void luasandbox_timer_handle_limiter(luasandbox_timer * lt)
 	}
 }
 
-static void luasandbox_timer_timeout_hook(lua_State *L, lua_Debug *ar)
+static void luasandbox_timer_handle_wall(luasandbox_timer * lt)
 {
-	// Avoid infinite recursion
-	lua_sethook(L, luasandbox_timer_timeout_hook, 0, 0);
-	// Do a longjmp to report the timeout error
-	luasandbox_timer_timeout_error(L);
-}
-
-void luasandbox_timer_timeout_error(lua_State *L)
-{
-	lua_pushstring(L, luasandbox_timeout_message);
-	luasandbox_wrap_fatal(L);
-	lua_error(L);
+	// Unlike the CPU limit, the wall clock limit keeps running while the
+	// timers are paused
+	lt->sandbox->timed_out = 1;
+	lua_sethook(lt->sandbox->state, luasandbox_timer_timeout_hook,
+		LUA_MASKCOUNT | LUA_MASKCALL | LUA_MASKRET | LUA_MASKLINE, 1);
 }
 
 static char * luasandbox_timer_get_cfunction_name(lua_State *L)
@@ -256,9 +410,8 @@ static char * luasandbox_timer_get_cfunction_name(lua_State *L)
 
 static void luasandbox_timer_profiler_hook(lua_State *L, lua_Debug *ar)
 {
-	lua_sethook(L, luasandbox_timer_profiler_hook, 0, 0);
-
 	php_luasandbox_obj * sandbox = luasandbox_get_php_obj(L);
+	luasandbox_timer_restore_hook(L, sandbox);
 	lua_Debug debug;
 	memset(&debug, 0, sizeof(debug));
 
@@ -272,41 +425,10 @@ static void luasandbox_timer_profiler_hook(lua_State *L, lua_Debug *ar)
 	if (ar->what[0] == 'C') {
 		name = luasandbox_timer_get_cfunction_name(L);
 	}
-	if (!name) {
-		if (ar->namewhat[0] != '\0') {
-			name = ar->name;
-		} else if (ar->what[0] == 'm') {
-			name = "[main chunk]";
-		}
-	}
-	size_t prof_name_size = strlen(ar->short_src)
-		+ sizeof(ar->linedefined) * 4 + sizeof("  <:>");
-	if (name) {
-		prof_name_size += strlen(name);
-	}
-
-	zend_string *zstr = zend_string_alloc(prof_name_size, 0);
-	char *prof_name = ZSTR_VAL(zstr);
-
-	if (!name) {
-		if (ar->linedefined > 0) {
-			snprintf(prof_name, prof_name_size, "<%s:%d>", ar->short_src, ar->linedefined);
-		} else {
-			strcpy(prof_name, "?");
-		}
-	} else {
-		if (ar->what[0] == 'm') {
-			snprintf(prof_name, prof_name_size, "%s <%s>", name, ar->short_src);
-		} else if (ar->linedefined > 0) {
-			snprintf(prof_name, prof_name_size, "%s <%s:%d>", name, ar->short_src, ar->linedefined);
-		} else {
-			snprintf(prof_name, prof_name_size, "%s", name);
-		}
-	}
+	zend_string *zstr = luasandbox_format_function_name(ar, name);
 
 	luasandbox_timer_set * lts = &sandbox->timer;
 	HashTable * ht = lts->function_counts;
-	ZSTR_LEN(zstr) = strlen(prof_name);
 	zval *elt = zend_hash_find(ht, zstr);
 	if (elt != NULL) {
 		ZVAL_LONG(elt, Z_LVAL_P(elt) + signal_count);
@@ -320,43 +442,355 @@ static void luasandbox_timer_profiler_hook(lua_State *L, lua_Debug *ar)
 	lts->total_count += signal_count;
 }
 
-void luasandbox_timer_minit()
+static inline int64_t luasandbox_timer_to_ns(const struct timespec * ts)
 {
-	timer_hash = NULL;
-	timer_hash_entries = 0;
-	timer_hash_size = 0;
+	return ts->tv_sec * INT64_C(1000000000) + ts->tv_nsec;
+}
 
-	if (pthread_rwlock_init(&timer_hash_rwlock, NULL) != 0) {
-		php_error_docref(NULL, E_ERROR,
-				"Unable to allocate timer rwlock: %s", strerror(errno));
+static inline void luasandbox_timer_from_ns(struct timespec * ts, int64_t ns)
+{
+	ts->tv_sec = ns / 1000000000;
+	ts->tv_nsec = ns % 1000000000;
+}
+
+/**
+ * Read a clock in nanoseconds, or return zero on failure.
+ */
+static inline int64_t luasandbox_timer_now(clockid_t clock_id)
+{
+	struct timespec ts;
+	if (clock_gettime(clock_id, &ts) != SUCCESS) {
+		return 0;
 	}
+	return luasandbox_timer_to_ns(&ts);
 }
 
-void luasandbox_timer_mshutdown()
+static void timer_heap_set(size_t i, luasandbox_timer * lt)
 {
-	int status;
+	timer_heap[i] = lt;
+	lt->heap_index = i;
+}
+
+static void timer_heap_sift_up(size_t i)
+{
+	luasandbox_timer * lt = timer_heap[i];
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (lt->wake >= timer_heap[parent]->wake) {
+			break;
+		}
+		timer_heap_set(i, timer_heap[parent]);
+		i = parent;
+	}
+	timer_heap_set(i, lt);
+}
+
+static void timer_heap_sift_down(size_t i)
+{
+	luasandbox_timer * lt = timer_heap[i];
+	while (1) {
+		size_t child = 2 * i + 1;
+		if (child >= timer_heap_size) {
+			break;
+		}
+		if (child + 1 < timer_heap_size
+			&& timer_heap[child + 1]->wake < timer_heap[child]->wake)
+		{
+			child++;
+		}
+		if (timer_heap[child]->wake >= lt->wake) {
+			break;
+		}
+		timer_heap_set(i, timer_heap[child]);
+		i = child;
+	}
+	timer_heap_set(i, lt);
+}
+
+// The service mutex must be held by the caller
+static void timer_heap_insert(luasandbox_timer * lt, int64_t wake)
+{
+	if (timer_heap_size == timer_heap_capacity) {
+		timer_heap_capacity = timer_heap_capacity ? timer_heap_capacity * 2 : 16;
+		timer_heap = (luasandbox_timer**)perealloc(timer_heap,
+			timer_heap_capacity * sizeof(*timer_heap), 1);
+	}
+	__atomic_store_n(&lt->wake, wake, __ATOMIC_SEQ_CST);
+	timer_heap[timer_heap_size] = lt;
+	timer_heap_sift_up(timer_heap_size++);
+	if (lt->heap_index == 0) {
+		// The earliest check moved forward, wake the service thread
+		pthread_cond_signal(&timer_service_cond);
+	}
+}
+
+// The service mutex must be held by the caller
+static void timer_heap_remove(luasandbox_timer * lt)
+{
+	luasandbox_timer * last;
 	size_t i;
 
-	status = pthread_rwlock_wrlock(&timer_hash_rwlock);
-	if (status != 0) {
-		// Some other error
-		php_error_docref(NULL, E_WARNING,
-				"Unable to acquire timer rwlock for writing, leaking timers: %s", strerror(errno));
+	if (lt->heap_index < 0) {
 		return;
 	}
+	i = lt->heap_index;
+	lt->heap_index = -1;
+	// Pairs with the expiry store in luasandbox_timer_arm(): once this is
+	// visible, an arming thread will requeue the timer itself.
+	__atomic_store_n(&lt->wake, 0, __ATOMIC_SEQ_CST);
+	last = timer_heap[--timer_heap_size];
+	if (last != lt) {
+		// Move the last element into the hole and restore the heap order
+		timer_heap_set(i, last);
+		timer_heap_sift_down(i);
+		timer_heap_sift_up(last->heap_index);
+	}
+}
 
-	if (timer_hash) {
-		for (i = 0; i < timer_hash_size; i++) {
-			if (timer_hash[i]) {
-				pefree(timer_hash[i], 1);
-			}
+/**
+ * Make sure the service thread checks the timer no later than the given
+ * monotonic time. The service mutex must be held by the caller.
+ */
+static void timer_heap_schedule(luasandbox_timer * lt, int64_t wake)
+{
+	if (lt->heap_index >= 0) {
+		if (lt->wake <= wake) {
+			return;
+		}
+		timer_heap_remove(lt);
+	}
+	timer_heap_insert(lt, wake);
+}
+
+/**
+ * Get the CPU time remaining on a timer, or zero if the timer is disarmed or
+ * has expired. This does not take the service mutex.
+ */
+static void luasandbox_timer_gettime(luasandbox_timer * lt, struct timespec * remaining)
+{
+	int64_t expiry = __atomic_load_n(&lt->expiry, __ATOMIC_SEQ_CST);
+	int64_t now;
+
+	luasandbox_timer_zero(remaining);
+	if (expiry) {
+		now = luasandbox_timer_now(lt->clock_id);
+		if (now && now < expiry) {
+			luasandbox_timer_from_ns(remaining, expiry - now);
+		}
+	}
+}
+
+/**
+ * Arm a timer with the given CPU time, or disarm it if value is zero, and
+ * update its place in the service heap.
+ */
+static void luasandbox_timer_settime(luasandbox_timer * lt,
+		struct timespec * value, struct timespec * interval)
+{
+	int64_t now;
+
+	pthread_mutex_lock(&timer_service_mutex);
+	timer_heap_remove(lt);
+	__atomic_store_n(&lt->expiry, 0, __ATOMIC_SEQ_CST);
+	lt->interval = *interval;
+	lt->overrun = 0;
+	if (!luasandbox_timer_is_zero(value)) {
+		now = luasandbox_timer_now(lt->clock_id);
+		if (now) {
+			__atomic_store_n(&lt->expiry, now + luasandbox_timer_to_ns(value),
+				__ATOMIC_SEQ_CST);
+			timer_heap_insert(lt, luasandbox_timer_now(CLOCK_MONOTONIC)
+				+ luasandbox_timer_to_ns(value));
 		}
-		pefree(timer_hash, 1);
 	}
+	pthread_mutex_unlock(&timer_service_mutex);
+}
+
+/**
+ * Check the timer at the top of the heap, which is due to be checked. If it
+ * has expired, return its ID so that the caller can run the event handler
+ * once the mutex is released, otherwise requeue it and return zero. A timer
+ * which was disarmed by luasandbox_timer_disarm() is dropped here. The
+ * service mutex must be held by the caller.
+ */
+static uint64_t luasandbox_timer_service_check(int64_t now)
+{
+	luasandbox_timer * lt = timer_heap[0];
+	int64_t expiry, cpu;
 
-	// Ideally when this is called no other threads are trying to use the mutex...
-	pthread_rwlock_unlock(&timer_hash_rwlock);
-	pthread_rwlock_destroy(&timer_hash_rwlock);
+	timer_heap_remove(lt);
+	expiry = __atomic_load_n(&lt->expiry, __ATOMIC_SEQ_CST);
+	if (!expiry) {
+		return 0;
+	}
+	cpu = luasandbox_timer_now(lt->clock_id);
+	if (!cpu) {
+		// The thread has gone away
+		__atomic_store_n(&lt->expiry, 0, __ATOMIC_SEQ_CST);
+		return 0;
+	}
+
+	if (cpu < expiry) {
+		// CPU time can't pass faster than real time, so the timer can't
+		// expire before the remaining CPU time has elapsed on the monotonic
+		// clock
+		timer_heap_insert(lt, now + expiry - cpu);
+		return 0;
+	} else if (luasandbox_timer_is_zero(&lt->interval)) {
+		if (!__atomic_compare_exchange_n(&lt->expiry, &expiry, 0,
+			0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		{
+			// Re-armed since we loaded it, look again on the next iteration
+			timer_heap_schedule(lt, now);
+			return 0;
+		}
+		return lt->id;
+	} else {
+		// Periodic timer: count the whole periods missed, and schedule the
+		// next expiry
+		int64_t period = luasandbox_timer_to_ns(&lt->interval);
+		int64_t late = cpu - expiry;
+		int64_t next = period - late % period;
+
+		lt->overrun = late / period;
+		__atomic_store_n(&lt->expiry, cpu + next, __ATOMIC_SEQ_CST);
+		timer_heap_insert(lt, now + next);
+		return lt->id;
+	}
+}
+
+static void * luasandbox_timer_service_main(void * arg)
+{
+	struct timespec wake;
+	sigset_t mask;
+	int64_t now;
+	uint64_t id;
+
+	// Signals are for the PHP threads, not for us
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	pthread_mutex_lock(&timer_service_mutex);
+	while (!timer_service_stopping) {
+		if (!timer_heap_size) {
+			pthread_cond_wait(&timer_service_cond, &timer_service_mutex);
+			continue;
+		}
+		now = luasandbox_timer_now(CLOCK_MONOTONIC);
+		if (now < timer_heap[0]->wake) {
+			luasandbox_timer_from_ns(&wake, timer_heap[0]->wake);
+			pthread_cond_timedwait(&timer_service_cond, &timer_service_mutex, &wake);
+			continue;
+		}
+		id = luasandbox_timer_service_check(now);
+		if (id) {
+			// The handler may re-arm the timer, so run it unlocked
+			pthread_mutex_unlock(&timer_service_mutex);
+			luasandbox_timer_handle_event(id);
+			pthread_mutex_lock(&timer_service_mutex);
+		}
+	}
+	pthread_mutex_unlock(&timer_service_mutex);
+	return NULL;
+}
+
+static void luasandbox_timer_service_init()
+{
+	pthread_condattr_t attr;
+
+	pthread_mutex_init(&timer_service_mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&timer_service_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	timer_service_running = 0;
+	timer_service_pid = getpid();
+}
+
+/**
+ * Start the service thread if it is not already running in this process.
+ */
+static int luasandbox_timer_service_start()
+{
+	int status, ok = 1;
+
+	if (timer_service_pid != getpid()) {
+		// We are in a child process, the thread did not survive the fork.
+		// Anything queued belongs to the parent.
+		size_t i;
+		for (i = 0; i < timer_heap_size; i++) {
+			timer_heap[i]->heap_index = -1;
+			timer_heap[i]->wake = 0;
+		}
+		timer_heap_size = 0;
+		luasandbox_timer_service_init();
+	}
+
+	pthread_mutex_lock(&timer_service_mutex);
+	if (!timer_service_running) {
+		timer_service_stopping = 0;
+		status = pthread_create(&timer_service_thread, NULL,
+			luasandbox_timer_service_main, NULL);
+		if (status != SUCCESS) {
+			php_error_docref(NULL, E_WARNING,
+				"Unable to start timer thread: %s", strerror(status));
+			ok = 0;
+		} else {
+			timer_service_running = 1;
+		}
+	}
+	pthread_mutex_unlock(&timer_service_mutex);
+	return ok;
+}
+
+void luasandbox_timer_minit()
+{
+	memset(timer_chunks, 0, sizeof(timer_chunks));
+	timer_slots_used = 0;
+	timer_free_head = TIMER_SLOT_NONE;
+
+	if (pthread_rwlock_init(&timer_registry_rwlock, NULL) != 0) {
+		php_error_docref(NULL, E_ERROR,
+				"Unable to allocate timer rwlock: %s", strerror(errno));
+	}
+
+	timer_heap = NULL;
+	timer_heap_size = timer_heap_capacity = 0;
+	luasandbox_timer_service_init();
+}
+
+void luasandbox_timer_mshutdown()
+{
+	size_t i, j;
+
+	if (timer_service_running && timer_service_pid == getpid()) {
+		pthread_mutex_lock(&timer_service_mutex);
+		timer_service_stopping = 1;
+		pthread_cond_signal(&timer_service_cond);
+		pthread_mutex_unlock(&timer_service_mutex);
+		pthread_join(timer_service_thread, NULL);
+		timer_service_running = 0;
+	}
+	if (timer_heap) {
+		pefree(timer_heap, 1);
+		timer_heap = NULL;
+	}
+	timer_heap_size = timer_heap_capacity = 0;
+	pthread_cond_destroy(&timer_service_cond);
+	pthread_mutex_destroy(&timer_service_mutex);
+
+	// Ideally when this is called no other threads are using timers...
+	for (i = 0; i < TIMER_MAX_CHUNKS; i++) {
+		if (!timer_chunks[i]) {
+			continue;
+		}
+		for (j = 0; j < TIMER_CHUNK_SIZE; j++) {
+			sem_destroy(&timer_chunks[i][j].semaphore);
+		}
+		pefree(timer_chunks[i], 1);
+		timer_chunks[i] = NULL;
+	}
+	pthread_rwlock_destroy(&timer_registry_rwlock);
 }
 
 int luasandbox_timer_enable_profiler(luasandbox_timer_set * lts, struct timespec * period)
@@ -397,9 +831,16 @@ void luasandbox_timer_create(luasandbox_timer_set * lts, php_luasandbox_obj * sa
 	luasandbox_timer_zero(&lts->pause_delta);
 	luasandbox_timer_zero(&lts->limiter_expired_at);
 	luasandbox_timer_zero(&lts->profiler_period);
+	luasandbox_timer_zero(&lts->wall_limit);
+	luasandbox_timer_zero(&lts->wall_remaining);
+	luasandbox_timer_zero(&lts->wall_usage);
 	lts->is_running = 0;
 	lts->limiter_running = 0;
 	lts->profiler_running = 0;
+	lts->wall_running = 0;
+	lts->limiter_timer = NULL;
+	lts->profiler_timer = NULL;
+	lts->wall_timer = NULL;
 	lts->sandbox = sandbox;
 }
 
@@ -423,6 +864,25 @@ void luasandbox_timer_set_limit(luasandbox_timer_set * lts,
 	}
 }
 
+void luasandbox_timer_set_wall_limit(luasandbox_timer_set * lts,
+		struct timespec * timeout)
+{
+	int was_running = 0;
+	int was_paused = luasandbox_timer_is_paused(lts);
+	if (lts->is_running) {
+		was_running = 1;
+		luasandbox_timer_stop(lts);
+	}
+	lts->wall_remaining = lts->wall_limit = *timeout;
+
+	if (was_running) {
+		luasandbox_timer_start(lts);
+	}
+	if (was_paused) {
+		luasandbox_timer_pause(lts);
+	}
+}
+
 int luasandbox_timer_start(luasandbox_timer_set * lts)
 {
 	if (lts->is_running) {
@@ -433,60 +893,89 @@ int luasandbox_timer_start(luasandbox_timer_set * lts)
 	// Initialise usage timer
 	clock_gettime(LUASANDBOX_CLOCK_ID, &lts->usage_start);
 
-	// Create limiter timer if requested
+	// Arm the limiter timer if requested. The timer is created on first use
+	// and then kept for the lifetime of the sandbox. Arming and disarming it
+	// normally only touch the timer itself, not the shared service heap.
 	if (!luasandbox_timer_is_zero(&lts->limiter_remaining)) {
-		luasandbox_timer * timer = luasandbox_timer_create_one(
-			lts->sandbox, LUASANDBOX_TIMER_LIMITER);
+		luasandbox_timer * timer = lts->limiter_timer;
+
+		// The timer measures the CPU clock of the thread that created it, so a
+		// persistent sandbox picked up by another thread needs a new one.
+		if (timer && !pthread_equal(timer->thread, pthread_self())) {
+			luasandbox_timer_stop_one(timer, NULL);
+			lts->limiter_timer = timer = NULL;
+		}
 		if (!timer) {
-			lts->limiter_running = 0;
-			return 0;
+			timer = luasandbox_timer_create_one(
+				lts->sandbox, LUASANDBOX_TIMER_LIMITER);
+			if (!timer) {
+				lts->limiter_running = 0;
+				lts->is_running = 0;
+				return 0;
+			}
+			lts->limiter_timer = timer;
 		}
-		lts->limiter_timer = timer;
 		lts->limiter_running = 1;
-		luasandbox_timer_set_one_time(timer, &lts->limiter_remaining);
+		luasandbox_timer_arm(timer, &lts->limiter_remaining);
 	} else {
 		lts->limiter_running = 0;
 	}
+
+	// Likewise the wall clock limit timer. It uses the monotonic clock, so it
+	// can be kept when the sandbox moves to another thread.
+	clock_gettime(CLOCK_MONOTONIC, &lts->wall_usage_start);
+	if (!luasandbox_timer_is_zero(&lts->wall_remaining)) {
+		if (!lts->wall_timer) {
+			lts->wall_timer = luasandbox_timer_create_one(
+				lts->sandbox, LUASANDBOX_TIMER_WALL);
+			if (!lts->wall_timer) {
+				// Undo the limiter, so that the timers are left stopped
+				if (lts->limiter_running) {
+					luasandbox_timer_disarm(lts->limiter_timer, &lts->limiter_remaining);
+					lts->limiter_running = 0;
+				}
+				lts->wall_running = 0;
+				lts->is_running = 0;
+				return 0;
+			}
+		}
+		lts->wall_running = 1;
+		luasandbox_timer_arm(lts->wall_timer, &lts->wall_remaining);
+	} else {
+		lts->wall_running = 0;
+	}
 	return 1;
 }
 
 static luasandbox_timer * luasandbox_timer_create_one(
 		php_luasandbox_obj * sandbox, int type)
 {
-	struct sigevent ev;
-	luasandbox_timer * lt = luasandbox_timer_alloc();
-	if (!lt) {
+	luasandbox_timer * lt;
+
+	if (!luasandbox_timer_service_start()) {
 		return NULL;
 	}
-
-	// Make valgrind happy
-	memset(&ev, 0, sizeof(ev));
-
-	if (sem_init(&lt->semaphore, 0, 1) != 0) {
-		php_error_docref(NULL, E_WARNING,
-			"Unable to create semaphore: %s", strerror(errno));
-		luasandbox_timer_free(lt);
+	lt = luasandbox_timer_alloc();
+	if (!lt) {
 		return NULL;
 	}
-	ev.sigev_notify = SIGEV_THREAD;
-	ev.sigev_notify_function = luasandbox_timer_handle_event;
+
 	lt->type = type;
 	lt->sandbox = sandbox;
-	ev.sigev_value.sival_int = lt->id;
-
-	if (pthread_getcpuclockid(pthread_self(), &lt->clock_id) != 0) {
+	lt->thread = pthread_self();
+	lt->armed = 0;
+	lt->expiry = 0;
+	lt->wake = 0;
+	lt->heap_index = -1;
+
+	if (type == LUASANDBOX_TIMER_WALL) {
+		lt->clock_id = CLOCK_MONOTONIC;
+	} else if (pthread_getcpuclockid(pthread_self(), &lt->clock_id) != 0) {
 		php_error_docref(NULL, E_WARNING,
 			"Unable to get thread clock ID: %s", strerror(errno));
 		luasandbox_timer_free(lt);
 		return NULL;
 	}
-
-	if (timer_create(lt->clock_id, &ev, &lt->timer) != 0) {
-		php_error_docref(NULL, E_WARNING,
-			"Unable to create timer: %s", strerror(errno));
-		luasandbox_timer_free(lt);
-		return NULL;
-	}
 	return lt;
 }
 
@@ -496,14 +985,12 @@ static luasandbox_timer * luasandbox_timer_create_one(
  */
 static void luasandbox_timer_set_one_time(luasandbox_timer * lt, struct timespec * ts)
 {
-	struct itimerspec its;
-	luasandbox_timer_zero(&its.it_interval);
-	its.it_value = *ts;
-	if (luasandbox_timer_is_zero(&its.it_value)) {
+	struct timespec value = *ts, interval = {0, 0};
+	if (luasandbox_timer_is_zero(&value)) {
 		// Sanity check: make sure there is at least 1 nanosecond on the timer.
-		its.it_value.tv_nsec = 1;
+		value.tv_nsec = 1;
 	}
-	timer_settime(lt->timer, 0, &its, NULL);
+	luasandbox_timer_settime(lt, &value, &interval);
 }
 
 /**
@@ -511,13 +998,7 @@ static void luasandbox_timer_set_one_time(luasandbox_timer * lt, struct timespec
  */
 static void luasandbox_timer_set_periodic(luasandbox_timer * lt, struct timespec * period)
 {
-	struct itimerspec its;
-	its.it_interval = *period;
-	its.it_value = *period;
-	if (timer_settime(lt->timer, 0, &its, NULL) != SUCCESS) {
-		php_error_docref(NULL, E_WARNING,
-			"timer_settime(): %s", strerror(errno));
-	}
+	luasandbox_timer_settime(lt, period, period);
 }
 
 void luasandbox_timer_stop(luasandbox_timer_set * lts)
@@ -537,11 +1018,20 @@ void luasandbox_timer_stop(luasandbox_timer_set * lts)
 
 	// Stop the limiter and save the time remaining
 	if (lts->limiter_running) {
-		luasandbox_timer_stop_one(lts->limiter_timer, &lts->limiter_remaining);
+		luasandbox_timer_disarm(lts->limiter_timer, &lts->limiter_remaining);
 		lts->limiter_running = 0;
 		luasandbox_timer_add(&lts->limiter_remaining, &delta);
 	}
 
+	// Stop the wall clock limiter, and update the wall clock usage
+	if (lts->wall_running) {
+		luasandbox_timer_disarm(lts->wall_timer, &lts->wall_remaining);
+		lts->wall_running = 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &usage);
+	luasandbox_timer_subtract(&usage, &lts->wall_usage_start);
+	luasandbox_timer_add(&lts->wall_usage, &usage);
+
 	// Update the usage
 	luasandbox_update_usage(lts);
 	clock_gettime(LUASANDBOX_CLOCK_ID, &usage);
@@ -553,175 +1043,224 @@ void luasandbox_timer_stop(luasandbox_timer_set * lts)
 static void luasandbox_timer_stop_one(luasandbox_timer * lt, struct timespec * remaining)
 {
 	static struct timespec zero = {0, 0};
-	struct itimerspec its;
-	timer_gettime(lt->timer, &its);
 	if (remaining) {
-		*remaining = its.it_value;
+		luasandbox_timer_gettime(lt, remaining);
 	}
+	luasandbox_timer_settime(lt, &zero, &zero);
 
-	its.it_value = zero;
-	its.it_interval = zero;
-	if (timer_settime(lt->timer, 0, &its, NULL) != SUCCESS) {
-		php_error_docref(NULL, E_WARNING,
-			"timer_settime(): %s", strerror(errno));
+	// Invalidate the callback structure. If the timer event handler is
+	// running, wait for it to finish before returning to the caller, since it
+	// may be using the sandbox.
+	lt->sandbox = NULL;
+	if (luasandbox_timer_lock(lt)) {
+		sem_post(&lt->semaphore);
 	}
+	luasandbox_timer_free(lt);
+}
 
-	// Invalidate the callback structure, delete the timer
-	lt->sandbox = NULL;
-	// If the timer event handler is running, wait for it to finish
-	// before returning to the caller, otherwise the timer event handler
-	// may find itself with a dangling pointer in its local scope.
-	while (1) {
-		if (sem_wait(&lt->semaphore) == SUCCESS) {
-			sem_destroy(&lt->semaphore);
-			break;
-		}
+/**
+ * Acquire the timer semaphore, excluding the event handler.
+ */
+static int luasandbox_timer_lock(luasandbox_timer * lt)
+{
+	while (sem_wait(&lt->semaphore) != SUCCESS) {
 		if (errno != EINTR) {
 			php_error_docref(NULL, E_WARNING,
 				"sem_wait(): %s", strerror(errno));
-			break;
+			return 0;
 		}
 	}
-	if (timer_delete(lt->timer) != SUCCESS) {
-		php_error_docref(NULL, E_WARNING,
-			"timer_delete(): %s", strerror(errno));
+	return 1;
+}
+
+/**
+ * Arm a reusable limiter timer for the current call. The service mutex is
+ * only taken if the service thread would otherwise check the timer too late,
+ * which for a timer that was disarmed after a call and is armed again with
+ * the time remaining is normally not the case.
+ */
+static void luasandbox_timer_arm(luasandbox_timer * lt, struct timespec * ts)
+{
+	int64_t value = luasandbox_timer_to_ns(ts), now, wake, queued;
+	int locked = luasandbox_timer_lock(lt);
+
+	if (value <= 0) {
+		// Sanity check: make sure there is at least 1 nanosecond on the timer.
+		value = 1;
+	}
+	lt->armed = 1;
+	now = luasandbox_timer_now(lt->clock_id);
+	if (now) {
+		__atomic_store_n(&lt->expiry, now + value, __ATOMIC_SEQ_CST);
+		wake = luasandbox_timer_now(CLOCK_MONOTONIC) + value;
+		// If the timer is still queued, the service thread has not loaded the
+		// expiry yet, and it will requeue the timer according to the new one.
+		queued = __atomic_load_n(&lt->wake, __ATOMIC_SEQ_CST);
+		if (!queued || queued > wake) {
+			pthread_mutex_lock(&timer_service_mutex);
+			timer_heap_schedule(lt, wake);
+			pthread_mutex_unlock(&timer_service_mutex);
+		}
+	}
+	if (locked) {
+		sem_post(&lt->semaphore);
+	}
+}
+
+/**
+ * Disarm a reusable limiter timer and save the time remaining. Unlike
+ * luasandbox_timer_stop_one(), the timer is kept so that the next call can
+ * arm it again. The timer is left in the service heap, and is dropped or
+ * requeued when the service thread next looks at it, so this does not take
+ * the service mutex.
+ */
+static void luasandbox_timer_disarm(luasandbox_timer * lt, struct timespec * remaining)
+{
+	int locked = luasandbox_timer_lock(lt);
+	int64_t expiry = __atomic_exchange_n(&lt->expiry, 0, __ATOMIC_SEQ_CST);
+	int64_t now;
+
+	luasandbox_timer_zero(remaining);
+	if (expiry) {
+		now = luasandbox_timer_now(lt->clock_id);
+		if (now && now < expiry) {
+			luasandbox_timer_from_ns(remaining, expiry - now);
+		}
+	}
+	lt->armed = 0;
+	if (locked) {
+		sem_post(&lt->semaphore);
 	}
-	luasandbox_timer_free(lt);
 }
 
-static inline int hash_for_id(int id)
+/**
+ * Since the limiter timer is reused, an expiry notification may be delivered
+ * after the call it was armed for has finished, possibly after the timer was
+ * armed again for a later call. Check that the timer really is armed and has
+ * run out. Must be called with the semaphore held.
+ */
+static int luasandbox_timer_is_due(luasandbox_timer * lt)
 {
-	return id * 131071;
+	struct timespec remaining;
+
+	if (!lt->armed) {
+		return 0;
+	}
+	luasandbox_timer_gettime(lt, &remaining);
+	return luasandbox_timer_is_zero(&remaining);
 }
 
-// Don't call this directly, use luasandbox_timer_alloc()
-static void timer_hash_insert(luasandbox_timer *lt)
+// The registry rwlock must be held by the caller
+static inline luasandbox_timer * timer_slot(uint32_t slot)
 {
-	off_t i;
+	luasandbox_timer * chunk = timer_chunks[slot / TIMER_CHUNK_SIZE];
+	return chunk ? chunk + slot % TIMER_CHUNK_SIZE : NULL;
+}
 
-	for (i = hash_for_id(lt->id) % timer_hash_size; timer_hash[i]; i = (i + 1) % timer_hash_size);
-	timer_hash[i] = lt;
+/**
+ * Take a never-used slot from the end of the registry, allocating a new
+ * chunk if necessary. The registry rwlock must be held for writing.
+ */
+static luasandbox_timer * luasandbox_timer_alloc_new_slot()
+{
+	uint32_t slot, i;
+	size_t chunk_index;
+	luasandbox_timer * chunk;
+
+	slot = timer_slots_used;
+	chunk_index = slot / TIMER_CHUNK_SIZE;
+	if (chunk_index >= TIMER_MAX_CHUNKS) {
+		php_error_docref(NULL, E_WARNING, "Too many timers");
+		return NULL;
+	}
+
+	if (!timer_chunks[chunk_index]) {
+		chunk = (luasandbox_timer*)pecalloc(TIMER_CHUNK_SIZE, sizeof(*chunk), 1);
+		for (i = 0; i < TIMER_CHUNK_SIZE; i++) {
+			chunk[i].id = chunk_index * TIMER_CHUNK_SIZE + i;
+			chunk[i].heap_index = -1;
+			if (sem_init(&chunk[i].semaphore, 0, 1) != 0) {
+				php_error_docref(NULL, E_WARNING,
+					"Unable to create semaphore: %s", strerror(errno));
+				while (i--) {
+					sem_destroy(&chunk[i].semaphore);
+				}
+				pefree(chunk, 1);
+				return NULL;
+			}
+		}
+		timer_chunks[chunk_index] = chunk;
+	}
+	timer_slots_used++;
+	return timer_slot(slot);
 }
 
 static luasandbox_timer * luasandbox_timer_alloc()
 {
-	int status;
-	size_t old_hash_size;
-	off_t i;
 	luasandbox_timer *lt;
-	luasandbox_timer **old_hash;
+	int status;
 
-	status = pthread_rwlock_wrlock(&timer_hash_rwlock);
+	status = pthread_rwlock_wrlock(&timer_registry_rwlock);
 	if (status != SUCCESS) {
-		// Some other error
 		php_error_docref(NULL, E_WARNING,
-				"Unable to acquire timer rwlock for writing: %s", strerror(errno));
+				"Unable to acquire timer rwlock for writing: %s", strerror(status));
 		return NULL;
 	}
 
-	// Allocate the timer and set its id
-	lt = (luasandbox_timer*)pecalloc(1, sizeof(*lt), 1);
-	lt->id = timer_next_id;
-	if (++timer_next_id < 0) {
-		timer_next_id = 1;
+	if (timer_free_head == TIMER_SLOT_NONE) {
+		lt = luasandbox_timer_alloc_new_slot();
+	} else {
+		lt = timer_slot(timer_free_head);
+		timer_free_head = lt->next_free;
 	}
-
-	// Is it time to increase the hash table size?
-	timer_hash_entries++;
-	if (timer_hash_entries >= timer_hash_size * TIMER_HASH_LOAD_FACTOR) {
-		old_hash = timer_hash;
-		old_hash_size = timer_hash_size;
-		if (timer_hash_size == 0) {
-			timer_hash_size = 10;
-		} else {
-			timer_hash_size = timer_hash_size * 2;
-		}
-		timer_hash = (luasandbox_timer**)pecalloc(timer_hash_size, sizeof(*timer_hash), 1);
-		for (i = 0; i < old_hash_size; i++) {
-			if (old_hash[i]) {
-				timer_hash_insert(old_hash[i]);
-			}
-		}
+	if (lt) {
+		// Start a new generation so that the new ID is unique
+		lt->id += TIMER_GENERATION;
 	}
 
-	// Insert the new timer into the hash table
-	timer_hash_insert(lt);
-
-	pthread_rwlock_unlock(&timer_hash_rwlock);
+	pthread_rwlock_unlock(&timer_registry_rwlock);
 	return lt;
 }
 
-static luasandbox_timer *luasandbox_timer_lookup(int id)
+static luasandbox_timer *luasandbox_timer_lookup(uint64_t id)
 {
-	off_t i;
-	int status;
+	luasandbox_timer * lt;
 
-	if ( id <= 0 ) {
+	if (id < TIMER_GENERATION || (uint32_t)id >= TIMER_MAX_CHUNKS * TIMER_CHUNK_SIZE) {
 		return NULL;
 	}
 
-	status = pthread_rwlock_rdlock(&timer_hash_rwlock);
-	if (status != SUCCESS) {
-		// Some other error
-		php_error_docref(NULL, E_WARNING,
-				"Unable to acquire timer rwlock for reading: %s", strerror(errno));
+	// This is called from the service thread, so don't raise PHP errors
+	if (pthread_rwlock_rdlock(&timer_registry_rwlock) != SUCCESS) {
 		return NULL;
 	}
-
-	for (i = hash_for_id(id) % timer_hash_size; timer_hash[i]; i = (i + 1) % timer_hash_size) {
-		if (timer_hash[i]->id == id) {
-			pthread_rwlock_unlock(&timer_hash_rwlock);
-			return timer_hash[i];
-		}
+	lt = timer_slot((uint32_t)id);
+	if (lt && lt->id != id) {
+		lt = NULL;
 	}
-
-	pthread_rwlock_unlock(&timer_hash_rwlock);
-	return NULL;
+	pthread_rwlock_unlock(&timer_registry_rwlock);
+	return lt;
 }
 
 static void luasandbox_timer_free(luasandbox_timer *lt)
 {
-	int id;
-	off_t cur, remove = -1, wanted;
 	int status;
 
-	id = lt->id;
-	lt->id = 0;
-
-	status = pthread_rwlock_wrlock(&timer_hash_rwlock);
+	status = pthread_rwlock_wrlock(&timer_registry_rwlock);
 	if (status != SUCCESS) {
-		// Some other error
 		php_error_docref(NULL, E_WARNING,
-				"Unable to acquire timer semaphore: %s", strerror(errno));
+				"Unable to acquire timer rwlock for writing, leaking timer: %s",
+				strerror(status));
 		return;
 	}
 
-	// Find the location of this timer in the hash, then move any applicable
-	// timers after it over it.
-	for (cur = hash_for_id(id) % timer_hash_size; timer_hash[cur]; cur = (cur + 1) % timer_hash_size) {
-		if (timer_hash[cur] == lt) {
-			// Found it! Start moving subsequent items in the cluster
-			remove = cur;
-		} else if (remove >= 0) {
-			// Moving! The plan is to end the current cluster at 'remove', so
-			// if the current element should live at or before 'remove'
-			// (keeping wraparound in mind) move it there and remove this one
-			// instead.
-			wanted = hash_for_id(timer_hash[cur]->id) % timer_hash_size;
-			if ( (remove <= cur) ? (wanted <= remove || wanted > cur) : (wanted <= remove && wanted > cur) ) {
-				timer_hash[remove] = timer_hash[cur];
-				remove = cur;
-			}
-		}
-	}
-	if (remove >= 0) {
-		timer_hash[remove] = NULL;
-		timer_hash_entries--;
-	}
-
-	pefree(lt, 1);
+	// Invalidate the ID, so that lookups of it fail from now on, and put the
+	// slot on the free list
+	lt->id += TIMER_GENERATION;
+	lt->next_free = timer_free_head;
+	timer_free_head = (uint32_t)lt->id;
 
-	pthread_rwlock_unlock(&timer_hash_rwlock);
+	pthread_rwlock_unlock(&timer_registry_rwlock);
 }
 
 void luasandbox_timer_get_usage(luasandbox_timer_set * lts, struct timespec * ts)
@@ -790,6 +1329,18 @@ int luasandbox_timer_is_paused(luasandbox_timer_set * lts) {
 	return !luasandbox_timer_is_zero(&lts->pause_start);
 }
 
+void luasandbox_timer_get_wall_usage(luasandbox_timer_set * lts, struct timespec * ts)
+{
+	struct timespec now;
+
+	*ts = lts->wall_usage;
+	if (lts->is_running) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		luasandbox_timer_subtract(&now, &lts->wall_usage_start);
+		luasandbox_timer_add(ts, &now);
+	}
+}
+
 int luasandbox_timer_is_expired(luasandbox_timer_set * lts)
 {
 	if (!luasandbox_timer_is_zero(&lts->limiter_limit)) {
@@ -797,6 +1348,11 @@ int luasandbox_timer_is_expired(luasandbox_timer_set * lts)
 			return 1;
 		}
 	}
+	if (!luasandbox_timer_is_zero(&lts->wall_limit)) {
+		if (luasandbox_timer_is_zero(&lts->wall_remaining)) {
+			return 1;
+		}
+	}
 	return 0;
 }
 
@@ -813,6 +1369,14 @@ static void luasandbox_update_usage(luasandbox_timer_set * lts)
 void luasandbox_timer_destroy(luasandbox_timer_set * lts)
 {
 	luasandbox_timer_stop(lts);
+	if (lts->limiter_timer) {
+		luasandbox_timer_stop_one(lts->limiter_timer, NULL);
+		lts->limiter_timer = NULL;
+	}
+	if (lts->wall_timer) {
+		luasandbox_timer_stop_one(lts->wall_timer, NULL);
+		lts->wall_timer = NULL;
+	}
 	if (lts->profiler_running) {
 		luasandbox_timer_stop_one(lts->profiler_timer, NULL);
 		lts->profiler_running = 0;
@@ -824,4 +1388,22 @@ void luasandbox_timer_destroy(luasandbox_timer_set * lts)
 	}
 }
 
+/**
+ * Stop all timers and clear the usage and profiler data, keeping the
+ * configured CPU and wall clock limits.
+ */
+void luasandbox_timer_reset(luasandbox_timer_set * lts)
+{
+	struct timespec limit = lts->limiter_limit;
+	struct timespec wall_limit = lts->wall_limit;
+
+	luasandbox_timer_destroy(lts);
+	luasandbox_timer_create(lts, lts->sandbox);
+	lts->total_count = 0;
+	lts->overrun_count = 0;
+	lts->profiler_signal_count = 0;
+	lts->limiter_remaining = lts->limiter_limit = limit;
+	lts->wall_remaining = lts->wall_limit = wall_limit;
+}
+
 #endif